@@ -0,0 +1,641 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "clock.h"
+#include "proto.h"
+
+/* wgg-bench opens many connections to a wordsrv and drives them with bots
+ * that speak the same text protocol as a person using nc -C: they answer
+ * the name prompt, wait for "Your guess?" and guess letters until the game
+ * is over. It reports how fast connections were set up, how many guesses
+ * and games the server got through, and the time from sending a guess to
+ * receiving the first line back.
+ *
+ * Unless churning, all bots first connect and join (the ramp), and the
+ * measurement window starts once they are all in. In churn mode every bot
+ * disconnects as soon as it has joined a game and connects again, so the
+ * handshake is measured instead of play.
+ *
+ * With -B the bots use the binary protocol of proto.h instead of text.
+ */
+
+#ifndef PORT
+    #define PORT 58474
+#endif
+#define MAX_EVENTS 256
+#define BOT_BUF 4096
+#define MAX_RAMP_US 60000000LL
+
+enum bot_state {
+    BOT_IDLE,                 // Not connected
+    BOT_CONNECTING,
+    BOT_NAMING,               // Name sent, waiting to be let in
+    BOT_PLAYING,
+};
+
+struct bot {
+    int id;
+    int fd;
+    enum bot_state state;
+    int gen;                  // Connections made so far, to keep names unique
+    long long started_us;     // When the current connection was started
+    long long sent_us;        // When the pending guess was sent, or 0
+    long long due_us;         // When to send the next guess, or 0
+    int last_guesser;         // 1 if the next game over was caused by us
+    char letters[26];         // Guess order for the current game
+    int next_letter;
+    uint64_t rng;
+    int synced;               // Binary mode: 1 once PROTO_MAGIC was seen
+    char inbuf[BOT_BUF];
+    int in_len;
+};
+
+/* What a bot makes of a message from the server, in either protocol. */
+enum reply {
+    R_OTHER,
+    R_BAD_NAME,
+    R_PROMPT,                 // It is this bot's turn
+    R_TURN,                   // It is someone else's turn
+    R_GAME_OVER,
+    R_NEW_GAME,
+};
+
+/* A growable array of latency samples in microseconds. */
+struct samples {
+    uint32_t *v;
+    size_t len;
+    size_t cap;
+};
+
+struct sockaddr_in server;
+int epfd;
+int churn = 0;
+int binary = 0;
+int think_ms = 0;
+int max_connecting = 4;       // Connects in flight at once; more than the
+                              // server's listen backlog just get dropped
+int num_connecting = 0;
+int num_playing = 0;
+
+long long connects = 0;       // Connections that reached the game
+long long guesses = 0;
+long long games = 0;
+long long errors = 0;
+struct samples guess_lat;
+struct samples join_lat;
+
+
+void add_sample(struct samples *s, long long us) {
+    if(s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(uint32_t));
+        if(s->v == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->len++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+
+int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/* Print the percentiles of s on one line.
+ */
+void print_percentiles(const char *label, struct samples *s) {
+    if(s->len == 0) {
+        printf("  %-14s no samples\n", label);
+        return;
+    }
+    qsort(s->v, s->len, sizeof(uint32_t), cmp_u32);
+    double pct[] = {50, 90, 99, 99.9};
+    printf("  %-14s", label);
+    for(int i = 0; i < 4; i++) {
+        size_t k = (size_t)(pct[i] / 100 * (s->len - 1) + 0.5);
+        printf(" p%g %u", pct[i], s->v[k]);
+    }
+    printf(" max %u us (n=%zu)\n", s->v[s->len - 1], s->len);
+}
+
+
+uint64_t next_rand(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/* Pick a fresh order in which b guesses letters.
+ */
+void shuffle_letters(struct bot *b) {
+    for(int i = 0; i < 26; i++) {
+        b->letters[i] = 'a' + i;
+    }
+    for(int i = 25; i > 0; i--) {
+        int j = next_rand(&b->rng) % (i + 1);
+        char t = b->letters[i];
+        b->letters[i] = b->letters[j];
+        b->letters[j] = t;
+    }
+    b->next_letter = 0;
+}
+
+
+/* Start a non-blocking connection for b.
+ */
+void start_connect(struct bot *b) {
+    b->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(b->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    // close with a reset, so a churning bot does not pile up TIME_WAIT
+    // sockets and run out of local ports
+    struct linger lg = {1, 0};
+    setsockopt(b->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    b->state = BOT_CONNECTING;
+    b->started_us = now_us();
+    b->in_len = 0;
+    b->sent_us = 0;
+    b->due_us = 0;
+    b->last_guesser = 0;
+    b->synced = 0;
+    b->gen++;
+    shuffle_letters(b);
+    num_connecting++;
+
+    if(connect(b->fd, (struct sockaddr *)&server, sizeof(server)) < 0
+       && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = b;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+
+void close_bot(struct bot *b) {
+    if(b->state == BOT_CONNECTING) {
+        num_connecting--;
+    }
+    if(b->state == BOT_PLAYING) {
+        num_playing--;
+    }
+    close(b->fd);
+    b->fd = -1;
+    b->state = BOT_IDLE;
+}
+
+
+/* Write len bytes of data to b's socket. The messages are short and the
+ * server reads them promptly, so a full socket is treated as an error.
+ */
+int send_bytes(struct bot *b, const void *data, int len) {
+    if(write(b->fd, data, len) != len) {
+        errors++;
+        close_bot(b);
+        return -1;
+    }
+    return 0;
+}
+
+
+int send_line(struct bot *b, const char *line) {
+    return send_bytes(b, line, strlen(line));
+}
+
+
+void send_guess(struct bot *b) {
+    if(b->next_letter == 26) {
+        shuffle_letters(b);
+    }
+    char letter = b->letters[b->next_letter++];
+    char line[4] = {letter, '\r', '\n', '\0'};
+    b->due_us = 0;
+    int sent;
+    if(binary) {
+        struct frame f;
+        frame_begin(&f, OP_GUESS);
+        frame_u8(&f, letter);
+        sent = send_bytes(b, f.data, f.len);
+    }
+    else {
+        sent = send_line(b, line);
+    }
+    if(sent == 0) {
+        b->sent_us = now_us();
+        b->last_guesser = 1;
+        guesses++;
+    }
+}
+
+
+/* React to one message from the server.
+ */
+void handle_reply(struct bot *b, enum reply r) {
+    if(b->sent_us != 0) {
+        add_sample(&guess_lat, now_us() - b->sent_us);
+        b->sent_us = 0;
+    }
+
+    if(b->state == BOT_NAMING) {
+        if(r == R_BAD_NAME) {
+            errors++;
+            close_bot(b);
+            return;
+        }
+        add_sample(&join_lat, now_us() - b->started_us);
+        connects++;
+        if(churn) {
+            close_bot(b);
+            return;
+        }
+        b->state = BOT_PLAYING;
+        num_playing++;
+    }
+
+    if(r == R_PROMPT) {
+        b->last_guesser = 0;
+        if(think_ms > 0) {
+            b->due_us = now_us() + think_ms * 1000LL;
+        }
+        else {
+            send_guess(b);
+        }
+    }
+    else if(r == R_TURN) {
+        b->last_guesser = 0;
+    }
+    else if(r == R_GAME_OVER) {
+        if(b->last_guesser) {
+            games++;
+        }
+        b->last_guesser = 0;
+    }
+    else if(r == R_NEW_GAME) {
+        shuffle_letters(b);
+    }
+}
+
+
+/* React to one line of text from the server.
+ */
+void handle_line(struct bot *b, const char *line) {
+    enum reply r = R_OTHER;
+    if(strncmp(line, "Unacceptable name", 17) == 0) {
+        r = R_BAD_NAME;
+    }
+    else if(strncmp(line, "Your guess?", 11) == 0) {
+        r = R_PROMPT;
+    }
+    else if(strncmp(line, "It's ", 5) == 0) {
+        r = R_TURN;
+    }
+    else if(strncmp(line, "Game over!", 10) == 0) {
+        r = R_GAME_OVER;
+    }
+    else if(strncmp(line, "Let's start a new game", 22) == 0) {
+        r = R_NEW_GAME;
+    }
+    handle_reply(b, r);
+}
+
+
+/* React to one binary frame from the server: opcode op and n bytes of
+ * payload.
+ */
+void handle_frame(struct bot *b, int op, const unsigned char *payload, int n) {
+    enum reply r = R_OTHER;
+    switch(op) {
+    case OP_HELLO:
+        // confirms the mode; the name has not been taken yet
+        return;
+    case OP_ERROR:
+        if(n >= 1 && payload[0] == PROTO_ERR_BAD_NAME) {
+            r = R_BAD_NAME;
+        }
+        break;
+    case OP_TURN:
+        r = n >= 1 && payload[0] ? R_PROMPT : R_TURN;
+        break;
+    case OP_GAME_OVER:
+        r = R_GAME_OVER;
+        break;
+    case OP_STATE:
+        // sent on joining too, which is as good a time as any to shuffle
+        r = R_NEW_GAME;
+        break;
+    }
+    handle_reply(b, r);
+}
+
+
+/* Handle every complete frame in b's buffer and return the number of
+ * bytes they took up. Everything before PROTO_MAGIC is the text greeting.
+ */
+int parse_frames(struct bot *b) {
+    unsigned char *start = (unsigned char *)b->inbuf;
+    unsigned char *end = start + b->in_len;
+    if(!b->synced) {
+        unsigned char *magic = memchr(start, PROTO_MAGIC, end - start);
+        if(magic == NULL) {
+            return b->in_len;
+        }
+        b->synced = 1;
+        start = magic + 1;
+    }
+    while(b->state != BOT_IDLE && end - start >= 2 && end - start >= 1 + start[0]) {
+        int len = start[0];
+        if(len > 0) {
+            handle_frame(b, start[1], start + 2, len - 1);
+        }
+        start += 1 + len;
+    }
+    return start - (unsigned char *)b->inbuf;
+}
+
+
+/* Read what the server sent to b and handle every complete line.
+ */
+void read_bot(struct bot *b) {
+    while(b->state != BOT_IDLE) {
+        int n = read(b->fd, b->inbuf + b->in_len, BOT_BUF - b->in_len);
+        if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if(n <= 0) {
+            errors++;
+            close_bot(b);
+            return;
+        }
+        b->in_len += n;
+
+        if(binary) {
+            int used = parse_frames(b);
+            if(b->state == BOT_IDLE) {
+                return;
+            }
+            b->in_len -= used;
+            memmove(b->inbuf, b->inbuf + used, b->in_len);
+            continue;
+        }
+
+        char *start = b->inbuf;
+        char *end = b->inbuf + b->in_len;
+        char *nl;
+        while(b->state != BOT_IDLE && (nl = memchr(start, '\n', end - start)) != NULL) {
+            *nl = '\0';
+            // the prompt ends in "\n\r", so a line may start with '\r'
+            char *line = start;
+            while(*line == '\r') {
+                line++;
+            }
+            if(nl > line && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            if(b->state == BOT_NAMING && strncmp(line, "Welcome", 7) == 0) {
+                // the greeting arrives before the name has been taken
+            }
+            else if(*line != '\0') {
+                handle_line(b, line);
+            }
+            start = nl + 1;
+        }
+        if(b->state == BOT_IDLE) {
+            return;
+        }
+        b->in_len = end - start;
+        memmove(b->inbuf, start, b->in_len);
+        if(b->in_len == BOT_BUF) {
+            // a line this long is not part of the protocol
+            b->in_len = 0;
+        }
+    }
+}
+
+
+/* The connection of b has completed (or failed). Send the bot's name.
+ */
+void connected(struct bot *b) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    num_connecting--;
+    if(err != 0) {
+        errors++;
+        b->state = BOT_IDLE;
+        close(b->fd);
+        b->fd = -1;
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = b;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, b->fd, &ev);
+
+    b->state = BOT_NAMING;
+    char name[32];
+    if(binary) {
+        // the magic byte and the join frame go out together
+        snprintf(name, sizeof(name), "b%d_%d", b->id, b->gen);
+        struct frame join;
+        frame_begin(&join, OP_JOIN);
+        frame_str(&join, name);
+        unsigned char hello[1 + PROTO_MAX_FRAME] = {PROTO_MAGIC};
+        memcpy(hello + 1, join.data, join.len);
+        send_bytes(b, hello, 1 + join.len);
+        return;
+    }
+    snprintf(name, sizeof(name), "b%d_%d\r\n", b->id, b->gen);
+    send_line(b, name);
+}
+
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    const char *scenario = "play";
+    int port = PORT;
+    int num_bots = 100;
+    double duration = 10;
+    int opt;
+
+    while((opt = getopt(argc, argv, "H:p:n:d:t:cBC:s:")) != -1) {
+        switch(opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            num_bots = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = strtod(optarg, NULL);
+            break;
+        case 't':
+            think_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            churn = 1;
+            break;
+        case 'B':
+            binary = 1;
+            break;
+        case 'C':
+            max_connecting = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            scenario = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-H host] [-p port] [-n connections] [-d seconds]\n"
+                    "       [-t think ms] [-c] [-B] [-C connects in flight] [-s scenario name]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(num_bots < 1 || duration <= 0 || max_connecting < 1) {
+        fprintf(stderr, "The connection counts and the duration must be positive\n");
+        exit(1);
+    }
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Bad address %s\n", host);
+        exit(1);
+    }
+
+    epfd = epoll_create1(0);
+    if(epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct bot *bots = calloc(num_bots, sizeof(struct bot));
+    if(bots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for(int i = 0; i < num_bots; i++) {
+        bots[i].id = i;
+        bots[i].fd = -1;
+        bots[i].rng = 0x5eed0000 + i;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    long long ramp_start = now_us();
+    long long ramp_us = 0;
+    long long start = ramp_start;
+    long long end = start + (churn ? (long long)(duration * 1e6) : MAX_RAMP_US);
+    int ramping = !churn;
+    int next_idle = 0;
+    long long now;
+    while((now = now_us()) < end) {
+        if(ramping && num_playing == num_bots) {
+            // everyone is in; measure from here
+            ramping = 0;
+            ramp_us = now - ramp_start;
+            start = now;
+            end = start + (long long)(duration * 1e6);
+            guesses = 0;
+            games = 0;
+            errors = 0;
+            guess_lat.len = 0;
+        }
+
+        // (re)connect idle bots, a few at a time
+        for(int k = 0; k < num_bots && num_connecting < max_connecting; k++) {
+            struct bot *b = &bots[next_idle];
+            next_idle = (next_idle + 1) % num_bots;
+            if(b->state == BOT_IDLE) {
+                start_connect(b);
+            }
+        }
+
+        // send the guesses whose think time is over
+        int timeout = (end - now) / 1000 + 1;
+        if(think_ms > 0) {
+            for(int i = 0; i < num_bots; i++) {
+                if(bots[i].state == BOT_PLAYING && bots[i].due_us != 0) {
+                    if(bots[i].due_us <= now) {
+                        send_guess(&bots[i]);
+                    }
+                    else if((bots[i].due_us - now) / 1000 < timeout) {
+                        timeout = (bots[i].due_us - now) / 1000;
+                    }
+                }
+            }
+        }
+        if(num_connecting < max_connecting) {
+            for(int i = 0; i < num_bots; i++) {
+                if(bots[i].state == BOT_IDLE) {
+                    timeout = 10;
+                    break;
+                }
+            }
+        }
+
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < nready; i++) {
+            struct bot *b = events[i].data.ptr;
+            if(b->state == BOT_CONNECTING) {
+                connected(b);
+            }
+            if(b->state != BOT_CONNECTING && b->state != BOT_IDLE
+               && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                read_bot(b);
+            }
+        }
+    }
+
+    double secs = (now_us() - start) / 1e6;
+    printf("scenario %s: %d %sconnections%s, think %d ms, %.1f s\n", scenario,
+           num_bots, binary ? "binary " : "", churn ? " (churning)" : "", think_ms, secs);
+    if(ramping && !churn) {
+        printf("  ramp did not finish: %d of %d joined in %.1f s\n",
+               num_playing, num_bots, secs);
+    }
+    else if(!churn) {
+        printf("  ramp %.2f s (%.1f joins/s)\n", ramp_us / 1e6, num_bots / (ramp_us / 1e6));
+    }
+    else {
+        printf("  joins/s %.1f\n", connects / secs);
+    }
+    printf("  guesses/s %.1f  games/s %.2f  in game at end %d  errors %lld\n",
+           guesses / secs, games / secs, num_playing, errors);
+    print_percentiles("join latency", &join_lat);
+    print_percentiles("guess latency", &guess_lat);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Start a wordsrv on a scratch port and run the standard load scenarios
+# against it with wgg-bench. Extra arguments are passed to the server, so
+# for example "./bench.sh -b uring -t 4" benchmarks that configuration.
+
+BENCH_PORT=${BENCH_PORT:-58599}
+DICT=${BENCH_DICT:-dictionary.txt}
+
+./wordsrv -p "$BENCH_PORT" "$@" "$DICT" > /dev/null 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT INT TERM
+sleep 0.5
+if ! kill -0 $server 2>/dev/null; then
+    echo "wordsrv failed to start" >&2
+    exit 1
+fi
+
+echo "wordsrv $* on port $BENCH_PORT, $(date)"
+
+# Many players who take their time: every guess is sent to all of them
+./wgg-bench -p "$BENCH_PORT" -s idle-fanout -n 2000 -t 20 -d 10
+
+# Clients that leave as soon as they have joined and come straight back
+./wgg-bench -p "$BENCH_PORT" -s churn -n 64 -c -d 10
+
+# Small games played as fast as the server answers
+./wgg-bench -p "$BENCH_PORT" -s heavy-turns -n 8 -d 10
@@ -0,0 +1,46 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <time.h>
+
+/* While the server records or replays its input (see replay.h), a shard
+ * sets clock_frozen_ns to the time of the event it is about to handle, and
+ * its clock stands still there until the next event, so that a replay sees
+ * exactly the times the recorded run saw. 0 lets the clock run. Each thread
+ * has its own. Defined in replay.c, which every program using this header
+ * links.
+ */
+extern __thread long long clock_frozen_ns;
+
+/* Return the time in nanoseconds on a clock that never jumps backwards,
+ * even when the clock is frozen; for measuring how long things take.
+ */
+static inline long long real_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Return the time in nanoseconds on the same clock as real_now_ns, or the
+ * time it is frozen at.
+ */
+static inline long long now_ns(void) {
+    if(clock_frozen_ns != 0) {
+        return clock_frozen_ns;
+    }
+    return real_now_ns();
+}
+
+/* Return the time in milliseconds on the same clock as now_ns.
+ */
+static inline long long now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+/* Return the time in microseconds on the same clock as now_ns.
+ */
+static inline long long now_us(void) {
+    return now_ns() / 1000;
+}
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dict.h"
+#include "gameplay.h"
+
+
+/* Map filename into memory. Return 0 on success and -1 on failure.
+ */
+static int map_file(const char *filename, const char **data, size_t *len) {
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        perror("Opening dictionary");
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if(st.st_size == 0) {
+        fprintf(stderr, "Dictionary %s is empty\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    *data = p;
+    *len = st.st_size;
+    return 0;
+}
+
+
+/* Parse the frequency weight that follows a word on its line: blanks and
+ * then digits. Return it, or -1 if there is none.
+ */
+static long long parse_weight(const char *p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if(p == end || *p < '0' || *p > '9') {
+        return -1;
+    }
+    long long w = 0;
+    while(p < end && *p >= '0' && *p <= '9') {
+        if(w < UINT32_MAX) {
+            w = w * 10 + (*p - '0');
+        }
+        p++;
+    }
+    return w < UINT32_MAX ? w : UINT32_MAX;
+}
+
+
+/* Build the word index in one pass over the mapped text. Lines that are
+ * empty or do not fit in MAX_WORD are skipped. A word may be followed on
+ * its line by a blank and a frequency weight; once one word has a weight,
+ * those without one count as 1.
+ */
+static int index_words(struct dictionary *dict) {
+    const char *p = dict->data;
+    const char *end = dict->data + dict->data_len;
+    int cap = 1024;
+    int skipped = 0;
+    int crlf = 0;
+
+    dict->size = 0;
+    dict->words = malloc(cap * sizeof(struct word_entry));
+    if(dict->words == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    while(p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+        size_t len = line_end - p;
+
+        if(len > 0 && p[len - 1] == '\r') {
+            len--;
+            crlf = 1;
+        }
+        long long weight = -1;
+        const char *blank = memchr(p, ' ', len);
+        if(blank == NULL) {
+            blank = memchr(p, '\t', len);
+        }
+        if(blank != NULL) {
+            weight = parse_weight(blank, p + len);
+            len = blank - p;
+        }
+
+        if(len == 0 || len > MAX_WORD - 1) {
+            skipped++;
+        } else {
+            if(dict->size == cap) {
+                cap *= 2;
+                struct word_entry *w = realloc(dict->words,
+                                               cap * sizeof(struct word_entry));
+                if(w == NULL) {
+                    perror("realloc");
+                    return -1;
+                }
+                dict->words = w;
+                if(dict->weights != NULL) {
+                    uint32_t *ws = realloc(dict->weights, cap * sizeof(uint32_t));
+                    if(ws == NULL) {
+                        perror("realloc");
+                        return -1;
+                    }
+                    dict->weights = ws;
+                }
+            }
+            if(weight >= 0 && dict->weights == NULL) {
+                // the first weight; every word so far counts as 1
+                dict->weights = malloc(cap * sizeof(uint32_t));
+                if(dict->weights == NULL) {
+                    perror("malloc");
+                    return -1;
+                }
+                for(int i = 0; i < dict->size; i++) {
+                    dict->weights[i] = 1;
+                }
+            }
+            if(dict->weights != NULL) {
+                dict->weights[dict->size] = weight >= 0 ? weight : 1;
+            }
+            dict->words[dict->size].offset = p - dict->data;
+            dict->words[dict->size].len = len;
+            dict->size++;
+        }
+        p = line_end + 1;
+    }
+
+    if(crlf) {
+        fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
+    }
+    if(skipped) {
+        fprintf(stderr, "Skipped %d dictionary lines that are empty or longer than %d letters\n",
+                skipped, MAX_WORD - 1);
+    }
+    if(dict->size == 0) {
+        fprintf(stderr, "The dictionary does not contain any usable words\n");
+        return -1;
+    }
+
+    // give back the slack from the last doubling
+    struct word_entry *w = realloc(dict->words, dict->size * sizeof(struct word_entry));
+    if(w != NULL) {
+        dict->words = w;
+    }
+    return 0;
+}
+
+
+/* Use the index stored in a compiled dictionary file without parsing it.
+ * The header, checksum and every index entry are checked before anything
+ * is trusted; the checksum only catches accidents, not a file made by hand.
+ */
+static int use_compiled(struct dictionary *dict, const char *filename) {
+    const struct dict_file_header *h = (const struct dict_file_header *)dict->data;
+    size_t len = dict->data_len;
+
+    if(h->version != DICT_VERSION || h->byte_order != DICT_BYTE_ORDER
+       || h->header_size != sizeof(*h)) {
+        fprintf(stderr, "%s: unsupported compiled dictionary version %u\n",
+                filename, h->version);
+        return -1;
+    }
+    if(h->max_word > MAX_WORD || h->count == 0
+       || h->index_offset < sizeof(*h)
+       || h->index_offset % sizeof(struct word_entry) != 0
+       || h->index_offset + (uint64_t)h->count * sizeof(struct word_entry) > h->words_offset
+       || h->words_offset + h->words_len != len) {
+        fprintf(stderr, "%s: compiled dictionary header is inconsistent\n", filename);
+        return -1;
+    }
+    if(dict_checksum(dict->data + sizeof(*h), len - sizeof(*h)) != h->checksum) {
+        fprintf(stderr, "%s: compiled dictionary checksum mismatch\n", filename);
+        return -1;
+    }
+
+    // every word has to fit in a game and lie inside the packed letters
+    const struct word_entry *words = (const struct word_entry *)(dict->data + h->index_offset);
+    for(uint32_t i = 0; i < h->count; i++) {
+        if(words[i].len < 1 || words[i].len >= MAX_WORD
+           || words[i].offset < h->words_offset
+           || (uint64_t)words[i].offset + words[i].len > h->words_offset + h->words_len) {
+            fprintf(stderr, "%s: compiled dictionary entry %u is out of bounds\n",
+                    filename, i);
+            return -1;
+        }
+    }
+
+    dict->words = (struct word_entry *)(dict->data + h->index_offset);
+    dict->size = h->count;
+    dict->prebuilt = 1;
+    return 0;
+}
+
+
+/* Map the dictionary file and index its words. Files compiled by wgg-dictc
+ * are used directly; anything else is treated as a word list with one word
+ * per line.
+ * Return 0 on success and -1 on failure; dict is left empty on failure.
+ */
+int load_dictionary(struct dictionary *dict, const char *filename) {
+    memset(dict, 0, sizeof(*dict));
+    if(map_file(filename, &dict->data, &dict->data_len) < 0) {
+        return -1;
+    }
+
+    int status;
+    if(dict->data_len >= sizeof(struct dict_file_header)
+       && memcmp(dict->data, DICT_MAGIC, sizeof(DICT_MAGIC)) == 0) {
+        status = use_compiled(dict, filename);
+    } else {
+        status = index_words(dict);
+    }
+    if(status < 0) {
+        free_dictionary(dict);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Release the mapping and the index.
+ */
+void free_dictionary(struct dictionary *dict) {
+    if(!dict->prebuilt) {
+        free(dict->words);
+    }
+    free(dict->weights);
+    if(dict->data != NULL) {
+        munmap((void *)dict->data, dict->data_len);
+    }
+    memset(dict, 0, sizeof(*dict));
+}
+
+
+/* Return a pointer to the word at index and store its length in len.
+ * The word is not null terminated.
+ */
+const char *dict_word(const struct dictionary *dict, int index, int *len) {
+    const struct word_entry *w = &dict->words[index];
+    *len = w->len;
+    return dict->data + w->offset;
+}
+
+
+/* Return a 64-bit checksum of buf. It consumes eight bytes per step so that
+ * verifying a large compiled dictionary does not slow down startup.
+ */
+uint64_t dict_checksum(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+
+    while(len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
+        len--;
+    }
+    return h ^ (h >> 32);
+}
@@ -0,0 +1,54 @@
+#ifndef _DICT_H_
+#define _DICT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Location of one word inside the mapped dictionary file. */
+struct word_entry {
+    uint32_t offset;          // Byte offset of the first letter
+    uint32_t len;             // Number of letters (no line ending)
+};
+
+// Information about the dictionary used to pick random word.
+// The file is mapped once at startup and indexed in a single pass, so
+// picking a word is just an index into words.
+struct dictionary {
+    const char *data;         // The mapped file contents
+    size_t data_len;
+    struct word_entry *words; // One entry per usable word
+    int size;                 // Number of entries in words
+    uint32_t *weights;        // Frequency weight of each word, or NULL
+    int prebuilt;             // words points into a compiled file mapping
+};
+
+/* Compiled dictionary files, produced by wgg-dictc, start with this header.
+ * The index follows at index_offset and holds count word_entry records
+ * whose offsets are relative to the start of the file, so the loader can
+ * use the mapping as is. All fields are in host byte order; byte_order
+ * lets the loader reject a file compiled on a machine of the other order.
+ */
+#define DICT_MAGIC "WGGDICT"
+#define DICT_VERSION 1
+#define DICT_BYTE_ORDER 0x01020304
+
+struct dict_file_header {
+    char magic[8];            // DICT_MAGIC including its null terminator
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;     // sizeof(struct dict_file_header)
+    uint32_t max_word;        // Every word is shorter than this
+    uint32_t count;           // Number of index entries
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t words_offset;    // Packed word letters, no separators
+    uint64_t words_len;
+    uint64_t checksum;        // dict_checksum of everything after the header
+};
+
+int load_dictionary(struct dictionary *dict, const char *filename);
+void free_dictionary(struct dictionary *dict);
+const char *dict_word(const struct dictionary *dict, int index, int *len);
+uint64_t dict_checksum(const void *buf, size_t len);
+
+#endif
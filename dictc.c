@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dict.h"
+#include "gameplay.h"
+
+/* wgg-dictc compiles a word list into the binary dictionary format that
+ * wordsrv maps without parsing. Lines that are empty or do not fit in
+ * MAX_WORD are dropped and Windows line endings are stripped here, once,
+ * instead of on every server start.
+ */
+
+
+/* Write len bytes of buf to fp, exiting on failure.
+ */
+static void write_all(FILE *fp, const void *buf, size_t len, const char *path) {
+    if(len > 0 && fwrite(buf, len, 1, fp) != 1) {
+        perror(path);
+        exit(1);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    if(argc != 3) {
+        fprintf(stderr, "Usage: %s <word list> <output file>\n", argv[0]);
+        exit(1);
+    }
+
+    struct dictionary dict;
+    if(load_dictionary(&dict, argv[1]) < 0) {
+        exit(1);
+    }
+    if(dict.weights != NULL) {
+        fprintf(stderr, "%s: frequency weights are not kept in compiled dictionaries\n",
+                argv[1]);
+    }
+
+    // Lay out the packed letters and the index that points at them
+    struct dict_file_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DICT_MAGIC, sizeof(DICT_MAGIC));
+    h.version = DICT_VERSION;
+    h.byte_order = DICT_BYTE_ORDER;
+    h.header_size = sizeof(h);
+    h.max_word = MAX_WORD;
+    h.count = dict.size;
+    h.index_offset = sizeof(h);
+    h.words_offset = h.index_offset + (uint64_t)dict.size * sizeof(struct word_entry);
+
+    size_t body_len = h.words_offset - sizeof(h);
+    for(int i = 0; i < dict.size; i++) {
+        body_len += dict.words[i].len;
+    }
+    h.words_len = body_len - (h.words_offset - sizeof(h));
+    if(h.words_offset + h.words_len > UINT32_MAX) {
+        fprintf(stderr, "%s: too large for 32-bit word offsets\n", argv[1]);
+        exit(1);
+    }
+
+    char *body = malloc(body_len);
+    if(body == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    struct word_entry *index = (struct word_entry *)body;
+    char *letters = body + (h.words_offset - sizeof(h));
+    uint32_t pos = 0;
+    for(int i = 0; i < dict.size; i++) {
+        int len;
+        const char *word = dict_word(&dict, i, &len);
+        memcpy(letters + pos, word, len);
+        index[i].offset = h.words_offset + pos;
+        index[i].len = len;
+        pos += len;
+    }
+    h.checksum = dict_checksum(body, body_len);
+
+    // Write to a temporary name first so a running server never maps a
+    // half-written file
+    char tmp[4096];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]) >= sizeof(tmp)) {
+        fprintf(stderr, "%s: output name too long\n", argv[2]);
+        exit(1);
+    }
+    FILE *fp = fopen(tmp, "w");
+    if(fp == NULL) {
+        perror(tmp);
+        exit(1);
+    }
+    write_all(fp, &h, sizeof(h), tmp);
+    write_all(fp, body, body_len, tmp);
+    if(fclose(fp) != 0) {
+        perror(tmp);
+        exit(1);
+    }
+    if(rename(tmp, argv[2]) < 0) {
+        perror("rename");
+        unlink(tmp);
+        exit(1);
+    }
+
+    printf("Compiled %d words (%llu bytes) into %s\n", dict.size,
+           (unsigned long long)(sizeof(h) + body_len), argv[2]);
+    free(body);
+    free_dictionary(&dict);
+    return 0;
+}
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+
+#include "event.h"
+
+struct event_loop {
+    enum ev_backend backend;
+
+    // epoll backend
+    int epfd;
+    struct epoll_event *ready;
+    int ready_cap;
+
+    // select backend
+    fd_set readset;
+    fd_set writeset;
+    int maxfd;
+};
+
+
+/* Create an event loop using the given backend.
+ * Return NULL (with errno set) if the backend could not be set up.
+ */
+struct event_loop *ev_create(enum ev_backend backend) {
+    struct event_loop *loop = calloc(1, sizeof(struct event_loop));
+    if(loop == NULL) {
+        return NULL;
+    }
+    if(backend == EV_BACKEND_URING) {
+        // completion-based, so it has no readiness loop
+        free(loop);
+        errno = EINVAL;
+        return NULL;
+    }
+    loop->backend = backend;
+    loop->epfd = -1;
+    loop->maxfd = -1;
+    FD_ZERO(&loop->readset);
+    FD_ZERO(&loop->writeset);
+
+    if(backend == EV_BACKEND_EPOLL) {
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epfd < 0) {
+            free(loop);
+            return NULL;
+        }
+    }
+    return loop;
+}
+
+
+void ev_free(struct event_loop *loop) {
+    if(loop->epfd >= 0) {
+        close(loop->epfd);
+    }
+    free(loop->ready);
+    free(loop);
+}
+
+
+/* Translate EV_* flags to epoll flags. Registration is level-triggered, so
+ * a descriptor that still has data after one read is reported again.
+ */
+static unsigned int to_epoll(int events) {
+    unsigned int e = 0;
+    if(events & EV_READ) {
+        e |= EPOLLIN;
+    }
+    if(events & EV_WRITE) {
+        e |= EPOLLOUT;
+    }
+    return e;
+}
+
+
+/* Start, change or stop watching fd for events on the select backend.
+ */
+static int select_set(struct event_loop *loop, int fd, int events) {
+    if(fd < 0 || fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    if(events & EV_READ) {
+        FD_SET(fd, &loop->readset);
+    } else {
+        FD_CLR(fd, &loop->readset);
+    }
+    if(events & EV_WRITE) {
+        FD_SET(fd, &loop->writeset);
+    } else {
+        FD_CLR(fd, &loop->writeset);
+    }
+
+    if(events && fd > loop->maxfd) {
+        loop->maxfd = fd;
+    }
+    while(loop->maxfd >= 0 && !FD_ISSET(loop->maxfd, &loop->readset)
+          && !FD_ISSET(loop->maxfd, &loop->writeset)) {
+        loop->maxfd--;
+    }
+    return 0;
+}
+
+
+/* Start watching fd. Return 0 on success and -1 on failure.
+ */
+int ev_add(struct event_loop *loop, int fd, int events) {
+    if(loop->backend == EV_BACKEND_SELECT) {
+        return select_set(loop, fd, events);
+    }
+    struct epoll_event ev;
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/* Change the set of events watched for fd.
+ */
+int ev_modify(struct event_loop *loop, int fd, int events) {
+    if(loop->backend == EV_BACKEND_SELECT) {
+        return select_set(loop, fd, events);
+    }
+    struct epoll_event ev;
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+
+/* Stop watching fd. Must be called before fd is closed.
+ */
+int ev_del(struct event_loop *loop, int fd) {
+    if(loop->backend == EV_BACKEND_SELECT) {
+        return select_set(loop, fd, 0);
+    }
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+
+static int select_wait(struct event_loop *loop, struct ev_event *events,
+                       int max_events, int timeout_ms) {
+    fd_set rset = loop->readset;
+    fd_set wset = loop->writeset;
+    struct timeval tv;
+    struct timeval *tvp = NULL;
+    if(timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    int nready = select(loop->maxfd + 1, &rset, &wset, NULL, tvp);
+    if(nready <= 0) {
+        return nready;
+    }
+
+    // select only tells us how many are ready, so find them
+    int n = 0;
+    for(int fd = 0; fd <= loop->maxfd && n < max_events; fd++) {
+        int e = 0;
+        if(FD_ISSET(fd, &rset)) {
+            e |= EV_READ;
+        }
+        if(FD_ISSET(fd, &wset)) {
+            e |= EV_WRITE;
+        }
+        if(e) {
+            events[n].fd = fd;
+            events[n].events = e;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+static int epoll_wait_events(struct event_loop *loop, struct ev_event *events,
+                             int max_events, int timeout_ms) {
+    if(loop->ready_cap < max_events) {
+        struct epoll_event *r = realloc(loop->ready, max_events * sizeof(struct epoll_event));
+        if(r == NULL) {
+            return -1;
+        }
+        loop->ready = r;
+        loop->ready_cap = max_events;
+    }
+
+    int nready = epoll_wait(loop->epfd, loop->ready, max_events, timeout_ms);
+    for(int i = 0; i < nready; i++) {
+        unsigned int e = loop->ready[i].events;
+        events[i].fd = loop->ready[i].data.fd;
+        events[i].events = 0;
+        if(e & EPOLLIN) {
+            events[i].events |= EV_READ;
+        }
+        if(e & EPOLLOUT) {
+            events[i].events |= EV_WRITE;
+        }
+        if(e & (EPOLLERR | EPOLLHUP)) {
+            // let the owner find out about the error through read
+            events[i].events |= EV_ERROR | EV_READ;
+        }
+    }
+    return nready;
+}
+
+
+/* Wait up to timeout_ms milliseconds (-1 waits forever) for events and
+ * store at most max_events of them in events.
+ * Return the number of events stored, or -1 on error (errno is set).
+ */
+int ev_wait(struct event_loop *loop, struct ev_event *events, int max_events,
+            int timeout_ms) {
+    if(loop->backend == EV_BACKEND_SELECT) {
+        return select_wait(loop, events, max_events, timeout_ms);
+    }
+    return epoll_wait_events(loop, events, max_events, timeout_ms);
+}
+
+
+/* Set backend from its name. Return 0 on success and -1 if the name is
+ * not known.
+ */
+int ev_parse_backend(const char *name, enum ev_backend *backend) {
+    if(strcmp(name, "epoll") == 0) {
+        *backend = EV_BACKEND_EPOLL;
+    } else if(strcmp(name, "select") == 0) {
+        *backend = EV_BACKEND_SELECT;
+    } else if(strcmp(name, "uring") == 0) {
+        *backend = EV_BACKEND_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+const char *ev_backend_name(enum ev_backend backend) {
+    switch(backend) {
+    case EV_BACKEND_SELECT:
+        return "select";
+    case EV_BACKEND_URING:
+        return "uring";
+    default:
+        return "epoll";
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+/* A small readiness-based event loop with interchangeable backends.
+ * epoll is the default; select is kept so the two can be compared, but it
+ * cannot watch descriptors at or above FD_SETSIZE. The uring backend is
+ * completion-based and is driven by the server directly (see uring.h);
+ * ev_create refuses it.
+ */
+
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4          // Hang up or error; only ever reported
+
+enum ev_backend {
+    EV_BACKEND_EPOLL,
+    EV_BACKEND_SELECT,
+    EV_BACKEND_URING,
+};
+
+struct ev_event {
+    int fd;
+    int events;               // EV_READ, EV_WRITE and/or EV_ERROR
+};
+
+struct event_loop;
+
+struct event_loop *ev_create(enum ev_backend backend);
+void ev_free(struct event_loop *loop);
+int ev_add(struct event_loop *loop, int fd, int events);
+int ev_modify(struct event_loop *loop, int fd, int events);
+int ev_del(struct event_loop *loop, int fd);
+int ev_wait(struct event_loop *loop, struct ev_event *events, int max_events,
+            int timeout_ms);
+
+int ev_parse_backend(const char *name, enum ev_backend *backend);
+const char *ev_backend_name(enum ev_backend backend);
+
+#endif
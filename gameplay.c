@@ -4,93 +4,140 @@
 #include <string.h>
 
 #include "gameplay.h"
+#include "log.h"
 
 /* Return a status message that shows the current state of the game.
- * Assumes that the caller has allocated MAX_MSG bytes for msg.
+ * Assumes that the caller has allocated STATUS_MAX bytes for msg.
  */
 char *status_message(char *msg, struct game_state *game) {
-    sprintf(msg, "***************\r\n"
+    int len = sprintf(msg, "***************\r\n"
            "Word to guess: %s\r\nGuesses remaining: %d\r\n"
            "Letters guessed: \r\n", game->guess, game->guesses_left);
-    for(int i = 0; i < 26; i++){
-        if(game->letters_guessed[i]) {
-            int len = strlen(msg);
-            msg[len] = (char)(game->letters_guessed[i]);
-            msg[len + 1] = ' ';
-            msg[len + 2] = '\0';
-        }
+    for(uint32_t left = game->guessed; left != 0; left &= left - 1) {
+        msg[len++] = 'a' + __builtin_ctz(left);
+        msg[len++] = ' ';
     }
-    strncat(msg, "\r\n***************\0", MAX_MSG);
+    strcpy(msg + len, "\r\n***************");
     return msg;
 }
 
 
+/* Return the next number from the generator whose state is *state
+ * (splitmix64). Every game has its own state, so games running on
+ * different threads never contend for a shared generator.
+ */
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/* Return a number below n, with every one equally likely: the top half of
+ * a random 32x32-bit product, retried in the rare case that it falls in
+ * the part of the range that would favour some results (Lemire's method).
+ */
+uint32_t random_below(uint64_t *state, uint32_t n) {
+    uint64_t m = (uint64_t)(uint32_t)(next_random(state) >> 32) * n;
+    if((uint32_t)m < n) {
+        uint32_t reject = -n % n;
+        while((uint32_t)m < reject) {
+            m = (uint64_t)(uint32_t)(next_random(state) >> 32) * n;
+        }
+    }
+    return m >> 32;
+}
+
+
+/* Record letter as guessed and show it wherever it occurs in the word.
+ * Return the positions uncovered, which is 0 for a miss.
+ */
+uint32_t uncover(struct game_state *game, char letter) {
+    game->guessed |= LETTER_BIT(letter);
+    uint32_t hits = game->positions[letter - 'a'];
+    game->revealed |= hits;
+    for(uint32_t left = hits; left != 0; left &= left - 1) {
+        game->guess[__builtin_ctz(left)] = letter;
+    }
+    return hits;
+}
+
+
+/* Return 1 if line is a single letter that has not been guessed yet, and
+ * 0 otherwise.
+ */
+int check_guess(const struct game_state *game, const char *line) {
+    return line[0] >= 'a' && line[0] <= 'z' && line[1] == '\0'
+        && (game->guessed & LETTER_BIT(line[0])) == 0;
+}
+
+
+/* Make word, of len letters, the word to guess, with nothing guessed yet.
+ */
+static void set_word(struct game_state *game, const char *word, int len) {
+    memcpy(game->word, word, len);
+    game->word[len] = '\0';
+    game->len = len;
+
+    // Record where each letter occurs, so that a guess is a lookup.
+    // Characters other than a-z can never be guessed; they start out shown.
+    memset(game->positions, 0, sizeof(game->positions));
+    game->revealed = 0;
+    for(int j = 0; j < len; j++) {
+        char c = word[j];
+        if(c >= 'a' && c <= 'z') {
+            game->positions[c - 'a'] |= 1u << j;
+            game->guess[j] = '-';
+        }
+        else {
+            game->revealed |= 1u << j;
+            game->guess[j] = c;
+        }
+    }
+    game->guess[len] = '\0';
+    game->all_positions = len == 32 ? ~0u : (1u << len) - 1;
+    game->guessed = 0;
+}
+
+
 /* Initialize the gameboard: 
- *    - initialize dictionary
- *    - select a random word to guess from the dictionary file
+ *    - pick the word to guess as sel directs
  *    - set guess to all dashes ('-')
  *    - initialize the other fields
  * We can't initialize head and has_next_turn because these will have
  * different values when we use init_game to create a new game after one
- * has already been played
+ * has already been played; the same goes for rng and rot, which carry on
+ * from one game to the next.
  */
-void init_game(struct game_state *game, char *dict_name) {
-    char buf[MAX_WORD];
-    if(game->dict.fp != NULL) {
-        rewind(game->dict.fp);
-    } else {
-        game->dict.fp = fopen(dict_name, "r");
-        if(game->dict.fp == NULL) {
-            perror("Opening dictionary");
-            exit(1);
-        }
-    } 
-
-    int index = random() % game->dict.size;
-    printf("Looking for word at index %d\n", index);
-    for(int i = 0; i <= index; i++) {
-        if(!fgets(buf, MAX_WORD, game->dict.fp)){
-            fprintf(stderr,"File ended before we found the entry index %d",index);
-            exit(1);
-        }
-    } 
+void init_game(struct game_state *game, const struct selector *sel) {
+    uint32_t index = selector_pick(sel, &game->rot, &game->rng);
+    LOG(LOG_DEBUG, "Looking for word at index %u\n", index);
 
-    // Found word
-    if(buf[strlen(buf) - 1] == '\n') {  // from a unix file
-        buf[strlen(buf) - 1] = '\0';
-    } else {
-        fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
-    }
-    strncpy(game->word, buf, MAX_WORD);
-    game->word[MAX_WORD-1] = '\0';
-    for(int j = 0; j < strlen(game->word); j++) {
-        game->guess[j] = '-';
-    }
-    game->guess[strlen(game->word)] = '\0';
-
-    for(int i = 0; i < NUM_LETTERS; i++) {
-        game->letters_guessed[i] = 0;
-    }
+    // Found word; the index only holds words that fit in MAX_WORD
+    int len;
+    const char *word = dict_word(sel->index->dict, index, &len);
+    set_word(game, word, len);
     game->guesses_left = MAX_GUESSES;
 
 }
 
 
-/* Return the number of lines in the file
+/* Put the board of a game back as it was: word, with the letters in
+ * guessed already played and guesses_left guesses to go. Like init_game,
+ * this leaves the players alone. Return 0 on success and -1 if the word
+ * or the letters cannot belong to a game.
  */
-int get_file_length(char *filename) {
-    char buf[MAX_MSG];
-    int count = 0;
-    FILE *fp;
-    if((fp = fopen(filename, "r")) == NULL) {
-        perror("open");
-        exit(1);
+int resume_game(struct game_state *game, const char *word, int len,
+                uint32_t guessed, int guesses_left) {
+    if(len <= 0 || len >= MAX_WORD || guessed >> NUM_LETTERS != 0
+       || guesses_left < 0 || guesses_left > MAX_GUESSES) {
+        return -1;
     }
-    
-    while(fgets(buf, MAX_MSG, fp) != NULL) {
-        count++;
+    set_word(game, word, len);
+    for(uint32_t left = guessed; left != 0; left &= left - 1) {
+        uncover(game, 'a' + __builtin_ctz(left));
     }
-    
-    fclose(fp);
-    return count;
+    game->guesses_left = guesses_left;
+    return 0;
 }
@@ -1,41 +1,108 @@
+#ifndef _GAMEPLAY_H_
+#define _GAMEPLAY_H_
+
 #include <netinet/in.h>
+#include <stdint.h>
+
+#include "dict.h"
+#include "outq.h"
+#include "timer.h"
+#include "wordsel.h"
 
 #define MAX_NAME 30  
 #define MAX_MSG 128
 #define MAX_WORD 20
 #define MAX_BUF 256
+#define MAX_LINE 128 // Longest command accepted, without its line ending
 #define MAX_GUESSES 4
 #define NUM_LETTERS 26
+// Room for a status message: its fixed text and the guess count take under
+// 128 bytes, then the word and a letter and space for every letter guessed
+#define STATUS_MAX (128 + MAX_WORD + 2 * NUM_LETTERS)
 #define WELCOME_MSG "Welcome to our word game. What is your name? \r\n"
 
+/* How a player has done, over one game or over all of them. */
+struct player_stats {
+    uint32_t games;           // Games played to the end
+    uint32_t wins;
+    uint32_t hits;            // Guesses that uncovered a letter
+    uint32_t misses;
+    uint64_t think_us;        // Time taken over all those guesses
+};
+
+/* How a client talks to the server; see proto.h for the binary frames. */
+enum client_mode {
+    MODE_UNKNOWN,             // Nothing received yet
+    MODE_TEXT,
+    MODE_BINARY,
+};
+
+/* Clients live in cache-line-aligned pool slots. The fields touched for
+ * every event come first; the input and name buffers come last.
+ */
 struct client {
     int fd;
     struct in_addr ipaddr;
     struct client *next;
+    int in_game;          // 1 once the client is in the game's list of players
+    int bot;              // 1 for a bot player, which has no socket
+    int mode;             // One of enum client_mode
+    int op;               // Opcode of the binary frame in line
+    int closing;          // 1 once the client has been marked for removal
+    int dirty;            // 1 if output was queued since the last flush
+    int dirty_idx;        // Position in the list of dirty clients
+    int want_write;       // 1 while waiting for the socket to drain
+    int inflight;         // io_uring requests not yet completed
+    int sending;          // 1 while an io_uring write is in flight
+    int zombie;           // 1 if removed but waiting for inflight to reach 0,
+                          // or in pipeline mode for the game to let go
+    int io_id;            // In pipeline mode, the I/O thread owning the socket
+    struct outq out;      // Output the socket has not accepted yet
+    struct timer idle;    // Drops the client if it stays silent too long
+    int in_start;         // Offset in inbuf of input not yet handled
+    int in_end;           // Offset in inbuf where the next read goes
+    int skipping;         // While discarding a long line: 1 in text mode,
+                          // the bytes still to skip in binary mode
+    char *line;           // The command being handled, inside inbuf
+    long long prompted_ns; // When the client was last asked for a guess
+    struct player_stats played; // This game so far, not yet recorded
     char name[MAX_NAME];
     char inbuf[MAX_BUF];  // Used to hold input from the client
-    char *in_ptr;         // A pointer into inbuf to help with partial reads
 };
 
-// Information about the dictionary used to pick random word
-struct dictionary {
-    FILE *fp;
-    int size;
-};
+#define LETTER_BIT(c) (1u << ((c) - 'a'))
 
+/* Letters and word positions are kept as bitmasks: bit i of a letter mask
+ * stands for 'a' + i and bit j of a position mask for word[j]. The fields
+ * used by every guess come first, so checking and applying a guess touches
+ * one cache line.
+ */
 struct game_state {
-    char word[MAX_WORD];      // The word to guess
-    char guess[MAX_WORD];     // The current guess (for example '-o-d')
-    int letters_guessed[NUM_LETTERS]; // Index i will be 1 if the corresponding
-                                      // letter has been guessed; 0 otherwise
-    int guesses_left;         // Number of guesses remaining
-    struct dictionary dict;
-    
+    uint32_t guessed;         // Letters guessed so far
+    uint32_t revealed;        // Positions uncovered so far
+    uint32_t all_positions;   // Every position of the word; won once revealed
+    uint8_t len;              // Letters in word
+    int8_t guesses_left;      // Number of guesses remaining
     struct client *head;
     struct client *has_next_turn;
+    char word[MAX_WORD];      // The word to guess
+    char guess[MAX_WORD];     // The current guess (for example '-o-d')
+
+    uint32_t positions[NUM_LETTERS]; // Where each letter occurs in word
+    struct timer turn_timer;  // Skips a player who takes too long to guess
+    struct client *turn_player; // The player turn_timer was started for
+    uint64_t rng;             // Random state used to pick words
+    struct rotation rot;      // This game's way through them
 };
 
 
-void init_game(struct game_state *game, char *dict_name);
-int get_file_length(char *filename);
-char *status_message(char *msg, struct game_state *game);
\ No newline at end of file
+void init_game(struct game_state *game, const struct selector *sel);
+int resume_game(struct game_state *game, const char *word, int len,
+                uint32_t guessed, int guesses_left);
+uint64_t next_random(uint64_t *state);
+uint32_t random_below(uint64_t *state, uint32_t n);
+char *status_message(char *msg, struct game_state *game);
+uint32_t uncover(struct game_state *game, char letter);
+int check_guess(const struct game_state *game, const char *line);
+
+#endif
@@ -0,0 +1,58 @@
+#include <string.h>
+
+#include "input.h"
+
+/* Return where the next input for p goes and store in *size_left how many
+ * bytes fit there.
+ */
+char *input_space(struct client *p, int *size_left) {
+    int pending = p->in_end - p->in_start;
+    if(p->in_start > 0){
+        memmove(p->inbuf, p->inbuf + p->in_start, pending);
+        p->in_start = 0;
+        p->in_end = pending;
+    }
+    // keep a byte for the terminator of a line that fills the buffer
+    *size_left = MAX_BUF - 1 - p->in_end;
+    return p->inbuf + p->in_end;
+}
+
+
+/* Find the next full line of text input from p and set *line to it,
+ * without its line ending. Return 1 if there was one and 0 if no full line
+ * is in yet. Return -1 if a line longer than MAX_LINE was thrown away
+ * instead; there may be more lines after it.
+ */
+int scan_line(struct client *p, char **line) {
+    while(1){
+        char *start = p->inbuf + p->in_start;
+        int pending = p->in_end - p->in_start;
+        char *end = memchr(start, '\n', pending);
+
+        if(end == NULL){
+            if(pending > MAX_LINE + 1){
+                // the line is too long whatever follows; skip to its end
+                int first = !p->skipping;
+                p->skipping = 1;
+                p->in_start = p->in_end;
+                return first ? -1 : 0;
+            }
+            return 0;
+        }
+        p->in_start = end + 1 - p->inbuf;
+        if(p->skipping){
+            // the end of a line that was too long
+            p->skipping = 0;
+            continue;
+        }
+        if(end > start && end[-1] == '\r'){
+            end--;
+        }
+        if(end - start > MAX_LINE){
+            return -1;
+        }
+        *end = '\0';
+        *line = start;
+        return 1;
+    }
+}
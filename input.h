@@ -0,0 +1,18 @@
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include "gameplay.h"
+
+/* Input is kept in inbuf between in_start and in_end. Lines are handed out
+ * in place, so a read may bring in any number of them; whatever follows the
+ * last full line stays and is moved to the front before the next read.
+ * Since no line longer than MAX_LINE is kept, that tail is always short.
+ *
+ * Nothing here reads from or writes to a socket; the server does that and
+ * tells clients about lines that were too long.
+ */
+
+char *input_space(struct client *p, int *size_left);
+int scan_line(struct client *p, char **line);
+
+#endif
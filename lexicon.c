@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+
+#include "lexicon.h"
+#include "clock.h"
+#include "log.h"
+
+#define RECLAIM_INTERVAL_MS 100   // How often to retry freeing replaced lists
+
+/* A shard's hazard slot: the list it is picking a word from, or NULL.
+ * Each sits on its own cache line so that shards do not share one.
+ */
+struct hazard {
+    const struct lexicon *lex;
+} __attribute__((aligned(64)));
+
+static struct lexicon *current;   // The list new games pick from
+static struct hazard *hazards;
+static int num_hazards;
+
+struct reloader {
+    int sigfd;                    // Delivers SIGHUP
+    char *path;
+    struct select_policy policy;
+    struct lexicon *retired;      // Replaced, maybe still in use
+};
+
+
+/* Load the dictionary at path and build its index and the selector for
+ * policy. Return the new list, or NULL on failure.
+ */
+struct lexicon *lexicon_load(const char *path, const struct select_policy *policy) {
+    struct lexicon *lex = calloc(1, sizeof(struct lexicon));
+    if(lex == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if(load_dictionary(&lex->dict, path) < 0) {
+        free(lex);
+        return NULL;
+    }
+    if(word_index_build(&lex->index, &lex->dict) < 0) {
+        free_dictionary(&lex->dict);
+        free(lex);
+        return NULL;
+    }
+    if(match_index_build(&lex->match, &lex->index) < 0) {
+        word_index_free(&lex->index);
+        free_dictionary(&lex->dict);
+        free(lex);
+        return NULL;
+    }
+    if(selector_init(&lex->sel, &lex->index, policy) < 0) {
+        match_index_free(&lex->match);
+        word_index_free(&lex->index);
+        free_dictionary(&lex->dict);
+        free(lex);
+        return NULL;
+    }
+    lex->generation = 1;
+    LOG(LOG_INFO, "Picking from %u %s words%s\n", lex->sel.count,
+        difficulty_name(policy->difficulty), policy->weighted ? " by frequency" : "");
+    return lex;
+}
+
+
+void lexicon_free(struct lexicon *lex) {
+    selector_free(&lex->sel);
+    match_index_free(&lex->match);
+    word_index_free(&lex->index);
+    free_dictionary(&lex->dict);
+    free(lex);
+}
+
+
+/* Return the list new games pick from, and hold on to it until
+ * lexicon_exit. Only the thread that owns slot reader may call this.
+ */
+const struct lexicon *lexicon_enter(int reader) {
+    struct hazard *h = &hazards[reader];
+    const struct lexicon *lex = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    while(1) {
+        __atomic_store_n(&h->lex, lex, __ATOMIC_SEQ_CST);
+        // if the list was replaced before the slot named it, the reload
+        // thread may have missed the slot; take the new one instead
+        const struct lexicon *now = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+        if(now == lex) {
+            return lex;
+        }
+        lex = now;
+    }
+}
+
+
+void lexicon_exit(int reader) {
+    __atomic_store_n(&hazards[reader].lex, NULL, __ATOMIC_RELEASE);
+}
+
+
+/* Free every replaced list that no hazard slot names.
+ */
+static void reclaim(struct reloader *r) {
+    struct lexicon **pp = &r->retired;
+    while(*pp != NULL) {
+        struct lexicon *lex = *pp;
+        int in_use = 0;
+        for(int i = 0; i < num_hazards && !in_use; i++) {
+            in_use = __atomic_load_n(&hazards[i].lex, __ATOMIC_SEQ_CST) == lex;
+        }
+        if(in_use) {
+            pp = &lex->next;
+        }
+        else {
+            *pp = lex->next;
+            LOG(LOG_DEBUG, "Freed word list %u\n", lex->generation);
+            lexicon_free(lex);
+        }
+    }
+}
+
+
+/* Load the dictionary again and, if that works, make it the one new games
+ * pick from. On failure the current list stays in place.
+ */
+static void reload(struct reloader *r) {
+    long long start = now_ms();
+    struct lexicon *lex = lexicon_load(r->path, &r->policy);
+    if(lex == NULL) {
+        LOG(LOG_WARN, "Cannot reload %s; keeping the current word list\n", r->path);
+        return;
+    }
+    lex->generation = current->generation + 1;
+    struct lexicon *old = __atomic_exchange_n(&current, lex, __ATOMIC_SEQ_CST);
+    old->next = r->retired;
+    r->retired = old;
+    LOG(LOG_INFO, "Reloaded %s in %lld ms\n", r->path, now_ms() - start);
+}
+
+
+static void *reload_thread(void *arg) {
+    struct reloader *r = arg;
+    struct pollfd pfd;
+    pfd.fd = r->sigfd;
+    pfd.events = POLLIN;
+
+    while(1) {
+        int timeout = r->retired != NULL ? RECLAIM_INTERVAL_MS : -1;
+        if(poll(&pfd, 1, timeout) < 0) {
+            if(errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        if(pfd.revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if(read(r->sigfd, &si, sizeof(si)) == sizeof(si)) {
+                reload(r);
+            }
+        }
+        reclaim(r);
+    }
+    return NULL;
+}
+
+
+/* Make lex the list new games pick from, give num_readers threads a
+ * hazard slot each, and start the thread that reloads path with policy on
+ * SIGHUP. SIGHUP is blocked in the calling thread, so this must run before
+ * the other threads are created for them to inherit that.
+ * Return 0 on success and -1 on failure.
+ */
+int lexicon_start(struct lexicon *lex, const char *path,
+                  const struct select_policy *policy, int num_readers) {
+    if(posix_memalign((void **)&hazards, 64, num_readers * sizeof(struct hazard)) != 0) {
+        fprintf(stderr, "Cannot allocate hazard slots\n");
+        return -1;
+    }
+    memset(hazards, 0, num_readers * sizeof(struct hazard));
+    num_hazards = num_readers;
+    current = lex;
+
+    struct reloader *r = calloc(1, sizeof(struct reloader));
+    if(r == NULL || (r->path = strdup(path)) == NULL) {
+        perror("malloc");
+        free(r);
+        return -1;
+    }
+    r->policy = *policy;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    r->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if(r->sigfd < 0) {
+        perror("signalfd");
+        free(r->path);
+        free(r);
+        return -1;
+    }
+
+    // the reload thread takes no signals, so that none meant for another
+    // thread's signalfd is delivered to it instead
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, reload_thread, r);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        close(r->sigfd);
+        free(r->path);
+        free(r);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef _LEXICON_H_
+#define _LEXICON_H_
+
+#include "dict.h"
+#include "wordsel.h"
+#include "match.h"
+
+/* The word list in use: a dictionary with its indexes and selector. On
+ * SIGHUP a thread of its own loads and indexes the file again and then
+ * publishes the result by swapping a single pointer, so the shards never
+ * wait for a reload.
+ *
+ * Shards only look at the word list while starting a game, since a game
+ * keeps a copy of its word, and while answering a hint or moving a bot.
+ * For that moment a shard names the list it is using in a hazard slot of
+ * its own. A replaced list is freed once no slot names it any more; games
+ * already under way are not affected at all.
+ */
+
+struct lexicon {
+    struct dictionary dict;
+    struct word_index index;
+    struct match_index match;     // For hints and bots
+    struct selector sel;
+    unsigned generation;          // 1 at startup, one more for each reload
+    struct lexicon *next;         // Replaced lists waiting to be freed
+};
+
+struct lexicon *lexicon_load(const char *path, const struct select_policy *policy);
+void lexicon_free(struct lexicon *lex);
+int lexicon_start(struct lexicon *lex, const char *path,
+                  const struct select_policy *policy, int num_readers);
+const struct lexicon *lexicon_enter(int reader);
+void lexicon_exit(int reader);
+
+#endif
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+/* The ring is a bounded queue after Dmitry Vyukov's design. Every cell has
+ * a sequence number telling whose turn it is: a producer claims the next
+ * position with a compare-and-swap, fills the cell and then publishes it
+ * by bumping the sequence; the single consumer (the log thread) takes
+ * cells in order and hands them back the same way. Producers never wait
+ * for anybody else.
+ *
+ * A cell stores its sequence number minus its index, so the zeroed ring
+ * is already in its starting state and records can be logged before the
+ * log thread starts.
+ *
+ * With nothing to write, the log thread sleeps on an eventfd until a
+ * producer wakes it. Only a producer that finds it asleep makes that
+ * system call, so while records keep coming nobody does.
+ */
+
+#define LOG_RING_SIZE 4096        // Cells; a power of two
+#define LOG_DATA 200              // Bytes of captured arguments per record
+
+struct log_record {
+    size_t seq;                   // Sequence number minus the cell's index
+    const char *fmt;
+    struct timespec ts;
+    int level;
+    int len;                      // Bytes used in data
+    char data[LOG_DATA];
+};
+
+/* One conversion in a format string. */
+struct spec {
+    const char *start;            // The '%'
+    int len;                      // Characters up to and including conv
+    int length;                   // 0, 'H' (hh), 'h', 'l', 'L' (ll) or 'z'
+    char conv;
+};
+
+int log_level = LOG_INFO;
+
+static struct log_record ring[LOG_RING_SIZE];
+static size_t enqueue_pos;
+static size_t dequeue_pos;
+static unsigned long long dropped;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_fd = -1;          // The eventfd the idle log thread sleeps on
+static int asleep;                // 1 while the log thread may be sleeping
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+
+/* Find the next conversion in fmt and describe it in *s.
+ * Return a pointer to the character after it, or NULL if there is none.
+ */
+static const char *next_spec(const char *fmt, struct spec *s) {
+    const char *p = strchr(fmt, '%');
+    if(p == NULL) {
+        return NULL;
+    }
+    s->start = p++;
+    if(*p == '%') {
+        s->conv = '%';
+        s->length = 0;
+        s->len = 2;
+        return p + 1;
+    }
+    p += strspn(p, "-+ #0");
+    p += strspn(p, "0123456789");
+    if(*p == '.') {
+        p++;
+        p += strspn(p, "0123456789");
+    }
+    s->length = 0;
+    if(p[0] == 'h' && p[1] == 'h') {
+        s->length = 'H';
+        p += 2;
+    } else if(p[0] == 'l' && p[1] == 'l') {
+        s->length = 'L';
+        p += 2;
+    } else if(*p == 'h' || *p == 'l' || *p == 'z') {
+        s->length = *p++;
+    }
+    s->conv = *p;
+    if(*p == '\0') {
+        return NULL;
+    }
+    s->len = p + 1 - s->start;
+    return p + 1;
+}
+
+
+static int is_signed_conv(char c) {
+    return c == 'd' || c == 'i';
+}
+
+
+static int is_unsigned_conv(char c) {
+    return c == 'u' || c == 'x' || c == 'X' || c == 'o';
+}
+
+
+static int is_float_conv(char c) {
+    return c == 'f' || c == 'g' || c == 'e' || c == 'F' || c == 'G' || c == 'E';
+}
+
+
+/* Copy the arguments described by fmt from ap into r->data.
+ */
+static void capture(struct log_record *r, const char *fmt, va_list ap) {
+    char *d = r->data;
+    char *end = r->data + LOG_DATA;
+    struct spec s;
+    while((fmt = next_spec(fmt, &s)) != NULL) {
+        if(s.conv == '%') {
+            continue;
+        }
+        if(s.conv == 's') {
+            const char *str = va_arg(ap, const char *);
+            if(str == NULL) {
+                str = "(null)";
+            }
+            // store the string with its terminator, cut to fit
+            size_t room = end - d;
+            size_t n = strlen(str);
+            if(room == 0) {
+                continue;
+            }
+            if(n > room - 1) {
+                n = room - 1;
+            }
+            memcpy(d, str, n);
+            d[n] = '\0';
+            d += n + 1;
+            continue;
+        }
+
+        union {
+            long long i;
+            unsigned long long u;
+            double f;
+            void *p;
+        } v;
+        if(is_signed_conv(s.conv) || s.conv == 'c') {
+            if(s.length == 'l') {
+                v.i = va_arg(ap, long);
+            } else if(s.length == 'L') {
+                v.i = va_arg(ap, long long);
+            } else if(s.length == 'z') {
+                v.i = va_arg(ap, ssize_t);
+            } else {
+                v.i = va_arg(ap, int);
+            }
+        } else if(is_unsigned_conv(s.conv)) {
+            if(s.length == 'l') {
+                v.u = va_arg(ap, unsigned long);
+            } else if(s.length == 'L') {
+                v.u = va_arg(ap, unsigned long long);
+            } else if(s.length == 'z') {
+                v.u = va_arg(ap, size_t);
+            } else {
+                v.u = va_arg(ap, unsigned int);
+            }
+        } else if(is_float_conv(s.conv)) {
+            v.f = va_arg(ap, double);
+        } else {
+            v.p = va_arg(ap, void *);
+        }
+        if(end - d < (long)sizeof(v)) {
+            // no room; the formatter stops at the same point
+            break;
+        }
+        memcpy(d, &v, sizeof(v));
+        d += sizeof(v);
+    }
+    r->len = d - r->data;
+}
+
+
+/* Format record r into buf, which has room for size bytes.
+ * Return the number of bytes used.
+ */
+static int format_record(struct log_record *r, char *buf, int size) {
+    struct tm tm;
+    gmtime_r(&r->ts.tv_sec, &tm);
+    int n = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    n += snprintf(buf + n, size - n, ".%06ld %-5s ", r->ts.tv_nsec / 1000,
+                  level_names[r->level]);
+
+    const char *d = r->data;
+    const char *end = r->data + r->len;
+    const char *fmt = r->fmt;
+    const char *next;
+    struct spec s;
+    while(1) {
+        // snprintf returns the length it wanted, which may not have fit
+        if(n > size - 1) {
+            n = size - 1;
+        }
+        if(n == size - 1 || (next = next_spec(fmt, &s)) == NULL) {
+            break;
+        }
+        // the text before the conversion
+        int lit = s.start - fmt;
+        if(lit > size - 1 - n) {
+            lit = size - 1 - n;
+        }
+        memcpy(buf + n, fmt, lit);
+        n += lit;
+        fmt = next;
+        if(s.conv == '%') {
+            n += snprintf(buf + n, size - n, "%%");
+            continue;
+        }
+
+        // rebuild the conversion without its length modifier, since every
+        // captured integer was widened to long long
+        char conv[32];
+        int body = s.len - 1 - (s.length == 'H' || s.length == 'L' ? 2 : s.length ? 1 : 0);
+        if(body >= (int)sizeof(conv) - 4) {
+            body = sizeof(conv) - 4;
+        }
+        memcpy(conv, s.start, body);
+        int c = body;
+        if(is_signed_conv(s.conv) || is_unsigned_conv(s.conv)) {
+            conv[c++] = 'l';
+            conv[c++] = 'l';
+        }
+        conv[c++] = s.conv;
+        conv[c] = '\0';
+
+        if(s.conv == 's') {
+            if(d >= end) {
+                break;
+            }
+            n += snprintf(buf + n, size - n, conv, d);
+            d += strlen(d) + 1;
+            continue;
+        }
+        if(end - d < 8) {
+            break;
+        }
+        union {
+            long long i;
+            unsigned long long u;
+            double f;
+            void *p;
+        } v;
+        memcpy(&v, d, sizeof(v));
+        d += sizeof(v);
+        if(is_signed_conv(s.conv)) {
+            n += snprintf(buf + n, size - n, conv, v.i);
+        } else if(s.conv == 'c') {
+            n += snprintf(buf + n, size - n, conv, (int)v.i);
+        } else if(is_unsigned_conv(s.conv)) {
+            n += snprintf(buf + n, size - n, conv, v.u);
+        } else if(is_float_conv(s.conv)) {
+            n += snprintf(buf + n, size - n, conv, v.f);
+        } else {
+            n += snprintf(buf + n, size - n, conv, v.p);
+        }
+    }
+    if(n > size - 1) {
+        n = size - 1;
+    }
+    if(n < size - 1) {
+        // the text after the last conversion
+        int rest = strlen(fmt);
+        if(rest > size - 1 - n) {
+            rest = size - 1 - n;
+        }
+        memcpy(buf + n, fmt, rest);
+        n += rest;
+    }
+    if(n > size - 1) {
+        n = size - 1;
+    }
+    // messages carry no newline of their own
+    while(n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) {
+        n--;
+    }
+    buf[n++] = '\n';
+    return n;
+}
+
+
+/* Queue a record for fmt and its arguments. Safe to call from any thread.
+ */
+void log_emit(int level, const char *fmt, ...) {
+    size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    struct log_record *r;
+    while(1) {
+        size_t idx = pos & (LOG_RING_SIZE - 1);
+        r = &ring[idx];
+        size_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + idx;
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // the log thread is a whole ring behind
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &r->ts);
+    r->fmt = fmt;
+    r->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    capture(r, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->seq, pos + 1 - (pos & (LOG_RING_SIZE - 1)), __ATOMIC_RELEASE);
+
+    // the log thread looks at the ring again after saying it is asleep,
+    // so either it sees this record or this sees it asleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&asleep, __ATOMIC_RELAXED)
+       && __atomic_exchange_n(&asleep, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if(write(wake_fd, &one, sizeof(one)) < 0) {
+            // nowhere to say so; the record is written with the next wakeup
+        }
+    }
+}
+
+
+/* Format and write every queued record.
+ * Return the number written.
+ */
+static int drain(void) {
+    char line[1024];
+    int count = 0;
+    // only the log thread drains, except at exit
+    pthread_mutex_lock(&drain_lock);
+    while(1) {
+        size_t idx = dequeue_pos & (LOG_RING_SIZE - 1);
+        struct log_record *r = &ring[idx];
+        if(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) + idx != dequeue_pos + 1) {
+            break;
+        }
+        int n = format_record(r, line, sizeof(line));
+        __atomic_store_n(&r->seq, dequeue_pos + LOG_RING_SIZE - idx, __ATOMIC_RELEASE);
+        dequeue_pos++;
+        fwrite(line, 1, n, stdout);
+        count++;
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+
+static void *log_thread(void *arg) {
+    unsigned long long reported = 0;
+    while(1) {
+        if(drain() > 0) {
+            continue;
+        }
+        unsigned long long d = log_dropped();
+        if(d != reported) {
+            fprintf(stdout, "log: dropped %llu records\n", d - reported);
+            reported = d;
+        }
+        fflush(stdout);
+
+        // a record queued before asleep was set woke nobody, so look once
+        // more before sleeping
+        __atomic_store_n(&asleep, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(drain() == 0) {
+            uint64_t rung;
+            if(read(wake_fd, &rung, sizeof(rung)) < 0) {
+                perror("read eventfd");
+            }
+        }
+        __atomic_store_n(&asleep, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+
+/* Write out what is still queued when the process exits.
+ */
+static void log_flush_at_exit(void) {
+    drain();
+    fflush(stdout);
+}
+
+
+/* Start the log thread. Records logged before this are kept and written
+ * once it runs. Return 0 on success and -1 on failure.
+ */
+int log_start(void) {
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(wake_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, log_thread, NULL);
+    if(err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(log_flush_at_exit);
+    return 0;
+}
+
+
+/* Return the level called name, or -1 if there is none.
+ */
+int log_parse_level(const char *name) {
+    for(int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if(strcasecmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+unsigned long long log_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,40 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+/* Asynchronous logging. LOG captures its arguments into a fixed-size
+ * binary record in a lock-free ring and returns; a background thread does
+ * the formatting and the writing. When the ring is full the record is
+ * dropped and counted instead of making the caller wait.
+ *
+ * The format must be a string literal: only the pointer is stored. It
+ * supports the usual conversions (d i u x X o c s p f g e and %%) with
+ * flags, width, precision and the hh h l ll z modifiers, but not '*'.
+ * Strings are copied, and cut short if the record runs out of room.
+ */
+
+#define LOG_DEBUG 0
+#define LOG_INFO  1
+#define LOG_WARN  2
+#define LOG_ERROR 3
+
+// Calls below this level compile to nothing
+#ifndef LOG_COMPILE_LEVEL
+    #define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+// Calls below this level are skipped at run time
+extern int log_level;
+
+#define LOG(level, ...) do { \
+        if((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) { \
+            log_emit((level), __VA_ARGS__); \
+        } \
+    } while(0)
+
+void log_emit(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int log_start(void);
+int log_parse_level(const char *name);
+unsigned long long log_dropped(void);
+
+#endif
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "match.h"
+
+#define LANES (MATCH_VEC_BITS / 64)
+// Below this many fitting words per vector, their letters are added up one
+// word at a time instead of a letter at a time over the whole bitset
+#define SCAN_PER_VEC 16
+// Byte counts of this many vectors add up to at most 248 a byte
+#define FOLD_EVERY 31
+
+
+/* Return n zeroed vectors, or NULL if memory ran out.
+ */
+static match_vec *new_bitsets(size_t n) {
+    match_vec *v;
+    if(posix_memalign((void **)&v, sizeof(match_vec), n * sizeof(match_vec)) != 0) {
+        return NULL;
+    }
+    memset(v, 0, n * sizeof(match_vec));
+    return v;
+}
+
+
+static void set_bit(match_vec *set, uint32_t i) {
+    set[i / MATCH_VEC_BITS][i / 64 % LANES] |= 1ULL << (i % 64);
+}
+
+
+/* Count the bits of each byte of x, in that byte. Bits are counted this
+ * way, a whole vector at a time, rather than with a popcount instruction
+ * that the build may not be allowed to use.
+ */
+static match_vec byte_counts(match_vec x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    return (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+}
+
+
+/* Return the sum of the bytes of x.
+ */
+static uint32_t sum_bytes(match_vec x) {
+    x = (x & 0x00ff00ff00ff00ffULL) + ((x >> 8) & 0x00ff00ff00ff00ffULL);
+    uint32_t sum = 0;
+    for(int l = 0; l < LANES; l++) {
+        sum += (x[l] * 0x0001000100010001ULL) >> 48;
+    }
+    return sum;
+}
+
+
+/* Return the number of bits set in both of the n vectors of a and b.
+ */
+static uint32_t count_both(const match_vec *a, const match_vec *b, uint32_t n) {
+    uint32_t count = 0;
+    for(uint32_t v = 0; v < n; v += FOLD_EVERY) {
+        uint32_t end = v + FOLD_EVERY < n ? v + FOLD_EVERY : n;
+        match_vec bytes = {0};
+        for(uint32_t i = v; i < end; i++) {
+            bytes += byte_counts(a[i] & b[i]);
+        }
+        count += sum_bytes(bytes);
+    }
+    return count;
+}
+
+
+static int is_empty(match_vec x) {
+    uint64_t any = 0;
+    for(int l = 0; l < LANES; l++) {
+        any |= x[l];
+    }
+    return any == 0;
+}
+
+
+static const match_vec *at(const struct match_bucket *b, int pos, char letter) {
+    return b->at + (size_t)(pos * NUM_LETTERS + letter - 'a') * b->num_vecs;
+}
+
+
+/* Build the bitsets of every length of idx's words, which must outlive mi.
+ * Return 0 on success and -1 on failure.
+ */
+int match_index_build(struct match_index *mi, const struct word_index *idx) {
+    memset(mi, 0, sizeof(*mi));
+    mi->dict = idx->dict;
+    for(int len = 1; len < SEL_MAX_LEN; len++) {
+        struct match_bucket *b = &mi->buckets[len];
+        b->words = idx->by_length + idx->length_start[len];
+        b->count = idx->length_start[len + 1] - idx->length_start[len];
+        if(b->count == 0) {
+            continue;
+        }
+        size_t n = b->num_vecs = (b->count + MATCH_VEC_BITS - 1) / MATCH_VEC_BITS;
+        b->at = new_bitsets(len * NUM_LETTERS * n);
+        b->has = new_bitsets(NUM_LETTERS * n);
+        b->other = new_bitsets(len * n);
+        b->all = new_bitsets(n);
+        b->letters = malloc(b->count * sizeof(uint32_t));
+        if(b->at == NULL || b->has == NULL || b->other == NULL || b->all == NULL
+           || b->letters == NULL) {
+            perror("match_index_build");
+            match_index_free(mi);
+            return -1;
+        }
+
+        for(uint32_t i = 0; i < b->count; i++) {
+            int word_len;
+            const char *w = dict_word(idx->dict, b->words[i], &word_len);
+            uint32_t mask = 0;
+            int plain = 1;
+            for(int j = 0; j < len; j++) {
+                if(w[j] >= 'a' && w[j] <= 'z') {
+                    set_bit(b->at + (size_t)(j * NUM_LETTERS + w[j] - 'a') * n, i);
+                    mask |= LETTER_BIT(w[j]);
+                }
+                else {
+                    set_bit(b->other + j * n, i);
+                    plain = 0;
+                }
+            }
+            set_bit(b->all, i);
+            b->letters[i] = mask;
+            b->plain += plain;
+            for(uint32_t m = mask; m != 0; m &= m - 1) {
+                set_bit(b->has + __builtin_ctz(m) * n, i);
+                b->containing[__builtin_ctz(m)] += plain;
+            }
+        }
+    }
+    return 0;
+}
+
+
+void match_index_free(struct match_index *mi) {
+    for(int len = 0; len < SEL_MAX_LEN; len++) {
+        struct match_bucket *b = &mi->buckets[len];
+        free(b->at);
+        free(b->has);
+        free(b->other);
+        free(b->all);
+        free(b->letters);
+    }
+    memset(mi, 0, sizeof(*mi));
+}
+
+
+/* Clear the words in fits, a bitset of bucket b, that have something other
+ * than what word has at a shown position that is not a letter. Return how
+ * many there were.
+ */
+static uint32_t check_others(const struct match_index *mi, const struct match_bucket *b,
+                         uint32_t others, const char *word, match_vec *fits) {
+    uint32_t cleared = 0;
+    for(uint32_t v = 0; v < b->num_vecs; v++) {
+        for(int l = 0; l < LANES; l++) {
+            for(uint64_t bits = fits[v][l]; bits != 0; bits &= bits - 1) {
+                int bit = __builtin_ctzll(bits);
+                int len;
+                const char *w = dict_word(mi->dict, b->words[v * MATCH_VEC_BITS + l * 64 + bit],
+                                          &len);
+                for(uint32_t m = others; m != 0; m &= m - 1) {
+                    if(w[__builtin_ctz(m)] != word[__builtin_ctz(m)]) {
+                        fits[v][l] &= ~(1ULL << bit);
+                        cleared++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return cleared;
+}
+
+
+/* Find the words of len letters that fit a board: the positions in shown
+ * show what word has there, which is not looked at anywhere else, and the
+ * letters in guessed were guessed. Count them into r, and count how many
+ * contain each letter not guessed yet.
+ */
+void match_board(const struct match_index *mi, int len, uint32_t shown,
+                 const char *word, uint32_t guessed, struct match_result *r) {
+    memset(r, 0, sizeof(*r));
+    if(len <= 0 || len >= SEL_MAX_LEN || mi->buckets[len].count == 0) {
+        return;
+    }
+    const struct match_bucket *b = &mi->buckets[len];
+    uint32_t n = b->num_vecs;
+    if(shown == 0 && guessed == 0) {
+        // a new game: every word of letters only fits
+        r->count = b->plain;
+        memcpy(r->containing, b->containing, sizeof(r->containing));
+        return;
+    }
+
+    // the letters shown are the guesses that hit; shown positions that
+    // are not letters are checked word by word, as they are rare
+    uint32_t hits = 0;
+    uint32_t others = 0;
+    for(uint32_t m = shown; m != 0; m &= m - 1) {
+        int j = __builtin_ctz(m);
+        if(word[j] >= 'a' && word[j] <= 'z') {
+            hits |= LETTER_BIT(word[j]);
+        }
+        else {
+            others |= 1u << j;
+        }
+    }
+
+    // the bitsets a word has to be in, and the ones it must not be in
+    const match_vec *keep[SEL_MAX_LEN];
+    const match_vec *drop[SEL_MAX_LEN * (NUM_LETTERS + 1) + NUM_LETTERS];
+    int num_keep = 0, num_drop = 0;
+    for(int j = 0; j < len; j++) {
+        if(shown & (1u << j)) {
+            keep[num_keep++] = others & (1u << j) ? b->other + j * n : at(b, j, word[j]);
+            continue;
+        }
+        drop[num_drop++] = b->other + j * n;
+        for(uint32_t m = hits; m != 0; m &= m - 1) {
+            drop[num_drop++] = at(b, j, 'a' + __builtin_ctz(m));
+        }
+    }
+    for(uint32_t m = guessed & ~hits; m != 0; m &= m - 1) {
+        drop[num_drop++] = b->has + __builtin_ctz(m) * n;
+    }
+
+    // the words counted as they are found, a byte at a time for a while
+    match_vec fits[n];
+    match_vec bytes = {0};
+    for(uint32_t v = 0; v < n; v++) {
+        if(v % FOLD_EVERY == 0) {
+            r->count += sum_bytes(bytes);
+            bytes = (match_vec){0};
+        }
+        match_vec x = b->all[v];
+        for(int k = 0; k < num_keep; k++) {
+            x &= keep[k][v];
+        }
+        // most words are out once the letters shown are checked
+        for(int k = 0; k < num_drop && !is_empty(x); k++) {
+            x &= ~drop[k][v];
+        }
+        fits[v] = x;
+        bytes += byte_counts(x);
+    }
+    r->count += sum_bytes(bytes);
+    if(others != 0) {
+        r->count -= check_others(mi, b, others, word, fits);
+    }
+
+    uint32_t open = ~guessed & (LETTER_BIT('z') * 2 - 1);
+    if(r->count < SCAN_PER_VEC * n) {
+        /* Few words: add up their letter masks in counters kept bit-sliced,
+         * bit c of plane[k] being bit k of the count of letter c, so that
+         * adding a word is a ripple carry through a plane or two.
+         */
+        uint32_t plane[32] = {0};
+        for(uint32_t v = 0; v < n; v++) {
+            for(int l = 0; l < LANES; l++) {
+                for(uint64_t bits = fits[v][l]; bits != 0; bits &= bits - 1) {
+                    uint32_t carry = b->letters[v * MATCH_VEC_BITS + l * 64 + __builtin_ctzll(bits)];
+                    for(int k = 0; carry != 0; k++) {
+                        uint32_t next = plane[k] & carry;
+                        plane[k] ^= carry;
+                        carry = next;
+                    }
+                }
+            }
+        }
+        for(int k = 0; k < 32; k++) {
+            for(uint32_t m = plane[k] & open; m != 0; m &= m - 1) {
+                r->containing[__builtin_ctz(m)] += 1u << k;
+            }
+        }
+        return;
+    }
+    for(uint32_t m = open; m != 0; m &= m - 1) {
+        int c = __builtin_ctz(m);
+        r->containing[c] = count_both(fits, b->has + c * n, n);
+    }
+}
+
+
+/* Return the letter, as 0 for 'a' and so on, that the most words in r
+ * contain, the earliest in the alphabet of those tied, or -1 if no letter
+ * left is in any of them.
+ */
+int match_best_letter(const struct match_result *r) {
+    int best = -1;
+    for(int c = 0; c < NUM_LETTERS; c++) {
+        if(r->containing[c] > 0 && (best < 0 || r->containing[c] > r->containing[best])) {
+            best = c;
+        }
+    }
+    return best;
+}
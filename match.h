@@ -0,0 +1,64 @@
+#ifndef _MATCH_H_
+#define _MATCH_H_
+
+#include <stdint.h>
+
+#include "gameplay.h"
+#include "wordsel.h"
+
+/* Finding the words that fit a board, for hints and bot players. A
+ * match_index is built with the word_index of a word list. Each length
+ * gets a bucket: the run of by_length holding the words of that length,
+ * with bitsets over them in which bit i stands for the i-th word of the
+ * run:
+ *
+ *   at[pos][letter]   the words with letter at pos
+ *   has[letter]       the words with letter anywhere
+ *   other[pos]        the words with something other than a-z at pos
+ *   all               every word
+ *
+ * A board is what the players see: which positions are shown and what is
+ * there, and which letters were guessed. A word fits if it has every shown
+ * letter where it is shown, none of the letters that missed, and no
+ * guessed letter, nor anything other than a-z, at a hidden position; so
+ * the words that fit are the AND and ANDNOT of a handful of bitsets, taken
+ * MATCH_VEC_BITS bits at a time.
+ */
+
+#define MATCH_VEC_BITS 128
+
+// What the compiler turns into the widest AND and ANDNOT it has
+typedef uint64_t match_vec __attribute__((vector_size(MATCH_VEC_BITS / 8)));
+
+struct match_bucket {
+    const uint32_t *words;        // Word numbers, a run of by_length
+    uint32_t count;
+    uint32_t num_vecs;            // Vectors in each bitset
+    match_vec *at;                // [pos][letter][vec]
+    match_vec *has;               // [letter][vec]
+    match_vec *other;             // [pos][vec]
+    match_vec *all;               // Every word of the bucket
+    uint32_t *letters;            // Letter mask of each word, LETTER_BIT style
+    uint32_t plain;               // Words of nothing but a-z, which fit a new game
+    uint32_t containing[NUM_LETTERS]; // Of those, the ones with each letter
+};
+
+struct match_index {
+    const struct dictionary *dict;
+    struct match_bucket buckets[SEL_MAX_LEN];
+};
+
+/* What the words that fit a board have in common. */
+struct match_result {
+    uint32_t count;               // Words that fit
+    uint32_t containing[NUM_LETTERS]; // Of those, the ones with each letter
+                                  // not guessed yet; 0 for guessed letters
+};
+
+int match_index_build(struct match_index *mi, const struct word_index *idx);
+void match_index_free(struct match_index *mi);
+void match_board(const struct match_index *mi, int len, uint32_t shown,
+                 const char *word, uint32_t guessed, struct match_result *r);
+int match_best_letter(const struct match_result *r);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Metrics are written in the Prometheus text format, one series per shard.
+ * Histograms list only their non-empty buckets, cumulatively, with the
+ * largest value each bucket holds as its upper bound.
+ */
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "wordsrv_connections_accepted_total",
+    "wordsrv_connections_removed_total",
+    "wordsrv_bytes_in_total",
+    "wordsrv_bytes_out_total",
+    "wordsrv_write_errors_total",
+    "wordsrv_short_writes_total",
+    "wordsrv_games_started_total",
+    "wordsrv_games_finished_total",
+    "wordsrv_guesses_total",
+    "wordsrv_turn_timeouts_total",
+    "wordsrv_idle_timeouts_total",
+};
+
+static const char *gauge_names[NUM_GAUGES] = {
+    "wordsrv_client_slots_in_use",
+    "wordsrv_client_slots_high_water",
+    "wordsrv_client_slots",
+};
+
+static const char *histogram_names[NUM_HISTOGRAMS] = {
+    "wordsrv_loop_iteration_ns",
+    "wordsrv_process_guess_ns",
+    "wordsrv_think_time_ns",
+};
+
+struct stats_server {
+    struct metrics *all;
+    int n;
+    int listenfd;             // Unix socket, or -1
+    int sigfd;                // Delivers SIGUSR1
+};
+
+
+/* Return the largest value counted in bucket b.
+ */
+static uint64_t bucket_limit(int b) {
+    if(b < (1 << HIST_SUB_BITS)) {
+        return b;
+    }
+    int shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    uint64_t lower = ((1ULL << HIST_SUB_BITS) | sub) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+
+static uint64_t load(const uint64_t *v) {
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+
+/* Write the metrics of all n shards to fp.
+ */
+void metrics_dump(FILE *fp, struct metrics *all, int n) {
+    for(int c = 0; c < NUM_COUNTERS; c++) {
+        fprintf(fp, "# TYPE %s counter\n", counter_names[c]);
+        for(int s = 0; s < n; s++) {
+            fprintf(fp, "%s{shard=\"%d\"} %llu\n", counter_names[c], s,
+                    (unsigned long long)load(&all[s].counters[c]));
+        }
+    }
+    for(int g = 0; g < NUM_GAUGES; g++) {
+        fprintf(fp, "# TYPE %s gauge\n", gauge_names[g]);
+        for(int s = 0; s < n; s++) {
+            fprintf(fp, "%s{shard=\"%d\"} %llu\n", gauge_names[g], s,
+                    (unsigned long long)load(&all[s].gauges[g]));
+        }
+    }
+    for(int h = 0; h < NUM_HISTOGRAMS; h++) {
+        const char *name = histogram_names[h];
+        fprintf(fp, "# TYPE %s histogram\n", name);
+        for(int s = 0; s < n; s++) {
+            struct histogram *hist = &all[s].hists[h];
+            uint64_t total = 0;
+            for(int b = 0; b < HIST_BUCKETS; b++) {
+                uint64_t count = load(&hist->counts[b]);
+                if(count == 0) {
+                    continue;
+                }
+                total += count;
+                fprintf(fp, "%s_bucket{shard=\"%d\",le=\"%llu\"} %llu\n", name, s,
+                        (unsigned long long)bucket_limit(b), (unsigned long long)total);
+            }
+            fprintf(fp, "%s_bucket{shard=\"%d\",le=\"+Inf\"} %llu\n", name, s,
+                    (unsigned long long)total);
+            fprintf(fp, "%s_sum{shard=\"%d\"} %llu\n", name, s,
+                    (unsigned long long)load(&hist->sum));
+            fprintf(fp, "%s_count{shard=\"%d\"} %llu\n", name, s,
+                    (unsigned long long)total);
+        }
+    }
+}
+
+
+/* Send a dump to the client connected on fd, then hang up.
+ */
+static void serve_client(struct stats_server *srv, int fd) {
+    char *text;
+    size_t len;
+    FILE *fp = open_memstream(&text, &len);
+    if(fp == NULL) {
+        perror("open_memstream");
+        close(fd);
+        return;
+    }
+    metrics_dump(fp, srv->all, srv->n);
+    fclose(fp);
+
+    size_t off = 0;
+    while(off < len) {
+        ssize_t w = write(fd, text + off, len - off);
+        if(w < 0 && errno == EINTR) {
+            continue;
+        }
+        if(w <= 0) {
+            break;
+        }
+        off += w;
+    }
+    free(text);
+    close(fd);
+}
+
+
+static void *stats_thread(void *arg) {
+    struct stats_server *srv = arg;
+    struct pollfd fds[2];
+    fds[0].fd = srv->sigfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = srv->listenfd;
+    fds[1].events = POLLIN;
+    int nfds = srv->listenfd >= 0 ? 2 : 1;
+
+    while(1) {
+        if(poll(fds, nfds, -1) < 0) {
+            if(errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        if(fds[0].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if(read(srv->sigfd, &si, sizeof(si)) == sizeof(si)) {
+                metrics_dump(stderr, srv->all, srv->n);
+                fflush(stderr);
+            }
+        }
+        if(nfds == 2 && (fds[1].revents & POLLIN)) {
+            int fd = accept(srv->listenfd, NULL, NULL);
+            if(fd >= 0) {
+                serve_client(srv, fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/* Start the thread that dumps the metrics of the n shards in all to stderr
+ * on SIGUSR1 and, if path is not NULL, to every client of a Unix socket
+ * at path. SIGUSR1 is blocked in the calling thread, so this must run
+ * before the other threads are created for them to inherit that.
+ * Return 0 on success and -1 on failure.
+ */
+int metrics_start(struct metrics *all, int n, const char *path) {
+    struct stats_server *srv = malloc(sizeof(struct stats_server));
+    if(srv == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    srv->all = all;
+    srv->n = n;
+    srv->listenfd = -1;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    srv->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if(srv->sigfd < 0) {
+        perror("signalfd");
+        free(srv);
+        return -1;
+    }
+
+    if(path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "%s: stats socket path too long\n", path);
+            goto fail;
+        }
+        strcpy(addr.sun_path, path);
+        srv->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(srv->listenfd < 0) {
+            perror("socket");
+            goto fail;
+        }
+        // a socket left behind by an earlier run would make bind fail
+        unlink(path);
+        if(bind(srv->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+           || listen(srv->listenfd, 16) < 0) {
+            perror(path);
+            goto fail;
+        }
+    }
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, stats_thread, srv);
+    if(err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        goto fail;
+    }
+    pthread_detach(thread);
+    return 0;
+
+fail:
+    if(srv->listenfd >= 0) {
+        close(srv->listenfd);
+    }
+    close(srv->sigfd);
+    free(srv);
+    return -1;
+}
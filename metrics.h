@@ -0,0 +1,96 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Counters, gauges and latency histograms kept by every shard. Only the shard's
+ * own thread updates its metrics, so an update is a plain add published
+ * with a relaxed atomic store: no locks, no read-modify-write and no
+ * allocation. The stats thread reads them with relaxed loads and may see
+ * a histogram mid-update, which is off by at most one sample.
+ */
+
+enum counter {
+    M_ACCEPTED,               // Connections accepted
+    M_REMOVED,                // Connections closed
+    M_BYTES_IN,
+    M_BYTES_OUT,
+    M_WRITE_ERRORS,           // Writes that failed and dropped the client
+    M_SHORT_WRITES,           // Writes the socket did not take in full
+    M_GAMES_STARTED,
+    M_GAMES_FINISHED,
+    M_GUESSES,                // Valid guesses processed
+    M_TURN_TIMEOUTS,          // Turns skipped because the player took too long
+    M_IDLE_TIMEOUTS,          // Clients dropped for not naming themselves or
+                              // not sending anything in time
+    NUM_COUNTERS
+};
+
+enum gauge {
+    G_CLIENT_SLOTS_IN_USE,    // Slots of the client pool handed out
+    G_CLIENT_SLOTS_HIGH_WATER, // The most ever in use at once
+    G_CLIENT_SLOTS,           // Slots in all of the pool's slabs
+    NUM_GAUGES
+};
+
+enum histogram_id {
+    H_LOOP,                   // One event loop iteration, in ns
+    H_GUESS,                  // One call to process_guess, in ns
+    H_THINK,                  // From a player's prompt to their guess, in ns
+    NUM_HISTOGRAMS
+};
+
+/* A log-linear histogram in the style of HdrHistogram: values below
+ * 2^HIST_SUB_BITS get a bucket each, and every power of two above that is
+ * split into 2^HIST_SUB_BITS buckets, so a bucket is never wider than
+ * 1/8 of its lower bound.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t sum;
+};
+
+struct metrics {
+    uint64_t counters[NUM_COUNTERS];
+    uint64_t gauges[NUM_GAUGES];
+    struct histogram hists[NUM_HISTOGRAMS];
+} __attribute__((aligned(64)));
+
+
+static inline void metric_add(struct metrics *m, enum counter c, uint64_t n) {
+    __atomic_store_n(&m->counters[c], m->counters[c] + n, __ATOMIC_RELAXED);
+}
+
+
+static inline void metric_set(struct metrics *m, enum gauge g, uint64_t v) {
+    __atomic_store_n(&m->gauges[g], v, __ATOMIC_RELAXED);
+}
+
+
+static inline int hist_bucket(uint64_t v) {
+    if(v < (1 << HIST_SUB_BITS)) {
+        return v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    int sub = (v >> shift) & ((1 << HIST_SUB_BITS) - 1);
+    return ((shift + 1) << HIST_SUB_BITS) | sub;
+}
+
+
+static inline void metric_record(struct metrics *m, enum histogram_id h, uint64_t v) {
+    struct histogram *hist = &m->hists[h];
+    int b = hist_bucket(v);
+    __atomic_store_n(&hist->counts[b], hist->counts[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + v, __ATOMIC_RELAXED);
+}
+
+
+void metrics_dump(FILE *fp, struct metrics *all, int n);
+int metrics_start(struct metrics *all, int n, const char *path);
+
+#endif
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "clock.h"
+#include "gameplay.h"
+#include "render.h"
+#include "input.h"
+#include "dict.h"
+#include "wordsel.h"
+#include "match.h"
+#include "log.h"
+
+/* wgg-microbench times the functions the server runs for every guess, one
+ * at a time and without any sockets: the status message, picking a word,
+ * finding a line in the input, checking and applying a guess, building
+ * the text and frames that announce turns, guesses and winners, and
+ * finding the words that fit a board for a hint or a bot.
+ *
+ * Each function first runs for a warmup period, during which the batch
+ * size grows until one batch takes at least MIN_BATCH_NS. Then a number of
+ * batches are timed, and the time per call in each batch is one sample.
+ * The results go out as JSON, one object per function with the sample
+ * statistics in nanoseconds per call.
+ */
+
+#define MIN_BATCH_NS 50000LL
+#define NAME "player_one"
+
+struct result {
+    const char *name;
+    long batch;               // Calls per sample
+    int num_samples;
+    double min, median, p99, max, mean, stddev;
+};
+
+/* The state the functions work on, set up once. */
+struct game_state game;
+struct game_state fresh;      // A game nobody has guessed in, for init_game
+struct client client;
+struct word_index word_index;
+struct selector sel;
+struct match_index match_index;
+int line_len;
+
+// What the functions return goes here, so no call can be left out
+volatile uint32_t sink;
+
+
+void run_status_message(long n) {
+    char msg[STATUS_MAX];
+    for(long i = 0; i < n; i++) {
+        status_message(msg, &game);
+        sink += msg[20];
+    }
+}
+
+
+void run_init_game(long n) {
+    for(long i = 0; i < n; i++) {
+        init_game(&fresh, &sel);
+        sink += fresh.len;
+    }
+}
+
+
+void run_scan_line(long n) {
+    char *line;
+    for(long i = 0; i < n; i++) {
+        // put back the line ending the last call cut off
+        client.inbuf[line_len - 2] = '\r';
+        client.in_start = 0;
+        client.in_end = line_len;
+        sink += scan_line(&client, &line);
+    }
+}
+
+
+void run_check_guess(long n) {
+    static const char *lines[] = {"q", "o", "ab", "Q"};
+    for(long i = 0; i < n; i++) {
+        sink += check_guess(&game, lines[i & 3]);
+    }
+}
+
+
+void run_uncover(long n) {
+    // uncovering a letter again does the same work, so the game can stay
+    for(long i = 0; i < n; i++) {
+        sink += uncover(&game, 'a' + i % NUM_LETTERS);
+    }
+}
+
+
+void run_format_turn(long n) {
+    char buf[MAX_BUF];
+    for(long i = 0; i < n; i++) {
+        sink += format_turn(buf, NAME);
+    }
+}
+
+
+void run_render_state(long n) {
+    struct frame f;
+    for(long i = 0; i < n; i++) {
+        render_state(&game, &f);
+        sink += f.len;
+    }
+}
+
+
+void run_render_turn_frame(long n) {
+    struct frame f;
+    for(long i = 0; i < n; i++) {
+        render_turn_frame(NAME, &f);
+        sink += f.len;
+    }
+}
+
+
+void run_format_guess(long n) {
+    char buf[MAX_BUF];
+    for(long i = 0; i < n; i++) {
+        sink += format_guess(buf, NAME, 'e');
+    }
+}
+
+
+void run_format_miss(long n) {
+    char buf[MAX_BUF];
+    for(long i = 0; i < n; i++) {
+        sink += format_miss(buf, 'q');
+    }
+}
+
+
+void run_render_delta(long n) {
+    struct frame f;
+    for(long i = 0; i < n; i++) {
+        render_delta(&game, NAME, 'e', 0x12, &f);
+        sink += f.len;
+    }
+}
+
+
+void run_format_win(long n) {
+    char buf[MAX_BUF];
+    for(long i = 0; i < n; i++) {
+        sink += format_win(buf, NAME);
+        sink += format_own_win(buf);
+    }
+}
+
+
+void run_format_loss(long n) {
+    char buf[MAX_BUF];
+    for(long i = 0; i < n; i++) {
+        sink += format_loss(buf, game.word);
+    }
+}
+
+
+void run_render_game_over(long n) {
+    struct frame f;
+    for(long i = 0; i < n; i++) {
+        render_game_over(&game, NAME, &f);
+        sink += f.len;
+    }
+}
+
+
+void run_match_board(long n) {
+    struct match_result r;
+    for(long i = 0; i < n; i++) {
+        match_board(&match_index, game.len, game.revealed, game.word, game.guessed, &r);
+        sink += r.count;
+    }
+}
+
+
+void run_match_early(long n) {
+    // one miss and nothing shown: nearly every word of the length fits,
+    // the most work
+    struct match_result r;
+    for(long i = 0; i < n; i++) {
+        match_board(&match_index, game.len, 0, game.word, LETTER_BIT('x'), &r);
+        sink += match_best_letter(&r);
+    }
+}
+
+
+struct bench {
+    const char *name;
+    void (*run)(long n);
+} benches[] = {
+    {"status_message", run_status_message},
+    {"init_game", run_init_game},
+    {"scan_line", run_scan_line},
+    {"check_guess", run_check_guess},
+    {"uncover", run_uncover},
+    {"format_turn", run_format_turn},
+    {"render_state", run_render_state},
+    {"render_turn_frame", run_render_turn_frame},
+    {"format_guess", run_format_guess},
+    {"format_miss", run_format_miss},
+    {"render_delta", run_render_delta},
+    {"format_win", run_format_win},
+    {"format_loss", run_format_loss},
+    {"render_game_over", run_render_game_over},
+    {"match_board", run_match_board},
+    {"match_early", run_match_early},
+};
+
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/* Warm b up for warmup_ms, then time num_samples batches of it and
+ * summarize them in *r.
+ */
+void measure(struct bench *b, int warmup_ms, int num_samples, struct result *r) {
+    long batch = 1;
+    long long until = now_ns() + warmup_ms * 1000000LL;
+    while(1) {
+        long long start = now_ns();
+        b->run(batch);
+        long long end = now_ns();
+        if(end - start < MIN_BATCH_NS) {
+            batch *= 2;
+        }
+        else if(end >= until) {
+            break;
+        }
+    }
+
+    double *v = malloc(num_samples * sizeof(double));
+    if(v == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    double sum = 0;
+    for(int i = 0; i < num_samples; i++) {
+        long long start = now_ns();
+        b->run(batch);
+        v[i] = (double)(now_ns() - start) / batch;
+        sum += v[i];
+    }
+    qsort(v, num_samples, sizeof(double), cmp_double);
+
+    r->name = b->name;
+    r->batch = batch;
+    r->num_samples = num_samples;
+    r->min = v[0];
+    r->median = v[num_samples / 2];
+    r->p99 = v[(int)(0.99 * (num_samples - 1) + 0.5)];
+    r->max = v[num_samples - 1];
+    r->mean = sum / num_samples;
+    double var = 0;
+    for(int i = 0; i < num_samples; i++) {
+        var += (v[i] - r->mean) * (v[i] - r->mean);
+    }
+    r->stddev = num_samples > 1 ? sqrt(var / (num_samples - 1)) : 0;
+    free(v);
+}
+
+
+void print_json(FILE *out, struct result *results, int n, const char *dict_path,
+                int warmup_ms) {
+    fprintf(out, "{\n  \"dictionary\": \"%s\",\n  \"warmup_ms\": %d,\n"
+            "  \"unit\": \"ns/call\",\n  \"results\": [\n", dict_path, warmup_ms);
+    for(int i = 0; i < n; i++) {
+        struct result *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"batch\": %ld, \"samples\": %d, "
+                "\"min\": %.2f, \"median\": %.2f, \"p99\": %.2f, \"max\": %.2f, "
+                "\"mean\": %.2f, \"stddev\": %.2f}%s\n",
+                r->name, r->batch, r->num_samples, r->min, r->median, r->p99,
+                r->max, r->mean, r->stddev, i + 1 < n ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+
+int main(int argc, char **argv) {
+    const char *dict_path = "dictionary.txt";
+    const char *out_path = NULL;
+    const char *only = NULL;
+    int warmup_ms = 200;
+    int num_samples = 100;
+    int opt;
+
+    while((opt = getopt(argc, argv, "D:o:w:s:f:")) != -1) {
+        switch(opt) {
+        case 'D':
+            dict_path = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'w':
+            warmup_ms = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            num_samples = strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-D dictionary] [-o json file] [-w warmup ms]\n"
+                    "       [-s samples] [-f name filter]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(warmup_ms < 0 || num_samples < 1) {
+        fprintf(stderr, "The warmup must not be negative and there must be samples\n");
+        exit(1);
+    }
+    // nobody writes the log out, so keep the functions from filling it
+    log_level = LOG_ERROR + 1;
+
+    struct dictionary dict;
+    struct select_policy policy = {0, 0, DIFF_ANY, 0};
+    if(load_dictionary(&dict, dict_path) < 0
+       || word_index_build(&word_index, &dict) < 0
+       || selector_init(&sel, &word_index, &policy) < 0
+       || match_index_build(&match_index, &word_index) < 0) {
+        fprintf(stderr, "Cannot load %s\n", dict_path);
+        exit(1);
+    }
+    fresh.rng = 0x5eed;
+    rotation_init(&fresh.rot);
+
+    // a game under way: two letters found, one miss
+    resume_game(&game, "wordgame", 8, LETTER_BIT('o') | LETTER_BIT('e') | LETTER_BIT('x'),
+                MAX_GUESSES - 1);
+    line_len = sprintf(client.inbuf, "%s\r\n", NAME);
+
+    FILE *out = stdout;
+    if(out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        perror(out_path);
+        exit(1);
+    }
+
+    int num_benches = sizeof(benches) / sizeof(benches[0]);
+    struct result results[num_benches];
+    int n = 0;
+    for(int i = 0; i < num_benches; i++) {
+        if(only != NULL && strstr(benches[i].name, only) == NULL) {
+            continue;
+        }
+        measure(&benches[i], warmup_ms, num_samples, &results[n]);
+        fprintf(stderr, "  %-18s median %8.2f  p99 %8.2f  stddev %7.2f ns/call\n",
+                results[n].name, results[n].median, results[n].p99, results[n].stddev);
+        n++;
+    }
+    print_json(out, results, n, dict_path, warmup_ms);
+    if(out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
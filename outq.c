@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "outq.h"
+#include "clock.h"
+
+#define MIN_PRIVATE_CAP 256   // Room for a few short per-client messages
+
+
+/* Return a new message holding a copy of len bytes of data, with room for
+ * at least MIN_PRIVATE_CAP bytes, or NULL if memory ran out. The caller
+ * holds the only reference.
+ */
+struct msgbuf *msgbuf_new(const char *data, int len) {
+    int cap = len > MIN_PRIVATE_CAP ? len : MIN_PRIVATE_CAP;
+    struct msgbuf *m = malloc(sizeof(struct msgbuf) + cap);
+    if(m == NULL) {
+        return NULL;
+    }
+    m->refs = 1;
+    m->len = len;
+    m->cap = cap;
+    memcpy(m->data, data, len);
+    return m;
+}
+
+
+/* Take another reference to m.
+ */
+void msgbuf_get(struct msgbuf *m) {
+    __atomic_fetch_add(&m->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Drop one reference to m, freeing it when none are left.
+ */
+void msgbuf_put(struct msgbuf *m) {
+    if(__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(m);
+    }
+}
+
+
+void outq_init(struct outq *q) {
+    q->segs = q->inline_segs;
+    q->head = 0;
+    q->count = 0;
+    q->cap = OUTQ_INLINE_SEGS;
+    q->len = 0;
+    q->since_ms = 0;
+}
+
+
+void outq_free(struct outq *q) {
+    for(int i = 0; i < q->count; i++) {
+        msgbuf_put(q->segs[(q->head + i) % q->cap].buf);
+    }
+    if(q->segs != q->inline_segs) {
+        free(q->segs);
+    }
+    outq_init(q);
+}
+
+
+/* Return the newest segment, or NULL if the queue is empty.
+ */
+static struct outseg *tail(struct outq *q) {
+    if(q->count == 0) {
+        return NULL;
+    }
+    return &q->segs[(q->head + q->count - 1) % q->cap];
+}
+
+
+/* Append a segment for m without touching its reference count.
+ * Return 0 on success and -1 if memory could not be allocated.
+ */
+static int add_segment(struct outq *q, struct msgbuf *m) {
+    if(q->count == q->cap) {
+        int cap = q->cap * 2;
+        struct outseg *segs = malloc(cap * sizeof(struct outseg));
+        if(segs == NULL) {
+            return -1;
+        }
+        // unroll the ring into the new array
+        for(int i = 0; i < q->count; i++) {
+            segs[i] = q->segs[(q->head + i) % q->cap];
+        }
+        if(q->segs != q->inline_segs) {
+            free(q->segs);
+        }
+        q->segs = segs;
+        q->head = 0;
+        q->cap = cap;
+    }
+
+    if(q->len == 0) {
+        q->since_ms = now_ms();
+    }
+    q->segs[(q->head + q->count) % q->cap].buf = m;
+    q->segs[(q->head + q->count) % q->cap].off = 0;
+    q->count++;
+    q->len += m->len;
+    return 0;
+}
+
+
+/* Queue a reference to the shared message m.
+ * Return 0 on success and -1 if memory could not be allocated.
+ */
+int outq_push(struct outq *q, struct msgbuf *m) {
+    if(m->len == 0) {
+        return 0;
+    }
+    if(add_segment(q, m) < 0) {
+        return -1;
+    }
+    msgbuf_get(m);
+    return 0;
+}
+
+
+/* Queue a copy of len bytes of data. Short messages are appended to the
+ * newest segment when this queue is its only holder, so a run of small
+ * per-client messages still goes out as one segment.
+ * Return 0 on success and -1 if memory could not be allocated.
+ */
+int outq_write(struct outq *q, const char *data, int len) {
+    if(len == 0) {
+        return 0;
+    }
+    struct outseg *t = tail(q);
+    // a sole holder stays the sole holder, so the buffer is ours to extend
+    if(t != NULL && __atomic_load_n(&t->buf->refs, __ATOMIC_ACQUIRE) == 1
+       && t->buf->cap - t->buf->len >= len) {
+        if(q->len == 0) {
+            q->since_ms = now_ms();
+        }
+        memcpy(t->buf->data + t->buf->len, data, len);
+        t->buf->len += len;
+        q->len += len;
+        return 0;
+    }
+
+    struct msgbuf *m = msgbuf_new(data, len);
+    if(m == NULL) {
+        return -1;
+    }
+    if(add_segment(q, m) < 0) {
+        msgbuf_put(m);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Fill iov with up to max_iov of the oldest unwritten segments.
+ * Return the number of entries used.
+ */
+int outq_iov(struct outq *q, struct iovec *iov, int max_iov) {
+    int n_iov = 0;
+    for(int i = 0; i < q->count && n_iov < max_iov; i++) {
+        struct outseg *s = &q->segs[(q->head + i) % q->cap];
+        iov[n_iov].iov_base = s->buf->data + s->off;
+        iov[n_iov].iov_len = s->buf->len - s->off;
+        n_iov++;
+    }
+    return n_iov;
+}
+
+
+/* Copy every unwritten byte, q->len of them, to dst, oldest first. The
+ * queue is left as it is.
+ */
+void outq_copy(const struct outq *q, char *dst) {
+    for(int i = 0; i < q->count; i++) {
+        const struct outseg *s = &q->segs[(q->head + i) % q->cap];
+        memcpy(dst, s->buf->data + s->off, s->buf->len - s->off);
+        dst += s->buf->len - s->off;
+    }
+}
+
+
+/* Record that the first n queued bytes have been written, releasing the
+ * segments that are now complete.
+ */
+void outq_consume(struct outq *q, size_t n) {
+    q->len -= n;
+    q->since_ms = now_ms();
+    while(n > 0) {
+        struct outseg *s = &q->segs[q->head];
+        size_t left = s->buf->len - s->off;
+        if(n < left) {
+            s->off += n;
+            break;
+        }
+        n -= left;
+        msgbuf_put(s->buf);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    if(q->count == 0) {
+        q->head = 0;
+    }
+}
+
+
+/* Write as much of the queue to fd as the socket accepts, gathering up to
+ * OUTQ_MAX_IOV segments into each writev.
+ * Return the number of bytes written if the socket is still usable (the
+ * queue may not be empty) and -1 if the write failed.
+ */
+ssize_t outq_flush(struct outq *q, int fd) {
+    struct iovec iov[OUTQ_MAX_IOV];
+    ssize_t total = 0;
+
+    while(q->len > 0) {
+        int n_iov = outq_iov(q, iov, OUTQ_MAX_IOV);
+        ssize_t n = writev(fd, iov, n_iov);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return total;
+            }
+            return -1;
+        }
+        outq_consume(q, n);
+        total += n;
+    }
+    return total;
+}
@@ -0,0 +1,57 @@
+#ifndef _OUTQ_H_
+#define _OUTQ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define OUTQ_MAX_IOV 64       // Segments handed to one writev
+#define OUTQ_INLINE_SEGS 4    // Segments that fit before the ring is allocated
+
+/* A reference-counted message. A message meant for many clients is built
+ * once and the same buffer is queued for each of them; it is freed when the
+ * last queue has written it. The count is atomic, so the holders may be on
+ * different threads.
+ */
+struct msgbuf {
+    int refs;                 // Holders of this buffer
+    int len;                  // Bytes used in data
+    int cap;                  // Bytes allocated for data
+    char data[];
+};
+
+struct msgbuf *msgbuf_new(const char *data, int len);
+void msgbuf_get(struct msgbuf *m);
+void msgbuf_put(struct msgbuf *m);
+
+/* One queued message and how much of it has already been written. */
+struct outseg {
+    struct msgbuf *buf;
+    int off;
+};
+
+/* Messages waiting to be written to a non-blocking socket, oldest first.
+ * The segments form a ring of cap entries starting at head. A short queue
+ * keeps its ring in inline_segs, so the queue must not be moved.
+ */
+struct outq {
+    struct outseg *segs;
+    int head;
+    int count;
+    int cap;
+    size_t len;               // Unwritten bytes over all segments
+    long long since_ms;       // When the queue last became non-empty or drained
+                              // some bytes; how long the consumer has stalled
+    struct outseg inline_segs[OUTQ_INLINE_SEGS];
+};
+
+void outq_init(struct outq *q);
+void outq_free(struct outq *q);
+int outq_push(struct outq *q, struct msgbuf *m);
+int outq_write(struct outq *q, const char *data, int len);
+int outq_iov(struct outq *q, struct iovec *iov, int max_iov);
+void outq_copy(const struct outq *q, char *dst);
+void outq_consume(struct outq *q, size_t n);
+ssize_t outq_flush(struct outq *q, int fd);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+
+/* Add a slab of slots to the free list.
+ * Return 0 on success and -1 if memory could not be allocated.
+ */
+static int grow(struct pool *pool) {
+    void **slabs = realloc(pool->slabs, (pool->num_slabs + 1) * sizeof(void *));
+    if(slabs == NULL) {
+        return -1;
+    }
+    pool->slabs = slabs;
+
+    char *slab;
+    if(posix_memalign((void **)&slab, CACHE_LINE,
+                      pool->slot_size * pool->slots_per_slab) != 0) {
+        return -1;
+    }
+    pool->slabs[pool->num_slabs++] = slab;
+
+    // link the slots so the lowest address is handed out first
+    for(int i = pool->slots_per_slab - 1; i >= 0; i--) {
+        void *slot = slab + i * pool->slot_size;
+        *(void **)slot = pool->free_list;
+        pool->free_list = slot;
+    }
+    pool->capacity += pool->slots_per_slab;
+    return 0;
+}
+
+
+/* Set up pool for objects of size bytes and allocate its first slab of
+ * slots_per_slab slots. Return 0 on success and -1 on failure.
+ */
+int pool_init(struct pool *pool, size_t size, int slots_per_slab) {
+    memset(pool, 0, sizeof(struct pool));
+    if(size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    pool->slot_size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    pool->slots_per_slab = slots_per_slab > 0 ? slots_per_slab : 1;
+    return grow(pool);
+}
+
+
+/* Return a free slot, or NULL if memory ran out. The slot is not zeroed.
+ */
+void *pool_alloc(struct pool *pool) {
+    if(pool->free_list == NULL && grow(pool) < 0) {
+        return NULL;
+    }
+    void *slot = pool->free_list;
+    pool->free_list = *(void **)slot;
+    if(++pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+    return slot;
+}
+
+
+/* Return obj, which came from pool_alloc on the same pool, to the pool.
+ */
+void pool_free(struct pool *pool, void *obj) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+}
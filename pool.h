@@ -0,0 +1,29 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+#define CACHE_LINE 64
+
+/* A pool of fixed-size objects carved out of large slabs. Every slot is a
+ * whole number of cache lines and starts on a cache line, so two objects
+ * never share one. Freed slots go on a free list and are handed out again
+ * most recently freed first, while they are still warm in the cache. The
+ * pool grows by one slab at a time and never gives memory back.
+ */
+struct pool {
+    size_t slot_size;         // Object size rounded up to whole cache lines
+    int slots_per_slab;
+    void **slabs;
+    int num_slabs;
+    void *free_list;          // Free slots, linked through their first word
+    int capacity;             // Slots in all slabs
+    int in_use;               // Slots handed out
+    int high_water;           // Largest in_use so far
+};
+
+int pool_init(struct pool *pool, size_t size, int slots_per_slab);
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/* The binary protocol, for bots and gateways. A client asks for it by
+ * sending PROTO_MAGIC as its very first byte, instead of a name. The
+ * server answers with PROTO_MAGIC followed by an OP_HELLO frame; the text
+ * greeting may already be on its way, so the client skips everything
+ * before that byte, which never occurs in text. From then on both sides
+ * speak in frames:
+ *
+ *     u8 length          bytes that follow: the opcode and the payload
+ *     u8 opcode
+ *     payload            length - 1 bytes
+ *
+ * Integers in a payload are big-endian. A name or word that ends a
+ * payload runs to the end of the frame and has no terminator.
+ *
+ * Client frames:
+ *     OP_JOIN      name
+ *     OP_GUESS     u8 letter
+ *     OP_TOP       (no payload) asks for the leaderboard; allowed any time
+ *     OP_HINT      (no payload) asks what words fit the board; players only
+ *
+ * Server frames:
+ *     OP_HELLO     u8 version
+ *     OP_STATE     u8 guesses left, u32 guessed letters, word so far
+ *                  Sent on joining and whenever a new game starts.
+ *     OP_DELTA     u8 letter, u8 guesses left, u32 positions uncovered,
+ *                  name of the guesser
+ *                  Sent for every guess; a miss uncovers nothing.
+ *     OP_TURN      u8 1 if it is the receiver's turn, name of the player
+ *     OP_GAME_OVER u8 1 if won, u8 length of word, word, name of the
+ *                  winner (empty if the guesses ran out)
+ *     OP_JOINED    name of a player who joined
+ *     OP_LEFT      name of a player who left
+ *     OP_ERROR     u8 one of the PROTO_ERR_ codes
+ *     OP_LEADER    u8 place, u8 places in all, u32 wins, u32 games, name
+ *                  One frame per place, best first, in answer to OP_TOP.
+ *                  A board nobody is on yet is a single frame of place 0.
+ *     OP_HINT_REPLY u32 words in the list that fit the board, u8 the letter
+ *                  most of them contain (0 if none does), u32 how many do
+ *
+ * Bit i of a letter mask stands for 'a' + i and bit j of a position mask
+ * for the j-th letter of the word.
+ */
+
+#define PROTO_MAGIC 0xB1
+#define PROTO_VERSION 1
+#define PROTO_MAX_FRAME 256       // Length byte included
+
+enum proto_op {
+    OP_JOIN = 0x01,
+    OP_GUESS = 0x02,
+    OP_TOP = 0x03,
+    OP_HINT = 0x04,
+
+    OP_HELLO = 0x80,
+    OP_STATE = 0x81,
+    OP_DELTA = 0x82,
+    OP_TURN = 0x83,
+    OP_GAME_OVER = 0x84,
+    OP_JOINED = 0x85,
+    OP_LEFT = 0x86,
+    OP_ERROR = 0x87,
+    OP_LEADER = 0x88,
+    OP_HINT_REPLY = 0x89,
+};
+
+enum proto_err {
+    PROTO_ERR_NOT_YOUR_TURN = 1,
+    PROTO_ERR_INVALID_GUESS = 2,
+    PROTO_ERR_BAD_NAME = 3,       // Taken, empty or too long
+    PROTO_ERR_TOO_LONG = 4,       // Frame payload over the line limit
+    PROTO_ERR_TIMED_OUT = 5,      // Took too long; the turn passed on
+    PROTO_ERR_BAD_FRAME = 6,      // Unknown opcode, or not allowed now
+};
+
+/* A frame being built. Appending past PROTO_MAX_FRAME is cut short. */
+struct frame {
+    int len;
+    unsigned char data[PROTO_MAX_FRAME];
+};
+
+
+static inline void frame_begin(struct frame *f, int op) {
+    f->data[0] = 1;
+    f->data[1] = op;
+    f->len = 2;
+}
+
+
+static inline void frame_u8(struct frame *f, unsigned v) {
+    if(f->len < PROTO_MAX_FRAME) {
+        f->data[f->len++] = v;
+        f->data[0] = f->len - 1;
+    }
+}
+
+
+static inline void frame_u32(struct frame *f, uint32_t v) {
+    for(int shift = 24; shift >= 0; shift -= 8) {
+        frame_u8(f, (v >> shift) & 0xff);
+    }
+}
+
+
+static inline void frame_bytes(struct frame *f, const char *s, int n) {
+    if(n > PROTO_MAX_FRAME - f->len) {
+        n = PROTO_MAX_FRAME - f->len;
+    }
+    memcpy(f->data + f->len, s, n);
+    f->len += n;
+    f->data[0] = f->len - 1;
+}
+
+
+static inline void frame_str(struct frame *f, const char *s) {
+    frame_bytes(f, s, strlen(s));
+}
+
+
+static inline uint32_t frame_get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+#endif
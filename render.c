@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "render.h"
+
+/* Copy the n bytes at s to dst and return the byte after them.
+ */
+static char *put(char *dst, const char *s, int n) {
+    memcpy(dst, s, n);
+    return dst + n;
+}
+
+#define PUT_LITERAL(dst, s) put((dst), (s), sizeof(s) - 1)
+
+
+/* "It's NAME's turn." */
+int format_turn(char *buf, const char *name) {
+    char *p = PUT_LITERAL(buf, "It's ");
+    p = put(p, name, strlen(name));
+    p = PUT_LITERAL(p, "'s turn.\r\n");
+    return p - buf;
+}
+
+
+/* "NAME guesses X", without a line ending: it goes out through broadcast,
+ * which adds one.
+ */
+int format_guess(char *buf, const char *name, char guess) {
+    char *p = put(buf, name, strlen(name));
+    p = PUT_LITERAL(p, " guesses ");
+    *p++ = guess;
+    return p - buf;
+}
+
+
+/* "X is not in the word." */
+int format_miss(char *buf, char guess) {
+    buf[0] = guess;
+    char *p = PUT_LITERAL(buf + 1, " is not in the word.\r\n");
+    return p - buf;
+}
+
+
+/* The end of a game nobody won, without a line ending, like format_guess.
+ */
+int format_loss(char *buf, const char *word) {
+    char *p = PUT_LITERAL(buf, "Game over! No more guesses left. The word was ");
+    p = put(p, word, strlen(word));
+    return p - buf;
+}
+
+
+/* The end of a game NAME won, as the other players see it. */
+int format_win(char *buf, const char *name) {
+    char *p = PUT_LITERAL(buf, "Game over! ");
+    p = put(p, name, strlen(name));
+    p = PUT_LITERAL(p, " won.\r\n \r\n");
+    return p - buf;
+}
+
+
+/* The end of a game, as its winner sees it. */
+int format_own_win(char *buf) {
+    char *p = PUT_LITERAL(buf, "Game over! You won.\r\n \r\n");
+    return p - buf;
+}
+
+
+/* The leaderboard, one line per place, into buf, which must hold
+ * MAX_BOARD_MSG bytes.
+ */
+int format_leaderboard(char *buf, const struct leaderboard *board) {
+    if(board->len == 0) {
+        char *p = PUT_LITERAL(buf, "Nobody has won a game yet.\r\n");
+        return p - buf;
+    }
+    char *p = PUT_LITERAL(buf, "Top players:\r\n");
+    for(int i = 0; i < board->len; i++) {
+        const struct player_stats *s = &board->top[i].stats;
+        uint32_t guesses = s->hits + s->misses;
+        p += sprintf(p, "%2d. %s: %u win%s in %u game%s", i + 1, board->top[i].name,
+                     s->wins, s->wins == 1 ? "" : "s", s->games, s->games == 1 ? "" : "s");
+        if(guesses > 0) {
+            p += sprintf(p, ", %u%% of guesses right, %.1f s a guess",
+                         (unsigned)(100ULL * s->hits / guesses),
+                         s->think_us / 1e6 / guesses);
+        }
+        p = PUT_LITERAL(p, "\r\n");
+    }
+    return p - buf;
+}
+
+
+/* "N words fit GUESS. X is in P% of them.", from what match_board found
+ * for the board showing guess.
+ */
+int format_hint(char *buf, const char *guess, const struct match_result *r) {
+    int best = match_best_letter(r);
+    if(r->count == 0) {
+        return sprintf(buf, "No word in the list fits %s.\r\n", guess);
+    }
+    int len = sprintf(buf, "%u word%s %s %s.", r->count, r->count == 1 ? "" : "s",
+                      r->count == 1 ? "fits" : "fit", guess);
+    if(best < 0) {
+        return len + sprintf(buf + len, " No letter left is in %s.\r\n",
+                             r->count == 1 ? "it" : "any of them");
+    }
+    return len + sprintf(buf + len, " %c is in %u%% of them.\r\n", 'a' + best,
+                         (unsigned)(100ULL * r->containing[best] / r->count));
+}
+
+/* Build the OP_STATE frame for the current state of the game.
+ */
+void render_state(const struct game_state *game, struct frame *f) {
+    frame_begin(f, OP_STATE);
+    frame_u8(f, game->guesses_left);
+    frame_u32(f, game->guessed);
+    frame_bytes(f, game->guess, game->len);
+}
+
+
+/* Build the OP_TURN frame telling players other than the current one,
+ * called name, whose turn it is.
+ */
+void render_turn_frame(const char *name, struct frame *f) {
+    frame_begin(f, OP_TURN);
+    frame_u8(f, 0);
+    frame_str(f, name);
+}
+
+
+/* Build the OP_DELTA frame for the guess by player name, which uncovered
+ * the positions in hits.
+ */
+void render_delta(const struct game_state *game, const char *name, char guess,
+                  uint32_t hits, struct frame *f) {
+    frame_begin(f, OP_DELTA);
+    frame_u8(f, guess);
+    frame_u8(f, game->guesses_left);
+    frame_u32(f, hits);
+    frame_str(f, name);
+}
+
+
+/* Build the OP_GAME_OVER frame; winner is NULL if the guesses ran out.
+ */
+void render_game_over(const struct game_state *game, const char *winner, struct frame *f) {
+    frame_begin(f, OP_GAME_OVER);
+    frame_u8(f, winner != NULL);
+    frame_u8(f, game->len);
+    frame_bytes(f, game->word, game->len);
+    if(winner != NULL) {
+        frame_str(f, winner);
+    }
+}
+
+
+/* Build the OP_LEADER frame for place, counted from 1, on the board. An
+ * empty board has only place 0.
+ */
+void render_leader(const struct leaderboard *board, int place, struct frame *f) {
+    frame_begin(f, OP_LEADER);
+    frame_u8(f, place);
+    frame_u8(f, board->len);
+    if(place == 0) {
+        frame_u32(f, 0);
+        frame_u32(f, 0);
+        return;
+    }
+    const struct leader *l = &board->top[place - 1];
+    frame_u32(f, l->stats.wins);
+    frame_u32(f, l->stats.games);
+    frame_str(f, l->name);
+}
+
+
+void render_hint(const struct match_result *r, struct frame *f) {
+    int best = match_best_letter(r);
+    frame_begin(f, OP_HINT_REPLY);
+    frame_u32(f, r->count);
+    frame_u8(f, best < 0 ? 0 : 'a' + best);
+    frame_u32(f, best < 0 ? 0 : r->containing[best]);
+}
@@ -0,0 +1,38 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <stdint.h>
+
+#include "gameplay.h"
+#include "match.h"
+#include "proto.h"
+#include "scores.h"
+
+/* What the server says about the game, built into buffers the caller
+ * owns. Nothing here sends anything, so the same text and frames can be
+ * shared by every player's queue, or timed on their own.
+ *
+ * The format_ functions write text without a terminating NUL into buf,
+ * which must hold MAX_BUF bytes, and return its length.
+ */
+
+#define MAX_BOARD_MSG 2048        // Room for the leaderboard as text
+
+int format_turn(char *buf, const char *name);
+int format_guess(char *buf, const char *name, char guess);
+int format_miss(char *buf, char guess);
+int format_loss(char *buf, const char *word);
+int format_win(char *buf, const char *name);
+int format_own_win(char *buf);
+int format_leaderboard(char *buf, const struct leaderboard *board);
+int format_hint(char *buf, const char *guess, const struct match_result *r);
+
+void render_state(const struct game_state *game, struct frame *f);
+void render_turn_frame(const char *name, struct frame *f);
+void render_delta(const struct game_state *game, const char *name, char guess,
+                  uint32_t hits, struct frame *f);
+void render_game_over(const struct game_state *game, const char *winner, struct frame *f);
+void render_leader(const struct leaderboard *board, int place, struct frame *f);
+void render_hint(const struct match_result *r, struct frame *f);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "clock.h"
+
+__thread long long clock_frozen_ns;
+
+/* The recording being written: its file, the events not yet written, and
+ * the time of the last event, which the next one is stored relative to.
+ */
+static int rec_fd = -1;
+static unsigned char rec_buf[REC_BUF_SIZE];
+static size_t rec_len;
+static long long rec_last_ns;
+static long long rec_flushed_ns;
+
+
+/* Write the buffered events out.
+ */
+static void rec_flush(void) {
+    size_t done = 0;
+    while(done < rec_len) {
+        ssize_t n = write(rec_fd, rec_buf + done, rec_len - done);
+        if(n < 0) {
+            perror("write recording");
+            break;
+        }
+        done += n;
+    }
+    rec_len = 0;
+    rec_flushed_ns = real_now_ns();
+}
+
+
+static void rec_flush_at_exit(void) {
+    if(rec_fd >= 0) {
+        rec_flush();
+    }
+}
+
+
+/* Create the recording path, starting it with h. Return 0 on success and
+ * -1 on failure.
+ */
+int rec_start(const char *path, const struct rec_header *h) {
+    rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(rec_fd < 0 || write(rec_fd, h, sizeof(*h)) != sizeof(*h)) {
+        perror(path);
+        return -1;
+    }
+    rec_last_ns = h->start_ns;
+    rec_flushed_ns = real_now_ns();
+    atexit(rec_flush_at_exit);
+    return 0;
+}
+
+
+static void put_varint(uint64_t v) {
+    while(v >= 0x80) {
+        rec_buf[rec_len++] = v | 0x80;
+        v >>= 7;
+    }
+    rec_buf[rec_len++] = v;
+}
+
+
+/* Start an event of type at the current time, with room for extra bytes
+ * after its header.
+ */
+static void rec_begin(int type, int extra) {
+    // type, time, and at most two more varints
+    if(rec_len + 1 + 3 * 10 + extra > REC_BUF_SIZE) {
+        rec_flush();
+    }
+    long long ns = now_ns();
+    rec_buf[rec_len++] = type;
+    put_varint(ns - rec_last_ns);
+    rec_last_ns = ns;
+}
+
+
+void rec_accept(int fd, struct in_addr addr) {
+    rec_begin(REC_ACCEPT, sizeof(addr));
+    put_varint(fd);
+    memcpy(rec_buf + rec_len, &addr, sizeof(addr));
+    rec_len += sizeof(addr);
+}
+
+
+void rec_read(int fd, const char *data, int len) {
+    rec_begin(REC_READ, len);
+    put_varint(fd);
+    put_varint(len);
+    memcpy(rec_buf + rec_len, data, len);
+    rec_len += len;
+}
+
+
+void rec_close(int fd) {
+    rec_begin(REC_CLOSE, 0);
+    put_varint(fd);
+}
+
+
+void rec_evict(int fd, int reason) {
+    rec_begin(REC_EVICT, 0);
+    put_varint(fd);
+    put_varint(reason);
+}
+
+
+/* Record the end of a loop iteration, and write the events out if the
+ * last write was REC_FLUSH_MS ago.
+ */
+void rec_tick(void) {
+    rec_begin(REC_TICK, 0);
+    if(real_now_ns() - rec_flushed_ns >= REC_FLUSH_MS * 1000000LL) {
+        rec_flush();
+    }
+}
+
+
+/* Map the recording at path into r and read its header into h. Return 0
+ * on success and -1 on failure, having said why.
+ */
+int rec_open(struct rec_reader *r, const char *path, struct rec_header *h) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    if((size_t)st.st_size < sizeof(*h)) {
+        fprintf(stderr, "%s is not a recording\n", path);
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    memcpy(h, data, sizeof(*h));
+    if(h->magic != REC_MAGIC || h->version != REC_VERSION) {
+        fprintf(stderr, "%s is not a recording this server can replay\n", path);
+        munmap(data, st.st_size);
+        return -1;
+    }
+    r->data = data;
+    r->len = st.st_size;
+    r->pos = sizeof(*h);
+    r->ns = h->start_ns;
+    return 0;
+}
+
+
+/* Read a varint into *v. Return 0 on success and -1 if it runs past the
+ * end.
+ */
+static int get_varint(struct rec_reader *r, uint64_t *v) {
+    *v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(r->pos == r->len) {
+            return -1;
+        }
+        unsigned char b = r->data[r->pos++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/* Read the next event of r into e. Return 1 if there was one, 0 at the
+ * end, and -1 if the recording is damaged or cut off in the middle of an
+ * event, as one from a server that was killed may be.
+ */
+int rec_next(struct rec_reader *r, struct rec_event *e) {
+    if(r->pos == r->len) {
+        return 0;
+    }
+    uint64_t dt, fd, len, reason;
+    e->type = r->data[r->pos++];
+    if(get_varint(r, &dt) < 0) {
+        return -1;
+    }
+    r->ns += dt;
+    e->ns = r->ns;
+    switch(e->type) {
+    case REC_ACCEPT:
+        if(get_varint(r, &fd) < 0 || r->len - r->pos < sizeof(e->addr)) {
+            return -1;
+        }
+        memcpy(&e->addr, r->data + r->pos, sizeof(e->addr));
+        r->pos += sizeof(e->addr);
+        break;
+    case REC_READ:
+        if(get_varint(r, &fd) < 0 || get_varint(r, &len) < 0 || r->len - r->pos < len) {
+            return -1;
+        }
+        e->len = len;
+        e->data = (const char *)r->data + r->pos;
+        r->pos += len;
+        break;
+    case REC_CLOSE:
+        if(get_varint(r, &fd) < 0) {
+            return -1;
+        }
+        break;
+    case REC_TICK:
+        fd = 0;
+        break;
+    case REC_EVICT:
+        if(get_varint(r, &fd) < 0 || get_varint(r, &reason) < 0) {
+            return -1;
+        }
+        e->reason = reason;
+        break;
+    default:
+        return -1;
+    }
+    e->fd = fd;
+    return 1;
+}
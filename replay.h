@@ -0,0 +1,101 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Recording what drives a server, so that the run can be played again.
+ *
+ * Everything a shard's game depends on from outside is in the recording:
+ * its seed, word selection policy, time limits and bots, the connections it
+ * accepted, every chunk of input read() returned, the sockets that closed,
+ * failed or fell too far behind, and the end of every loop iteration,
+ * where deadlines are checked and output goes out. The shard's clock is frozen
+ * at the time of each event (see clock.h), so a replay that feeds the same
+ * events through the same code at the same clock times repeats the run
+ * byte for byte, without a socket.
+ *
+ * A recording is a struct rec_header followed by events, each a type byte
+ * and the nanoseconds since the event before as a varint, then:
+ *
+ *   REC_ACCEPT  the socket (varint) and its IPv4 address (4 bytes)
+ *   REC_READ    the socket and the length (varints), then the bytes
+ *   REC_CLOSE   the socket, whose read() failed or found the end
+ *   REC_TICK    nothing
+ *   REC_EVICT   the socket and the enum rec_reason (varints)
+ *
+ * A client evicted for its output is dropped in the middle of handling
+ * something else, so a replay takes the REC_EVICT at the same place in the
+ * code, when it is the next event, instead of in its turn.
+ *
+ * Varints are little-endian base 128. Events are buffered and written
+ * every REC_FLUSH_MS or REC_BUF_SIZE bytes, and when the server exits.
+ */
+
+#define REC_MAGIC 0x52474757      // "WGGR"
+#define REC_VERSION 2
+#define REC_BUF_SIZE (64 * 1024)
+#define REC_FLUSH_MS 100
+
+enum rec_type {
+    REC_ACCEPT = 1,
+    REC_READ,
+    REC_CLOSE,
+    REC_TICK,
+    REC_EVICT,
+};
+
+enum rec_reason {
+    EVICT_WRITE_FAILED = 1,
+    EVICT_BACKLOG,                // More than the -w limit queued
+    EVICT_STALLED,                // Output stuck past the -W limit
+};
+
+struct rec_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seed;                // The game's random number state at the start
+    int64_t start_ns;             // The shard's clock at the start
+    int64_t turn_timeout_ms;
+    int64_t handshake_timeout_ms;
+    int64_t idle_timeout_ms;
+    int32_t min_len;              // The select_policy
+    int32_t max_len;
+    int32_t difficulty;
+    int32_t weighted;
+    uint32_t num_words;           // In the word list, to catch a replay with another
+    int32_t num_bots;
+    int32_t bot_skill;
+    uint32_t pad;
+};
+
+struct rec_event {
+    int type;                     // One of enum rec_type
+    long long ns;                 // When it happened on the shard's clock
+    int fd;
+    struct in_addr addr;          // REC_ACCEPT
+    int len;                      // REC_READ
+    const char *data;
+    int reason;                   // REC_EVICT
+};
+
+/* A recording being replayed, mapped in whole. */
+struct rec_reader {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    long long ns;                 // Time of the last event read
+};
+
+int rec_start(const char *path, const struct rec_header *h);
+void rec_accept(int fd, struct in_addr addr);
+void rec_read(int fd, const char *data, int len);
+void rec_close(int fd);
+void rec_tick(void);
+void rec_evict(int fd, int reason);
+
+int rec_open(struct rec_reader *r, const char *path, struct rec_header *h);
+int rec_next(struct rec_reader *r, struct rec_event *e);
+
+#endif
@@ -0,0 +1,501 @@
+#define _GNU_SOURCE         /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "socket.h"
+#include "event.h"
+#include "clock.h"
+#include "timer.h"
+#include "log.h"
+#include "proto.h"
+#include "router.h"
+
+/* wgg-router owns the public port and spreads players over the wordsrv
+ * processes behind it; see router.h for what they say to each other. A
+ * client is greeted here and handed over once it has sent its first line,
+ * so it never notices the hop. Processes may come and go: clients are
+ * only ever given to those connected right now, and a client ready while
+ * none is, or while every one's socket is full, waits until it can be
+ * handed over or its name deadline passes.
+ */
+
+#ifndef PORT
+    #define PORT 58474
+#endif
+#define MAX_QUEUE 1024
+#define ACCEPT_BATCH 1024
+#define MAX_EVENTS 256
+#define MAX_BACKENDS 256
+#define TIMER_TICK_MS 10
+#define RETRY_MS 10               // How soon to try again to hand over waiting clients
+
+/* A client that has not been handed over yet. */
+struct guest {
+    int fd;
+    int mode;                     // One of enum client_mode
+    int watched;                  // 1 while the event loop watches fd
+    int waiting;                  // 1 while in the waiting list
+    struct guest *next;           // In the waiting list
+    struct timer deadline;        // Drops the client if it stays silent too long
+    int len;                      // Bytes of input in buf
+    char buf[MAX_BUF];
+};
+
+/* A thread of a wordsrv process. */
+struct backend {
+    int fd;
+    unsigned load;                // Clients it last reported plus those sent since
+};
+
+struct event_loop *loop;
+struct timer_wheel timers;
+int reserve_fd = -1;              // Freed to turn a connection away when out of them
+long long handshake_timeout_ms = 30000;
+
+// guests indexed by socket descriptor
+struct guest **guests;
+int guests_len;
+
+struct backend backends[MAX_BACKENDS];
+int num_backends;
+
+// ready guests no backend could take yet, oldest first
+struct guest *waiting;
+struct guest **waiting_tail = &waiting;
+
+
+/* Record g as the guest on its socket descriptor.
+ */
+void set_guest(int fd, struct guest *g) {
+    if(fd >= guests_len) {
+        int len = guests_len ? guests_len : 64;
+        while(len <= fd) {
+            len *= 2;
+        }
+        struct guest **t = realloc(guests, len * sizeof(struct guest *));
+        if(t == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(t + guests_len, 0, (len - guests_len) * sizeof(struct guest *));
+        guests = t;
+        guests_len = len;
+    }
+    guests[fd] = g;
+}
+
+
+/* Forget g and close its socket; a backend it was handed to has its own.
+ */
+void free_guest(struct guest *g) {
+    timer_cancel(&timers, &g->deadline);
+    if(g->waiting) {
+        struct guest **q;
+        for(q = &waiting; *q != g; q = &(*q)->next)
+            ;
+        *q = g->next;
+        if(waiting_tail == &g->next) {
+            waiting_tail = q;
+        }
+    }
+    if(g->watched) {
+        ev_del(loop, g->fd);
+    }
+    guests[g->fd] = NULL;
+    close(g->fd);
+    free(g);
+}
+
+
+void deadline_passed(struct timer *t) {
+    struct guest *g = timer_owner(t, struct guest, deadline);
+    LOG(LOG_INFO, "Disconnecting client %d: no name given in time\n", g->fd);
+    free_guest(g);
+}
+
+
+/* Write all of len bytes of buf to a new client's socket, whose buffer is
+ * empty. Return 0 on success and -1 on failure.
+ */
+int greet(int fd, const void *buf, int len) {
+    return write(fd, buf, len) == len ? 0 : -1;
+}
+
+
+/* Out of descriptors: give up the reserve one to accept the next waiting
+ * connection on listenfd and close it at once, as wordsrv does, so that
+ * the listener does not stay ready. Return 0 if a connection was turned
+ * away and -1 if none could be.
+ */
+int turn_away(int listenfd) {
+    if(reserve_fd < 0) {
+        return -1;
+    }
+    close(reserve_fd);
+    struct sockaddr_in q;
+    int fd = accept_connection(listenfd, &q);
+    if(fd >= 0) {
+        close(fd);
+        LOG(LOG_WARN, "Out of descriptors; turned away %s\n", inet_ntoa(q.sin_addr));
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0 ? 0 : -1;
+}
+
+
+/* Accept the connections waiting on listenfd and greet them.
+ */
+void accept_guests(int listenfd) {
+    for(int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in q;
+        int fd = accept_connection(listenfd, &q);
+        if(fd < 0) {
+            if(errno == EMFILE || errno == ENFILE) {
+                if(turn_away(listenfd) < 0) {
+                    return;
+                }
+                continue;
+            }
+            if(errno == EAGAIN) {
+                return;
+            }
+            continue;
+        }
+        LOG(LOG_INFO, "Connection from %s\n", inet_ntoa(q.sin_addr));
+        if(set_nodelay(fd) < 0) {
+            perror("setsockopt");
+        }
+        struct guest *g = malloc(sizeof(struct guest));
+        if(g == NULL || greet(fd, WELCOME_MSG, strlen(WELCOME_MSG)) < 0
+           || ev_add(loop, fd, EV_READ) < 0) {
+            free(g);
+            close(fd);
+            continue;
+        }
+        g->fd = fd;
+        g->mode = MODE_UNKNOWN;
+        g->watched = 1;
+        g->waiting = 0;
+        g->len = 0;
+        timer_init(&g->deadline, deadline_passed);
+        if(handshake_timeout_ms > 0) {
+            timer_add(&timers, &g->deadline, now_ms() + handshake_timeout_ms);
+        }
+        set_guest(fd, g);
+    }
+}
+
+
+/* Stop using backend i, whose process went away.
+ */
+void drop_backend(int i) {
+    LOG(LOG_WARN, "Backend %d went away\n", backends[i].fd);
+    ev_del(loop, backends[i].fd);
+    close(backends[i].fd);
+    backends[i] = backends[--num_backends];
+}
+
+
+/* Pass g's socket and input to a backend, trying the least loaded first.
+ * Return 0 on success and -1 if no backend could take it now.
+ */
+int hand_over(struct guest *g) {
+    struct handoff h;
+    h.mode = g->mode;
+    h.pad = 0;
+    h.len = g->len;
+    memcpy(h.data, g->buf, g->len);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&h, HANDOFF_SIZE(g->len)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &g->fd, sizeof(int));
+
+    // a backend whose socket is full is passed over for this client, and
+    // ties go round the backends
+    int tried[MAX_BACKENDS] = {0};
+    static unsigned rotor;
+    rotor++;
+    while(1) {
+        int best = -1;
+        for(int k = 0; k < num_backends; k++) {
+            int i = (rotor + k) % num_backends;
+            if(!tried[i] && (best < 0 || backends[i].load < backends[best].load)) {
+                best = i;
+            }
+        }
+        if(best < 0) {
+            return -1;
+        }
+        if(sendmsg(backends[best].fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+            backends[best].load++;
+            LOG(LOG_DEBUG, "Client %d goes to backend %d\n", g->fd, backends[best].fd);
+            return 0;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            tried[best] = 1;
+        }
+        else {
+            drop_backend(best);
+            // the last backend moved into best's place
+            tried[best] = tried[num_backends];
+        }
+    }
+}
+
+
+/* Hand g over, or make it wait for a backend, behind those already
+ * waiting. Whatever it sends from now on is left for the backend to read.
+ */
+void guest_ready(struct guest *g) {
+    ev_del(loop, g->fd);
+    g->watched = 0;
+    if(waiting == NULL && hand_over(g) == 0) {
+        free_guest(g);
+        return;
+    }
+    g->waiting = 1;
+    g->next = NULL;
+    *waiting_tail = g;
+    waiting_tail = &g->next;
+}
+
+
+/* Hand over waiting guests, in order, until a backend cannot take one.
+ */
+void retry_waiting() {
+    while(waiting != NULL && hand_over(waiting) == 0) {
+        free_guest(waiting);
+    }
+}
+
+
+/* Return whether g has sent its first line, or first frame, in full, or
+ * so much that a backend will have to tell it that it is too long.
+ */
+int first_line_in(struct guest *g) {
+    if(g->len == MAX_BUF - 1) {
+        return 1;
+    }
+    if(g->mode == MODE_BINARY) {
+        return g->len > 0 && (g->len >= 1 + (unsigned char)g->buf[0]
+                              || (unsigned char)g->buf[0] > MAX_LINE + 1);
+    }
+    return memchr(g->buf, '\n', g->len) != NULL || g->len > MAX_LINE + 2;
+}
+
+
+/* Read what g has sent, answering a binary client's PROTO_MAGIC the way
+ * wordsrv does, and hand g over once its first line is in.
+ */
+void read_guest(struct guest *g) {
+    // a backend keeps a byte of its input buffer for a terminator
+    int n = read(g->fd, g->buf + g->len, MAX_BUF - 1 - g->len);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if(n <= 0) {
+        free_guest(g);
+        return;
+    }
+    g->len += n;
+    if(g->mode == MODE_UNKNOWN) {
+        if((unsigned char)g->buf[0] == PROTO_MAGIC) {
+            g->mode = MODE_BINARY;
+            memmove(g->buf, g->buf + 1, --g->len);
+            unsigned char hello[1 + PROTO_MAX_FRAME] = {PROTO_MAGIC};
+            struct frame f;
+            frame_begin(&f, OP_HELLO);
+            frame_u8(&f, PROTO_VERSION);
+            memcpy(hello + 1, f.data, f.len);
+            if(greet(g->fd, hello, 1 + f.len) < 0) {
+                free_guest(g);
+                return;
+            }
+        }
+        else {
+            g->mode = MODE_TEXT;
+        }
+    }
+    if(first_line_in(g)) {
+        guest_ready(g);
+    }
+}
+
+
+/* Take on the wordsrv threads connecting to unixfd.
+ */
+void accept_backends(int unixfd) {
+    int fd;
+    while((fd = accept4(unixfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if(num_backends == MAX_BACKENDS || ev_add(loop, fd, EV_READ) < 0) {
+            LOG(LOG_WARN, "Turned away a backend\n");
+            close(fd);
+            continue;
+        }
+        backends[num_backends].fd = fd;
+        backends[num_backends].load = 0;
+        num_backends++;
+        LOG(LOG_INFO, "Backend %d connected; %d in all\n", fd, num_backends);
+    }
+}
+
+
+/* Read the load reports of backend i, dropping it if it went away.
+ */
+void read_reports(int i) {
+    struct load_report r;
+    while(1) {
+        ssize_t n = recv(backends[i].fd, &r, sizeof(r), MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if(n != sizeof(r)) {
+            drop_backend(i);
+            return;
+        }
+        backends[i].load = r.clients;
+    }
+}
+
+
+/* Return a listening SOCK_SEQPACKET socket at path, replacing whatever
+ * was left there, or exit.
+ */
+int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+       || listen(fd, MAX_BACKENDS) < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+
+int main(int argc, char **argv) {
+    int port = PORT;
+    int listen_backlog = MAX_QUEUE;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:q:H:L:")) != -1) {
+        switch(opt) {
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            listen_backlog = strtol(optarg, NULL, 10);
+            if(listen_backlog < 1) {
+                fprintf(stderr, "The listen backlog must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'H':
+            handshake_timeout_ms = strtoll(optarg, NULL, 10) * 1000;
+            break;
+        case 'L':
+            log_level = log_parse_level(optarg);
+            if(log_level < 0) {
+                fprintf(stderr, "Unknown log level %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-p port] [-q listen backlog] [-H name seconds]\n"
+                "       [-L debug|info|warn|error] <backend socket path>\n"
+                "Start wordsrv with -R and the same path to put it behind the router.\n",
+                argv[0]);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int unixfd = listen_unix(argv[optind]);
+    int listenfd = set_up_server_socket(init_server_addr(port), listen_backlog, 0);
+    loop = ev_create(EV_BACKEND_EPOLL);
+    if(loop == NULL || ev_add(loop, listenfd, EV_READ) < 0
+       || ev_add(loop, unixfd, EV_READ) < 0) {
+        perror("event loop");
+        exit(1);
+    }
+    timer_wheel_init(&timers, now_ms(), TIMER_TICK_MS);
+    if(log_start() < 0) {
+        exit(1);
+    }
+    LOG(LOG_INFO, "Routing port %d to the backends on %s\n", port, argv[optind]);
+
+    struct ev_event events[MAX_EVENTS];
+    while(1) {
+        long long timeout = timer_next_ms(&timers, now_ms());
+        if(waiting != NULL && num_backends > 0 && (timeout < 0 || timeout > RETRY_MS)) {
+            timeout = RETRY_MS;
+        }
+        int nready = ev_wait(loop, events, MAX_EVENTS, timeout);
+        if(nready < 0) {
+            if(errno != EINTR) {
+                perror("ev_wait");
+            }
+            continue;
+        }
+        int listener_ready = 0;
+        for(int i = 0; i < nready; i++) {
+            int fd = events[i].fd;
+            if(fd == listenfd) {
+                listener_ready = 1;
+                continue;
+            }
+            if(fd == unixfd) {
+                accept_backends(unixfd);
+                continue;
+            }
+            if(fd < guests_len && guests[fd] != NULL) {
+                read_guest(guests[fd]);
+                continue;
+            }
+            for(int b = 0; b < num_backends; b++) {
+                if(backends[b].fd == fd) {
+                    read_reports(b);
+                    break;
+                }
+            }
+        }
+        // as in wordsrv, a descriptor closed above is not reused in this batch
+        if(listener_ready) {
+            accept_guests(listenfd);
+        }
+        retry_waiting();
+        timer_run(&timers, now_ms());
+    }
+    return 0;
+}
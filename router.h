@@ -0,0 +1,41 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gameplay.h"
+
+/* What wgg-router and the wordsrv processes behind it say to each other.
+ *
+ * The router owns the public port. It greets every client and waits for
+ * the first line, or the first frame of a binary client, which is normally
+ * the client's name. Then it passes the client's socket to one of the
+ * wordsrv processes connected to its Unix socket, as SCM_RIGHTS on a
+ * struct handoff carrying what the client has sent so far, and forgets
+ * the client. The process takes the client on as if it had read that
+ * input itself, so names are checked by the game the client joins.
+ *
+ * Every thread of a wordsrv process started with -R connects on its own
+ * and gets clients for its own game, and reports how many clients it
+ * holds every ROUTER_REPORT_MS while that changes. The router gives each
+ * new client to the thread with the fewest. Both sides use
+ * SOCK_SEQPACKET, so every message arrives whole.
+ */
+
+#define ROUTER_REPORT_MS 250
+
+struct handoff {
+    uint8_t mode;                 // MODE_TEXT or MODE_BINARY, already settled
+    uint8_t pad;
+    uint16_t len;                 // Bytes of input in data
+    char data[MAX_BUF];           // Input after PROTO_MAGIC, which the router answered
+};
+
+struct load_report {
+    uint32_t clients;             // Clients the thread holds
+};
+
+#define HANDOFF_SIZE(len) (offsetof(struct handoff, data) + (len))
+
+#endif
@@ -0,0 +1,726 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "scores.h"
+#include "clock.h"
+#include "log.h"
+
+/* The ring works like the one in log.c: a bounded queue after Dmitry
+ * Vyukov's design, with any number of producers (the shards) and one
+ * consumer (the writer thread).
+ */
+
+#define SCORES_RING_SIZE 16384    // Cells; a power of two
+#define SCORES_BATCH_NS 10000000  // How long the writer gathers a batch
+#define SCORES_MAGIC 0x53474757   // "WGGS"
+#define SCORES_VERSION 1
+#define MIN_COMPACT_BYTES (1 << 20) // Smallest log worth folding in
+#define SNAPSHOT_CHUNK 4096       // Records written or read at a time
+#define COMPACT_RETRY_MS 60000    // How long to wait after a failed compaction
+
+/* A player as stored on disk, in host order. In the log a record holds
+ * what changed, and its stamp is not used.
+ */
+struct score_record {
+    char name[SCORES_NAME];
+    struct player_stats stats;
+    uint32_t stamp;               // When the player reached their wins
+    uint32_t check;               // FNV-1a of the bytes before it
+};
+
+/* What starts a snapshot and a log. A log follows the snapshot with the
+ * same generation.
+ */
+struct score_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t count;               // Records in a snapshot; 0 in a log
+    uint32_t record_size;
+    uint32_t check;
+};
+
+struct cell {
+    size_t seq;                   // Sequence number minus the cell's index
+    char name[SCORES_NAME];
+    struct player_stats delta;
+};
+
+struct player {
+    char name[SCORES_NAME];
+    struct player_stats stats;
+    uint32_t hash;
+    uint32_t stamp;
+};
+
+static struct cell ring[SCORES_RING_SIZE];
+static size_t enqueue_pos;
+static size_t dequeue_pos;
+static unsigned long long dropped;
+
+/* Everything below belongs to whoever holds drain_lock: the writer
+ * thread, or the exit handler.
+ */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ready;                 // 1 once the files are loaded
+
+static struct player *players;
+static uint32_t num_players;
+static uint32_t players_cap;
+static uint32_t *slots;           // Index in players plus one, or 0 if free
+static uint32_t num_slots;        // A power of two
+static uint32_t next_stamp = 1;
+
+static uint32_t top[SCORES_TOP];  // Indices in players, best first
+static int top_len;
+static int top_changed;           // top differs from the published board
+
+struct store {
+    char *path;                   // The snapshot, or NULL to keep nothing
+    char *log_path;
+    char *tmp_path;               // Where a new snapshot or log is written
+    int lock_fd;
+    int log_fd;                   // -1 while nothing can be written
+    uint64_t generation;
+    off_t log_bytes;
+    off_t snapshot_bytes;
+    long long next_compact_ms;    // No compaction is tried before this
+    struct score_record *batch;   // Records not written to the log yet
+    size_t batch_len;
+    size_t batch_cap;
+};
+
+static struct store store = {.lock_fd = -1, .log_fd = -1};
+
+// The leaderboard as the shards see it
+static struct leaderboard published;
+static pthread_mutex_t board_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint32_t fnv1a(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+
+/* Queue what the player called name did in a game. Safe to call from any
+ * thread; never waits.
+ */
+void scores_add(const char *name, const struct player_stats *delta) {
+    size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    struct cell *c;
+    while(1) {
+        size_t idx = pos & (SCORES_RING_SIZE - 1);
+        c = &ring[idx];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) + idx;
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // the writer is a whole ring behind
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    strncpy(c->name, name, SCORES_NAME - 1);
+    c->name[SCORES_NAME - 1] = '\0';
+    c->delta = *delta;
+    __atomic_store_n(&c->seq, pos + 1 - (pos & (SCORES_RING_SIZE - 1)), __ATOMIC_RELEASE);
+}
+
+
+/* Copy the current leaderboard into *board.
+ */
+void scores_top(struct leaderboard *board) {
+    pthread_mutex_lock(&board_lock);
+    *board = published;
+    pthread_mutex_unlock(&board_lock);
+}
+
+
+unsigned long long scores_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+
+static int ranks_before(const struct player *a, const struct player *b) {
+    return a->stats.wins > b->stats.wins
+        || (a->stats.wins == b->stats.wins && a->stamp < b->stamp);
+}
+
+
+/* Move player i to its place in the leaderboard, if it has one. Players
+ * only ever move up, so one pass does.
+ */
+static void update_top(uint32_t i) {
+    int pos = 0;
+    while(pos < top_len && top[pos] != i) {
+        pos++;
+    }
+    if(pos == top_len) {
+        if(top_len < SCORES_TOP) {
+            top_len++;
+        }
+        else if(ranks_before(&players[i], &players[top[top_len - 1]])) {
+            pos = top_len - 1;
+        }
+        else {
+            return;
+        }
+        top[pos] = i;
+    }
+    while(pos > 0 && ranks_before(&players[top[pos]], &players[top[pos - 1]])) {
+        uint32_t t = top[pos];
+        top[pos] = top[pos - 1];
+        top[pos - 1] = t;
+        pos--;
+    }
+    top_changed = 1;
+}
+
+
+static void publish_top(void) {
+    pthread_mutex_lock(&board_lock);
+    published.len = top_len;
+    for(int i = 0; i < top_len; i++) {
+        memcpy(published.top[i].name, players[top[i]].name, SCORES_NAME);
+        published.top[i].stats = players[top[i]].stats;
+    }
+    pthread_mutex_unlock(&board_lock);
+    top_changed = 0;
+}
+
+
+/* Double the hash table and put every player back in.
+ */
+static int grow_slots(void) {
+    uint32_t n = num_slots ? num_slots * 2 : 1024;
+    uint32_t *s = calloc(n, sizeof(uint32_t));
+    if(s == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for(uint32_t i = 0; i < num_players; i++) {
+        uint32_t k = players[i].hash & (n - 1);
+        while(s[k] != 0) {
+            k = (k + 1) & (n - 1);
+        }
+        s[k] = i + 1;
+    }
+    free(slots);
+    slots = s;
+    num_slots = n;
+    return 0;
+}
+
+
+/* Return the index of the player called name, adding one with nothing to
+ * their name if there is none. Return -1 if out of memory.
+ */
+static long find_player(const char *name) {
+    uint32_t hash = fnv1a(name, strlen(name));
+    if(num_slots > 0) {
+        for(uint32_t k = hash & (num_slots - 1); slots[k] != 0; k = (k + 1) & (num_slots - 1)) {
+            struct player *pl = &players[slots[k] - 1];
+            if(pl->hash == hash && strcmp(pl->name, name) == 0) {
+                return slots[k] - 1;
+            }
+        }
+    }
+
+    // keep the table at most half full
+    if((num_players + 1) * 2 > num_slots && grow_slots() < 0) {
+        return -1;
+    }
+    if(num_players == players_cap) {
+        uint32_t cap = players_cap ? players_cap * 2 : 1024;
+        struct player *p = realloc(players, cap * sizeof(struct player));
+        if(p == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        players = p;
+        players_cap = cap;
+    }
+    uint32_t i = num_players++;
+    memset(&players[i], 0, sizeof(struct player));
+    strcpy(players[i].name, name);
+    players[i].hash = hash;
+    uint32_t k = hash & (num_slots - 1);
+    while(slots[k] != 0) {
+        k = (k + 1) & (num_slots - 1);
+    }
+    slots[k] = i + 1;
+    return i;
+}
+
+
+/* Add delta to the statistics of the player called name. Return 0 on
+ * success and -1 if out of memory.
+ */
+static int apply(const char *name, const struct player_stats *delta) {
+    long i = find_player(name);
+    if(i < 0) {
+        return -1;
+    }
+    struct player *pl = &players[i];
+    pl->stats.games += delta->games;
+    pl->stats.wins += delta->wins;
+    pl->stats.hits += delta->hits;
+    pl->stats.misses += delta->misses;
+    pl->stats.think_us += delta->think_us;
+    if(delta->wins > 0) {
+        pl->stamp = next_stamp++;
+        update_top(i);
+    }
+    else if(pl->stats.wins > 0) {
+        // the board shows more than the order
+        for(int k = 0; k < top_len; k++) {
+            if(top[k] == (uint32_t)i) {
+                top_changed = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static void seal_record(struct score_record *r) {
+    r->check = fnv1a(r, offsetof(struct score_record, check));
+}
+
+
+static int record_ok(struct score_record *r) {
+    return r->check == fnv1a(r, offsetof(struct score_record, check))
+        && memchr(r->name, '\0', SCORES_NAME) != NULL && r->name[0] != '\0';
+}
+
+
+static void make_header(struct score_header *h, uint64_t count) {
+    memset(h, 0, sizeof(*h));
+    h->magic = SCORES_MAGIC;
+    h->version = SCORES_VERSION;
+    h->generation = store.generation;
+    h->count = count;
+    h->record_size = sizeof(struct score_record);
+    h->check = fnv1a(h, offsetof(struct score_header, check));
+}
+
+
+static int header_ok(const struct score_header *h) {
+    return h->magic == SCORES_MAGIC && h->version == SCORES_VERSION
+        && h->record_size == sizeof(struct score_record)
+        && h->check == fnv1a(h, offsetof(struct score_header, check));
+}
+
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* Append the records batched so far to the log.
+ */
+static void write_batch(void) {
+    if(store.batch_len == 0) {
+        return;
+    }
+    size_t len = store.batch_len * sizeof(struct score_record);
+    store.batch_len = 0;
+    if(store.log_fd < 0) {
+        return;
+    }
+    if(write_all(store.log_fd, store.batch, len) < 0) {
+        LOG(LOG_ERROR, "Cannot write %s: %s; player stats are not being saved\n",
+            store.log_path, strerror(errno));
+        // cut off whatever part made it, so that later records still load
+        if(ftruncate(store.log_fd, store.log_bytes) < 0) {
+            close(store.log_fd);
+            store.log_fd = -1;
+        }
+        return;
+    }
+    store.log_bytes += len;
+}
+
+
+/* Apply every queued record and write them to the log in one go.
+ * Return the number applied.
+ */
+static int drain(void) {
+    int count = 0;
+    while(1) {
+        size_t idx = dequeue_pos & (SCORES_RING_SIZE - 1);
+        struct cell *c = &ring[idx];
+        if(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) + idx != dequeue_pos + 1) {
+            break;
+        }
+        if(store.batch_len == store.batch_cap) {
+            size_t cap = store.batch_cap ? store.batch_cap * 2 : 1024;
+            struct score_record *b = realloc(store.batch, cap * sizeof(struct score_record));
+            if(b == NULL) {
+                // leave the rest for the next round
+                break;
+            }
+            store.batch = b;
+            store.batch_cap = cap;
+        }
+        struct score_record *r = &store.batch[store.batch_len];
+        memset(r, 0, sizeof(*r));
+        memcpy(r->name, c->name, SCORES_NAME);
+        r->stats = c->delta;
+        __atomic_store_n(&c->seq, dequeue_pos + SCORES_RING_SIZE - idx, __ATOMIC_RELEASE);
+        dequeue_pos++;
+
+        if(apply(r->name, &r->stats) < 0) {
+            continue;
+        }
+        seal_record(r);
+        store.batch_len++;
+        count++;
+    }
+    write_batch();
+    if(top_changed) {
+        publish_top();
+    }
+    return count;
+}
+
+
+/* Start a new, empty log for the current generation, replacing the old
+ * one. Return 0 on success and -1 on failure.
+ */
+static int new_log(void) {
+    struct score_header h;
+    make_header(&h, 0);
+    int fd = open(store.tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || write_all(fd, &h, sizeof(h)) < 0 || fdatasync(fd) < 0
+       || rename(store.tmp_path, store.log_path) < 0) {
+        LOG(LOG_ERROR, "Cannot start %s: %s\n", store.log_path, strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    if(store.log_fd >= 0) {
+        close(store.log_fd);
+    }
+    store.log_fd = open(store.log_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    store.log_bytes = sizeof(h);
+    return store.log_fd < 0 ? -1 : 0;
+}
+
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(players[*(const uint32_t *)a].name, players[*(const uint32_t *)b].name);
+}
+
+
+/* Write every player into a new snapshot of the next generation, and
+ * start a log to follow it. Return 0 on success and -1 on failure. If
+ * the snapshot cannot be written the files stay as they were; if only
+ * the new log cannot be started, nothing more is saved.
+ */
+static int compact(void) {
+    long long start = now_ms();
+    uint32_t *order = malloc((num_players + 1) * sizeof(uint32_t));
+    struct score_record *chunk = malloc(SNAPSHOT_CHUNK * sizeof(struct score_record));
+    if(order == NULL || chunk == NULL) {
+        free(order);
+        free(chunk);
+        return -1;
+    }
+    for(uint32_t i = 0; i < num_players; i++) {
+        order[i] = i;
+    }
+    qsort(order, num_players, sizeof(uint32_t), by_name);
+
+    store.generation++;
+    struct score_header h;
+    make_header(&h, num_players);
+    int fd = open(store.tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int status = fd < 0 || write_all(fd, &h, sizeof(h)) < 0 ? -1 : 0;
+    for(uint32_t i = 0; i < num_players && status == 0; i += SNAPSHOT_CHUNK) {
+        uint32_t n = num_players - i < SNAPSHOT_CHUNK ? num_players - i : SNAPSHOT_CHUNK;
+        memset(chunk, 0, n * sizeof(struct score_record));
+        for(uint32_t k = 0; k < n; k++) {
+            struct player *pl = &players[order[i + k]];
+            memcpy(chunk[k].name, pl->name, SCORES_NAME);
+            chunk[k].stats = pl->stats;
+            chunk[k].stamp = pl->stamp;
+            seal_record(&chunk[k]);
+        }
+        status = write_all(fd, chunk, n * sizeof(struct score_record));
+    }
+    if(status == 0 && (fdatasync(fd) < 0 || rename(store.tmp_path, store.path) < 0)) {
+        status = -1;
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    free(order);
+    free(chunk);
+    if(status < 0) {
+        LOG(LOG_ERROR, "Cannot write %s: %s\n", store.path, strerror(errno));
+        unlink(store.tmp_path);
+        store.generation--;
+        store.next_compact_ms = now_ms() + COMPACT_RETRY_MS;
+        return -1;
+    }
+    store.snapshot_bytes = sizeof(h) + (off_t)num_players * sizeof(struct score_record);
+    // the old log is part of the snapshot now, so nothing more may go to it
+    if(new_log() < 0) {
+        LOG(LOG_ERROR, "Cannot start %s: %s; player stats are not being saved\n",
+            store.log_path, strerror(errno));
+        if(store.log_fd >= 0) {
+            close(store.log_fd);
+            store.log_fd = -1;
+        }
+        return -1;
+    }
+    LOG(LOG_INFO, "Saved the stats of %u players in %lld ms\n", num_players,
+        now_ms() - start);
+    return 0;
+}
+
+
+/* Load the snapshot, if there is one. Return 0 on success and -1 if it is
+ * damaged.
+ */
+static int load_snapshot(void) {
+    FILE *f = fopen(store.path, "r");
+    if(f == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct score_header h;
+    struct score_record *chunk = malloc(SNAPSHOT_CHUNK * sizeof(struct score_record));
+    int status = chunk != NULL && fread(&h, sizeof(h), 1, f) == 1 && header_ok(&h) ? 0 : -1;
+    uint64_t left = status == 0 ? h.count : 0;
+    while(left > 0 && status == 0) {
+        size_t n = left < SNAPSHOT_CHUNK ? left : SNAPSHOT_CHUNK;
+        if(fread(chunk, sizeof(struct score_record), n, f) != n) {
+            status = -1;
+            break;
+        }
+        for(size_t k = 0; k < n && status == 0; k++) {
+            long i;
+            if(!record_ok(&chunk[k]) || (i = find_player(chunk[k].name)) < 0) {
+                status = -1;
+                break;
+            }
+            players[i].stats = chunk[k].stats;
+            players[i].stamp = chunk[k].stamp;
+            if(chunk[k].stamp >= next_stamp) {
+                next_stamp = chunk[k].stamp + 1;
+            }
+            if(chunk[k].stats.wins > 0) {
+                update_top(i);
+            }
+        }
+        left -= n;
+    }
+    if(status == 0) {
+        store.generation = h.generation;
+        store.snapshot_bytes = sizeof(h) + h.count * sizeof(struct score_record);
+    }
+    free(chunk);
+    fclose(f);
+    return status;
+}
+
+
+/* Apply the log that follows the snapshot and open it for appending. A log
+ * of another generation, or none at all, is replaced by an empty one, and
+ * a record cut short by a crash is cut off. Return 0 on success and -1 on
+ * failure.
+ */
+static int load_log(void) {
+    int fd = open(store.log_path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if(fd < 0) {
+        return errno == ENOENT ? new_log() : -1;
+    }
+    FILE *f = fdopen(dup(fd), "r");
+    struct score_header h;
+    if(f == NULL || fread(&h, sizeof(h), 1, f) != 1 || !header_ok(&h)
+       || h.generation != store.generation) {
+        if(f != NULL) {
+            fclose(f);
+        }
+        close(fd);
+        LOG(LOG_INFO, "%s does not follow %s; starting it again\n", store.log_path, store.path);
+        return new_log();
+    }
+    off_t good = sizeof(h);
+    struct score_record r;
+    while(fread(&r, sizeof(r), 1, f) == 1 && record_ok(&r)) {
+        if(apply(r.name, &r.stats) < 0) {
+            break;
+        }
+        good += sizeof(r);
+    }
+    fclose(f);
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size != good) {
+        LOG(LOG_WARN, "Cutting %lld damaged bytes off the end of %s\n",
+            (long long)(st.st_size - good), store.log_path);
+        if(ftruncate(fd, good) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    store.log_fd = fd;
+    store.log_bytes = good;
+    return 0;
+}
+
+
+/* Load the files, which this process holds the lock on.
+ */
+static void open_store(void) {
+    long long start = now_ms();
+    if(load_snapshot() < 0) {
+        // leave the files alone for someone to look at
+        LOG(LOG_ERROR, "Cannot load %s; player stats are not being saved\n", store.path);
+        return;
+    }
+    if(load_log() < 0) {
+        LOG(LOG_ERROR, "Cannot load %s: %s; player stats are not being saved\n",
+            store.log_path, strerror(errno));
+        return;
+    }
+    LOG(LOG_INFO, "Loaded the stats of %u players from %s in %lld ms\n", num_players,
+        store.path, now_ms() - start);
+}
+
+
+static void *writer_thread(void *arg) {
+    if(store.path != NULL) {
+        // the lock is taken outside drain_lock so that exiting while
+        // waiting for it does not wait too
+        int locked = flock(store.lock_fd, LOCK_EX) == 0;
+        pthread_mutex_lock(&drain_lock);
+        if(locked) {
+            open_store();
+        }
+        else {
+            LOG(LOG_ERROR, "Cannot lock %s.lock: %s; player stats are not being saved\n",
+                store.path, strerror(errno));
+        }
+        publish_top();
+        ready = 1;
+        pthread_mutex_unlock(&drain_lock);
+    }
+
+    unsigned long long reported = 0;
+    struct timespec pause = {0, SCORES_BATCH_NS};
+    while(1) {
+        pthread_mutex_lock(&drain_lock);
+        drain();
+        if(store.log_fd >= 0 && store.log_bytes > MIN_COMPACT_BYTES
+           && store.log_bytes > store.snapshot_bytes && now_ms() >= store.next_compact_ms) {
+            compact();
+        }
+        pthread_mutex_unlock(&drain_lock);
+
+        unsigned long long d = scores_dropped();
+        if(d != reported) {
+            LOG(LOG_WARN, "Player stats: dropped %llu records\n", d - reported);
+            reported = d;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+
+/* Write out what is still queued when the process exits, including on
+ * handing over to a new process in an upgrade.
+ */
+static void scores_flush_at_exit(void) {
+    pthread_mutex_lock(&drain_lock);
+    if(ready) {
+        drain();
+    }
+    pthread_mutex_unlock(&drain_lock);
+}
+
+
+/* Start the thread that keeps player stats, in the files at path, or only
+ * in memory if path is NULL. The files are loaded by that thread, so this
+ * does not wait for them. Return 0 on success and -1 on failure.
+ */
+int scores_start(const char *path) {
+    if(path != NULL) {
+        size_t len = strlen(path);
+        store.path = strdup(path);
+        store.log_path = malloc(len + 5);
+        store.tmp_path = malloc(len + 5);
+        char *lock_path = malloc(len + 6);
+        if(store.path == NULL || store.log_path == NULL || store.tmp_path == NULL
+           || lock_path == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        sprintf(store.log_path, "%s.log", path);
+        sprintf(store.tmp_path, "%s.tmp", path);
+        sprintf(lock_path, "%s.lock", path);
+        store.lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(store.lock_fd < 0) {
+            perror(lock_path);
+            free(lock_path);
+            return -1;
+        }
+        free(lock_path);
+    }
+    else {
+        ready = 1;
+    }
+
+    // the writer thread takes no signals, so that none meant for another
+    // thread's signalfd is delivered to it instead
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(scores_flush_at_exit);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _SCORES_H_
+#define _SCORES_H_
+
+#include <stdint.h>
+
+#include "gameplay.h"
+
+/* Player statistics that outlive the server, and a leaderboard.
+ *
+ * Shards hand over what each player did in a game with scores_add, which
+ * queues a record in a lock-free ring and returns; it never waits, and
+ * drops the record if the ring is full. A thread of its own applies the
+ * records to a hash table of every player and to the top SCORES_TOP, and
+ * appends them to a log in one write per batch.
+ *
+ * On disk there is a snapshot, FILE, with one record per player sorted by
+ * name, and the log, FILE.log, of what happened since. Once the log grows
+ * past the size of the snapshot, the table is written out as a new
+ * snapshot and the log starts again. Each log belongs to the snapshot
+ * generation it follows, so a log that was already folded into the
+ * snapshot, because the server stopped between the two steps, is ignored.
+ * FILE.lock keeps two servers from using the same files; a server started
+ * by an upgrade waits there until the old one has written its last batch.
+ *
+ * The leaderboard ranks players by wins, and players with as many wins by
+ * who got there first. Since nobody's place can get worse through someone
+ * else's game, it is kept up to date with every record in O(SCORES_TOP).
+ */
+
+#define SCORES_TOP 10
+#define SCORES_NAME 32            // Bytes for a name on disk, NUL included
+
+struct leader {
+    char name[SCORES_NAME];
+    struct player_stats stats;
+};
+
+struct leaderboard {
+    int len;
+    struct leader top[SCORES_TOP];
+};
+
+int scores_start(const char *path);
+void scores_add(const char *name, const struct player_stats *delta);
+void scores_top(struct leaderboard *board);
+unsigned long long scores_dropped(void);
+
+#endif
@@ -1,12 +1,16 @@
+#define _GNU_SOURCE         /* accept4 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 
 #include "socket.h"
+#include "log.h"
 
 /*
  * Initialize a server address associated with the given port.
@@ -31,10 +35,12 @@ struct sockaddr_in *init_server_addr(int port) {
 
 
 /*
- * Create and set up a socket for a server to listen on.
+ * Create and set up a non-blocking socket for a server to listen on.
+ * If reuse_port is set, several sockets may listen on the same port and
+ * the kernel balances new connections between them.
  */
-int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
-    int soc = socket(PF_INET, SOCK_STREAM, 0);
+int set_up_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port) {
+    int soc = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (soc < 0) {
         perror("socket");
         exit(1);
@@ -49,6 +55,11 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
         perror("setsockopt");
         exit(1);
     }
+    if (reuse_port && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+        (const char *) &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
 
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
@@ -69,27 +80,46 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
- * Terminate with exit code 1 if the accept call failed, otherwise return
- * the client's socket descriptor.
+ * Accept a pending connection without waiting for one. Return the client's
+ * socket descriptor, already non-blocking, or -1 with errno set if none
+ * could be accepted.
  */
 int accept_connection(int listenfd, struct sockaddr_in *q) {
     struct sockaddr_in peer;
-    unsigned int peer_len = sizeof(peer);
+    socklen_t peer_len = sizeof(peer);
     peer.sin_family = PF_INET;
 
-    printf("Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
-    if (client_socket < 0) {
-        perror("accept");
-        exit(1);
-    } else {
-        printf("New connection accepted from %s:%d\n",
+    int client_socket = accept4(listenfd, (struct sockaddr *)&peer, &peer_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket >= 0) {
+        LOG(LOG_DEBUG, "New connection accepted from %s:%d\n",
             inet_ntoa(peer.sin_addr),
             ntohs(peer.sin_port));
-            *q = peer;
-        return client_socket;
+        *q = peer;
+    }
+    return client_socket;
+}
+
+
+
+
+/*
+ * Put fd in non-blocking mode. Return 0 on success and -1 on failure.
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
     }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 
+/*
+ * Send small writes on fd right away instead of holding them back until
+ * earlier data is acknowledged. Return 0 on success and -1 on failure.
+ */
+int set_nodelay(int fd) {
+    int on = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
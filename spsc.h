@@ -0,0 +1,96 @@
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A bounded queue between exactly one producer thread and one consumer
+ * thread, without locks or read-modify-write instructions. Entries of a
+ * fixed size are filled and read in place: the producer asks for a free
+ * slot, fills it and pushes it; the consumer peeks at the oldest entry,
+ * uses it and pops it.
+ *
+ * Each side's index sits on a cache line of its own, next to the copy it
+ * keeps of the other side's index. The copy is only read again when the
+ * queue looks full, or empty, so in a busy queue the two threads rarely
+ * touch the same line.
+ */
+
+struct spsc {
+    // the consumer's side
+    size_t head __attribute__((aligned(64)));
+    size_t tail_seen;             // tail, as the consumer last read it
+    // the producer's side
+    size_t tail __attribute__((aligned(64)));
+    size_t head_seen;             // head, as the producer last read it
+    // set once
+    char *entries __attribute__((aligned(64)));
+    size_t entry_size;
+    size_t mask;                  // Capacity - 1; the capacity is a power of 2
+};
+
+/* Make q a queue of capacity entries of entry_size bytes each, rounding
+ * capacity up to a power of two. Return 0 on success and -1 if memory
+ * could not be allocated.
+ */
+static inline int spsc_init(struct spsc *q, size_t entry_size, size_t capacity) {
+    size_t cap = 1;
+    while(cap < capacity) {
+        cap *= 2;
+    }
+    memset(q, 0, sizeof(*q));
+    if(posix_memalign((void **)&q->entries, 64, cap * entry_size) != 0) {
+        return -1;
+    }
+    q->entry_size = entry_size;
+    q->mask = cap - 1;
+    return 0;
+}
+
+/* Producer: return the slot the next entry goes in, or NULL if q is full.
+ */
+static inline void *spsc_slot(struct spsc *q) {
+    if(q->tail - q->head_seen > q->mask) {
+        q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if(q->tail - q->head_seen > q->mask) {
+            return NULL;
+        }
+    }
+    return q->entries + (q->tail & q->mask) * q->entry_size;
+}
+
+/* Producer: hand the entry filled in through spsc_slot to the consumer.
+ */
+static inline void spsc_push(struct spsc *q) {
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: return the oldest entry, or NULL if q is empty.
+ */
+static inline void *spsc_peek(struct spsc *q) {
+    if(q->head == q->tail_seen) {
+        q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if(q->head == q->tail_seen) {
+            return NULL;
+        }
+    }
+    return q->entries + (q->head & q->mask) * q->entry_size;
+}
+
+/* Consumer: give the slot of the entry returned by spsc_peek back.
+ */
+static inline void spsc_pop(struct spsc *q) {
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: return whether q is empty, reading the producer's index with
+ * a full barrier, for a consumer about to sleep that must not miss an
+ * entry pushed just before.
+ */
+static inline int spsc_drained(struct spsc *q) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return q->head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
+
+#endif
@@ -0,0 +1,207 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define WHEEL_SPAN (1LL << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+
+void timer_wheel_init(struct timer_wheel *w, long long now_ms, long long tick_ms) {
+    memset(w, 0, sizeof(*w));
+    w->base_ms = now_ms;
+    w->tick_ms = tick_ms;
+}
+
+
+void timer_init(struct timer *t, void (*fn)(struct timer *t)) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->slot = -1;
+    t->fn = fn;
+}
+
+
+/* Put t at the head of the list *head.
+ */
+static void link(struct timer **head, struct timer *t) {
+    t->next = *head;
+    if(t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+}
+
+
+/* Take t off whatever list it is on.
+ */
+static void unlink(struct timer_wheel *w, struct timer *t) {
+    *t->pprev = t->next;
+    if(t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    if(t->slot >= 0) {
+        int level = t->slot / TIMER_SLOTS;
+        int idx = t->slot % TIMER_SLOTS;
+        if(w->slots[level][idx] == NULL) {
+            w->occupied[level] &= ~(1ULL << idx);
+        }
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    t->slot = -1;
+}
+
+
+/* File t under the slot its expiry falls in, as seen from tick w->now.
+ */
+static void place(struct timer_wheel *w, struct timer *t) {
+    long long e = t->expires < w->now ? w->now : t->expires;
+    long long delta = e - w->now;
+    if(delta >= WHEEL_SPAN) {
+        // out of reach; wait in the top level's farthest slot
+        e = w->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while(delta >= 1LL << ((level + 1) * TIMER_SLOT_BITS)) {
+        level++;
+    }
+    int idx = (e >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+    link(&w->slots[level][idx], t);
+    t->slot = level * TIMER_SLOTS + idx;
+    w->occupied[level] |= 1ULL << idx;
+}
+
+
+/* Arm t to fire at expires_ms, or move it there if it is already armed.
+ * A time in the past fires at the next timer_run.
+ */
+void timer_add(struct timer_wheel *w, struct timer *t, long long expires_ms) {
+    if(timer_pending(t)) {
+        unlink(w, t);
+        w->pending--;
+    }
+    // round up, so that a timer never fires early
+    long long since = expires_ms - w->base_ms;
+    t->expires = since <= 0 ? 0 : (since + w->tick_ms - 1) / w->tick_ms;
+    place(w, t);
+    w->pending++;
+}
+
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+    if(timer_pending(t)) {
+        unlink(w, t);
+        w->pending--;
+    }
+}
+
+
+/* Move the list in slot idx of level into *head, which then owns it.
+ */
+static void detach(struct timer_wheel *w, int level, int idx, struct timer **head) {
+    *head = w->slots[level][idx];
+    w->slots[level][idx] = NULL;
+    w->occupied[level] &= ~(1ULL << idx);
+    if(*head != NULL) {
+        (*head)->pprev = head;
+    }
+    for(struct timer *t = *head; t != NULL; t = t->next) {
+        t->slot = -1;
+    }
+}
+
+
+/* Return the first tick from w->now on at which the wheel has work: a
+ * first-level slot to fire, or a higher-level slot to move down. Return
+ * -1 if no timer is pending.
+ */
+static long long next_tick(struct timer_wheel *w) {
+    long long best = -1;
+    for(int level = 0; level < TIMER_LEVELS; level++) {
+        if(w->occupied[level] == 0) {
+            continue;
+        }
+        int shift = level * TIMER_SLOT_BITS;
+        // a slot above the first level is moved down when its span starts;
+        // the current one has started already unless w->now is its start
+        long long first = w->now >> shift;
+        if(level > 0 && (w->now & ((1LL << shift) - 1)) != 0) {
+            first++;
+        }
+        int k = first & SLOT_MASK;
+        uint64_t bits = w->occupied[level];
+        uint64_t rotated = k == 0 ? bits : (bits >> k) | (bits << (64 - k));
+        long long tick = (first + __builtin_ctzll(rotated)) << shift;
+        if(best < 0 || tick < best) {
+            best = tick;
+        }
+    }
+    return best;
+}
+
+
+/* Run tick w->now: move down the higher-level slots that start at it, then
+ * fire the timers in its first-level slot.
+ */
+static void run_tick(struct timer_wheel *w) {
+    int idx = w->now & SLOT_MASK;
+    for(int level = 1; idx == 0 && level < TIMER_LEVELS; level++) {
+        int up = (w->now >> (level * TIMER_SLOT_BITS)) & SLOT_MASK;
+        struct timer *list;
+        detach(w, level, up, &list);
+        while(list != NULL) {
+            struct timer *t = list;
+            unlink(w, t);
+            place(w, t);
+        }
+        if(up != 0) {
+            break;
+        }
+    }
+
+    struct timer *expired;
+    detach(w, 0, idx, &expired);
+    w->now++;
+    // a callback may add or cancel any timer, including the ones left here
+    while(expired != NULL) {
+        struct timer *t = expired;
+        unlink(w, t);
+        w->pending--;
+        t->fn(t);
+    }
+}
+
+
+/* Fire every timer due by now_ms. Ticks with nothing to do are skipped
+ * over, so the cost does not depend on how long the wheel sat idle.
+ */
+void timer_run(struct timer_wheel *w, long long now_ms) {
+    long long target = (now_ms - w->base_ms) / w->tick_ms;
+    while(w->now <= target) {
+        long long tick = next_tick(w);
+        if(tick < 0 || tick > target) {
+            w->now = target + 1;
+            break;
+        }
+        w->now = tick;
+        run_tick(w);
+    }
+}
+
+
+/* Return how many ms from now_ms timer_run next has work, 0 if it has
+ * work already, or -1 if no timer is pending. Suitable as the timeout of
+ * a wait for events.
+ */
+long long timer_next_ms(struct timer_wheel *w, long long now_ms) {
+    long long tick = next_tick(w);
+    if(tick < 0) {
+        return -1;
+    }
+    long long wait = w->base_ms + tick * w->tick_ms - now_ms;
+    return wait < 0 ? 0 : wait;
+}
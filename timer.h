@@ -0,0 +1,62 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A hierarchical timing wheel. Time is counted in ticks of tick_ms. The
+ * first level has a slot for each of the next TIMER_SLOTS ticks, and every
+ * level above it has slots TIMER_SLOTS times as wide. A timer goes into
+ * the slot of the lowest level that reaches its expiry, and moves down a
+ * level whenever the wheel below wraps around. Adding and cancelling are
+ * O(1). Timers are embedded in the objects they belong to, so the wheel
+ * never allocates.
+ *
+ * Timers beyond the reach of the top level (TIMER_SLOTS^TIMER_LEVELS
+ * ticks) wait in its farthest slot and are placed again when it comes up.
+ */
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;     // What points at this timer; NULL if idle
+    long long expires;        // Tick at which it fires
+    int slot;                 // level * TIMER_SLOTS + slot, or -1
+    void (*fn)(struct timer *t);
+};
+
+struct timer_wheel {
+    long long base_ms;        // Time of tick 0
+    long long tick_ms;
+    long long now;            // Next tick to run
+    int pending;              // Timers waiting to fire
+    uint64_t occupied[TIMER_LEVELS]; // Bit i set if slot i is not empty
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, long long now_ms, long long tick_ms);
+void timer_init(struct timer *t, void (*fn)(struct timer *t));
+void timer_add(struct timer_wheel *w, struct timer *t, long long expires_ms);
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+void timer_run(struct timer_wheel *w, long long now_ms);
+long long timer_next_ms(struct timer_wheel *w, long long now_ms);
+
+/* The object of the given type whose field member is the timer t.
+ */
+#define timer_owner(t, type, member) \
+    ((type *)((char *)(t) - offsetof(type, member)))
+
+static inline int timer_pending(const struct timer *t) {
+    return t->pprev != NULL;
+}
+
+/* The time at which a pending timer t fires, in ms on the clock of w.
+ */
+static inline long long timer_expiry_ms(const struct timer_wheel *w, const struct timer *t) {
+    return w->base_ms + t->expires * w->tick_ms;
+}
+
+#endif
@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "upgrade.h"
+#include "clock.h"
+#include "log.h"
+
+#define UPGRADE_MAGIC 0x57474755      // "WGGU"
+#define UPGRADE_VERSION 4
+#define UPGRADE_CHUNK 16384           // Bytes of snapshot per record
+#define UPGRADE_FDS_PER_MSG 250       // Below the kernel's SCM_MAX_FD of 253
+#define UPGRADE_MAX_STATE (1ULL << 32) // Bytes of one shard's snapshot, past
+                                      // which the header is taken as damaged
+#define READY_TIMEOUT_MS 30000        // For the new process to load the dictionary
+#define PARK_TIMEOUT_MS 5000          // For every shard to stop
+#define ACK_TIMEOUT_MS 10000          // For the new process to take over
+
+struct upgrader {
+    int sigfd;                        // Delivers SIGUSR2
+    char **argv;
+};
+
+static int num_snapshots;
+static struct snapshot *snapshots;    // One per shard
+static int (*wake)[2];                // Per shard: [0] watched by it, [1] written here
+
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static int freezing;                  // An upgrade wants the shards stopped
+static int parked;                    // Shards stopped and waiting
+
+static int handover_fd = -1;          // In a new process, until upgrade_finish
+
+
+/* Make room for n more bytes in s. Return 0 on success and -1 on failure.
+ */
+static int snap_reserve(struct snapshot *s, size_t n) {
+    if(s->bad) {
+        return -1;
+    }
+    if(s->len + n > s->cap) {
+        size_t cap = s->cap ? s->cap : 4096;
+        while(cap < s->len + n) {
+            cap *= 2;
+        }
+        char *data = realloc(s->data, cap);
+        if(data == NULL) {
+            s->bad = 1;
+            return -1;
+        }
+        s->data = data;
+        s->cap = cap;
+    }
+    return 0;
+}
+
+
+void snap_put(struct snapshot *s, const void *p, size_t n) {
+    if(snap_reserve(s, n) == 0) {
+        memcpy(s->data + s->len, p, n);
+        s->len += n;
+    }
+}
+
+
+void snap_put_u32(struct snapshot *s, uint32_t v) {
+    snap_put(s, &v, sizeof(v));
+}
+
+
+void snap_put_u64(struct snapshot *s, uint64_t v) {
+    snap_put(s, &v, sizeof(v));
+}
+
+
+/* Add n bytes to s and return where they are, for the caller to fill in,
+ * or NULL on failure.
+ */
+void *snap_extend(struct snapshot *s, size_t n) {
+    if(snap_reserve(s, n) < 0) {
+        return NULL;
+    }
+    s->len += n;
+    return s->data + s->len - n;
+}
+
+
+/* Attach fd to s and write its number among the attached ones.
+ */
+void snap_put_fd(struct snapshot *s, int fd) {
+    if(s->num_fds == s->fds_cap) {
+        int cap = s->fds_cap ? s->fds_cap * 2 : 64;
+        int *fds = realloc(s->fds, cap * sizeof(int));
+        if(fds == NULL) {
+            s->bad = 1;
+            return;
+        }
+        s->fds = fds;
+        s->fds_cap = cap;
+    }
+    snap_put_u32(s, s->num_fds);
+    s->fds[s->num_fds++] = fd;
+}
+
+
+void snap_get(struct snapshot *s, void *p, size_t n) {
+    if(s->bad || n > s->len - s->pos) {
+        s->bad = 1;
+        memset(p, 0, n);
+        return;
+    }
+    memcpy(p, s->data + s->pos, n);
+    s->pos += n;
+}
+
+
+/* Return the next n bytes of s in place, or NULL if there are fewer.
+ */
+const void *snap_view(struct snapshot *s, size_t n) {
+    if(s->bad || n > s->len - s->pos) {
+        s->bad = 1;
+        return NULL;
+    }
+    s->pos += n;
+    return s->data + s->pos - n;
+}
+
+
+uint32_t snap_get_u32(struct snapshot *s) {
+    uint32_t v;
+    snap_get(s, &v, sizeof(v));
+    return v;
+}
+
+
+uint64_t snap_get_u64(struct snapshot *s) {
+    uint64_t v;
+    snap_get(s, &v, sizeof(v));
+    return v;
+}
+
+
+/* Return the descriptor whose number is read from s, or -1.
+ */
+int snap_get_fd(struct snapshot *s) {
+    uint32_t i = snap_get_u32(s);
+    if(s->bad || i >= (uint32_t)s->num_fds) {
+        s->bad = 1;
+        return -1;
+    }
+    return s->fds[i];
+}
+
+
+/* Release the memory of s, but not the descriptors attached to it.
+ */
+void snap_free(struct snapshot *s) {
+    free(s->data);
+    free(s->fds);
+    memset(s, 0, sizeof(*s));
+}
+
+
+/* Return the socket shard must watch for a request to stop.
+ */
+int upgrade_wake_fd(int shard) {
+    return wake[shard][0];
+}
+
+
+/* Consume what woke shard. It then has to stop at the end of its loop
+ * iteration: save into upgrade_snapshot and call upgrade_park.
+ */
+void upgrade_woken(int shard) {
+    char buf[16];
+    while(read(wake[shard][0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+
+/* Return the empty snapshot for shard to save its state into.
+ */
+struct snapshot *upgrade_snapshot(int shard) {
+    snap_free(&snapshots[shard]);
+    return &snapshots[shard];
+}
+
+
+/* Stop the calling shard until the upgrade is over. If it succeeds the
+ * process exits, so this returns only if the upgrade was called off; the
+ * shard then goes on as before.
+ */
+void upgrade_park(int shard) {
+    pthread_mutex_lock(&park_lock);
+    if(freezing) {
+        parked++;
+        pthread_cond_broadcast(&park_cond);
+        while(freezing) {
+            pthread_cond_wait(&park_cond, &park_lock);
+        }
+        parked--;
+    }
+    pthread_mutex_unlock(&park_lock);
+    snap_free(&snapshots[shard]);
+}
+
+
+/* Wait up to timeout_ms for fd to send the byte expected. Return 0 if it
+ * did and -1 otherwise.
+ */
+static int wait_byte(int fd, char expected, int timeout_ms) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    long long deadline = now_ms() + timeout_ms;
+    while(1) {
+        int left = deadline - now_ms();
+        int n = poll(&pfd, 1, left > 0 ? left : 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        char c;
+        ssize_t r = recv(fd, &c, 1, 0);
+        if(r < 0 && errno == EINTR) {
+            continue;
+        }
+        return r == 1 && c == expected ? 0 : -1;
+    }
+}
+
+
+static int send_record(int fd, const void *p, size_t n) {
+    while(send(fd, p, n, 0) < 0) {
+        if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Receive a record of exactly n bytes. Return 0 on success and -1 on
+ * failure.
+ */
+static int recv_record(int fd, void *p, size_t n) {
+    ssize_t r;
+    while((r = recv(fd, p, n, 0)) < 0) {
+        if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return (size_t)r == n ? 0 : -1;
+}
+
+
+/* Send the n descriptors in fds, UPGRADE_FDS_PER_MSG to a record.
+ */
+static int send_fds(int fd, const int *fds, int n) {
+    char cbuf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+    for(int done = 0; done < n; ) {
+        int count = n - done < UPGRADE_FDS_PER_MSG ? n - done : UPGRADE_FDS_PER_MSG;
+        char byte = 0;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(c), fds + done, count * sizeof(int));
+        while(sendmsg(fd, &msg, 0) < 0) {
+            if(errno != EINTR) {
+                return -1;
+            }
+        }
+        done += count;
+    }
+    return 0;
+}
+
+
+/* Receive n descriptors sent by send_fds into fds.
+ */
+static int recv_fds(int fd, int *fds, int n) {
+    char cbuf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+    for(int done = 0; done < n; ) {
+        int count = n - done < UPGRADE_FDS_PER_MSG ? n - done : UPGRADE_FDS_PER_MSG;
+        char byte;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        ssize_t r;
+        while((r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+        }
+        struct cmsghdr *c = r == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if(c == NULL || (msg.msg_flags & MSG_CTRUNC) || c->cmsg_type != SCM_RIGHTS
+           || c->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+            return -1;
+        }
+        memcpy(fds + done, CMSG_DATA(c), count * sizeof(int));
+        done += count;
+    }
+    return 0;
+}
+
+
+/* Send every shard's snapshot to the new process.
+ */
+static int send_snapshots(int fd) {
+    struct snapshot head;
+    memset(&head, 0, sizeof(head));
+    snap_put_u32(&head, UPGRADE_MAGIC);
+    snap_put_u32(&head, UPGRADE_VERSION);
+    snap_put_u32(&head, num_snapshots);
+    for(int i = 0; i < num_snapshots; i++) {
+        snap_put_u64(&head, snapshots[i].len);
+        snap_put_u32(&head, snapshots[i].num_fds);
+        if(snapshots[i].bad) {
+            head.bad = 1;
+        }
+    }
+    int status = head.bad ? -1 : send_record(fd, head.data, head.len);
+    snap_free(&head);
+
+    for(int i = 0; i < num_snapshots && status == 0; i++) {
+        struct snapshot *s = &snapshots[i];
+        for(size_t off = 0; off < s->len && status == 0; off += UPGRADE_CHUNK) {
+            size_t n = s->len - off < UPGRADE_CHUNK ? s->len - off : UPGRADE_CHUNK;
+            status = send_record(fd, s->data + off, n);
+        }
+        if(status == 0) {
+            status = send_fds(fd, s->fds, s->num_fds);
+        }
+    }
+    return status;
+}
+
+
+/* Start the new process, with the other end of sock as its handover
+ * socket. Return its pid, or -1.
+ */
+static pid_t spawn(char **argv, int sock) {
+    char num[16];
+    snprintf(num, sizeof(num), "%d", sock);
+    // setenv is not safe between fork and exec, so it is done here
+    setenv(UPGRADE_ENV, num, 1);
+    pid_t pid = fork();
+    if(pid == 0) {
+        // exec keeps the signal mask, and this thread blocks everything
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(sock, F_SETFD, 0);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    unsetenv(UPGRADE_ENV);
+    if(pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+
+/* Call off an upgrade: let the shards go on, and make sure the new process
+ * is gone.
+ */
+static void abort_upgrade(pid_t pid) {
+    pthread_mutex_lock(&park_lock);
+    freezing = 0;
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+    if(pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+
+static void upgrade(struct upgrader *u) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return;
+    }
+    LOG(LOG_INFO, "Upgrading: starting %s\n", u->argv[0]);
+    pid_t pid = spawn(u->argv, sv[1]);
+    close(sv[1]);
+    if(pid < 0) {
+        close(sv[0]);
+        return;
+    }
+    if(wait_byte(sv[0], 'R', READY_TIMEOUT_MS) < 0) {
+        LOG(LOG_WARN, "Upgrade failed: the new process did not start\n");
+        abort_upgrade(pid);
+        close(sv[0]);
+        return;
+    }
+
+    // from here on, clients wait
+    long long start = now_us();
+    pthread_mutex_lock(&park_lock);
+    freezing = 1;
+    pthread_mutex_unlock(&park_lock);
+    for(int i = 0; i < num_snapshots; i++) {
+        if(write(wake[i][1], "", 1) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PARK_TIMEOUT_MS / 1000;
+    pthread_mutex_lock(&park_lock);
+    while(parked < num_snapshots) {
+        if(pthread_cond_timedwait(&park_cond, &park_lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int all_parked = parked == num_snapshots;
+    pthread_mutex_unlock(&park_lock);
+    long long stopped = now_us();
+
+    const char *failure = NULL;
+    if(!all_parked) {
+        failure = "the shards did not stop";
+    }
+    else if(send_snapshots(sv[0]) < 0) {
+        failure = "cannot send the state";
+    }
+    else if(wait_byte(sv[0], 'A', ACK_TIMEOUT_MS) < 0) {
+        failure = "the new process did not take over";
+    }
+    if(failure != NULL) {
+        LOG(LOG_WARN, "Upgrade failed: %s; carrying on\n", failure);
+        abort_upgrade(pid);
+        close(sv[0]);
+        return;
+    }
+
+    LOG(LOG_INFO, "Handed over to pid %d after a pause of %lld us, %lld of them "
+        "stopping the shards\n", (int)pid, now_us() - start, stopped - start);
+    exit(0);
+}
+
+
+static void *upgrade_thread(void *arg) {
+    struct upgrader *u = arg;
+    struct pollfd pfd = {u->sigfd, POLLIN, 0};
+    while(1) {
+        if(poll(&pfd, 1, -1) < 0) {
+            if(errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        struct signalfd_siginfo si;
+        if(read(u->sigfd, &si, sizeof(si)) == sizeof(si)) {
+            upgrade(u);
+        }
+    }
+    return NULL;
+}
+
+
+/* Give each of num_shards shards a wake socket and a snapshot, and start
+ * the thread that upgrades to argv[0], run with argv, on SIGUSR2. SIGUSR2
+ * is blocked in the calling thread, so this must run before the other
+ * threads are created for them to inherit that.
+ * Return 0 on success and -1 on failure.
+ */
+int upgrade_start(char **argv, int num_shards) {
+    num_snapshots = num_shards;
+    snapshots = calloc(num_shards, sizeof(struct snapshot));
+    wake = calloc(num_shards, sizeof(*wake));
+    struct upgrader *u = malloc(sizeof(struct upgrader));
+    if(snapshots == NULL || wake == NULL || u == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for(int i = 0; i < num_shards; i++) {
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, wake[i]) < 0) {
+            perror("socketpair");
+            return -1;
+        }
+    }
+    u->argv = argv;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    u->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if(u->sigfd < 0) {
+        perror("signalfd");
+        return -1;
+    }
+
+    // the upgrade thread takes no signals, so that none meant for another
+    // thread's signalfd is delivered to it instead
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, upgrade_thread, u);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+
+/* In a process started by an upgrade, tell the old process it is ready
+ * and receive the snapshots of its num_shards shards into a new array
+ * stored in *snaps. Return 1 on success, 0 if this process was not started
+ * by an upgrade, and -1 on failure.
+ */
+int upgrade_inherit(int num_shards, struct snapshot **snaps) {
+    *snaps = NULL;
+    const char *env = getenv(UPGRADE_ENV);
+    if(env == NULL) {
+        return 0;
+    }
+    int fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if(send_record(fd, "R", 1) < 0) {
+        perror("upgrade");
+        return -1;
+    }
+
+    struct snapshot head;
+    memset(&head, 0, sizeof(head));
+    size_t head_len = 3 * sizeof(uint32_t) + num_shards * (sizeof(uint64_t) + sizeof(uint32_t));
+    if(snap_reserve(&head, head_len) < 0 || recv_record(fd, head.data, head_len) < 0) {
+        fprintf(stderr, "upgrade: cannot receive the state\n");
+        snap_free(&head);
+        return -1;
+    }
+    head.len = head_len;
+    if(snap_get_u32(&head) != UPGRADE_MAGIC || snap_get_u32(&head) != UPGRADE_VERSION
+       || snap_get_u32(&head) != (uint32_t)num_shards) {
+        fprintf(stderr, "upgrade: the old process saved its state in another "
+                "format, or runs another number of threads\n");
+        snap_free(&head);
+        return -1;
+    }
+
+    struct snapshot *s = calloc(num_shards, sizeof(struct snapshot));
+    if(s == NULL) {
+        perror("calloc");
+        snap_free(&head);
+        return -1;
+    }
+    // a damaged header must not make this process allocate without end
+    struct rlimit lim;
+    if(getrlimit(RLIMIT_NOFILE, &lim) < 0) {
+        perror("getrlimit");
+        snap_free(&head);
+        return -1;
+    }
+    for(int i = 0; i < num_shards; i++) {
+        uint64_t len = snap_get_u64(&head);
+        uint32_t num_fds = snap_get_u32(&head);
+        if(len > UPGRADE_MAX_STATE || num_fds >= lim.rlim_cur) {
+            fprintf(stderr, "upgrade: the state of shard %d is too large to be real\n", i);
+            snap_free(&head);
+            return -1;
+        }
+        s[i].fds = malloc((num_fds + 1) * sizeof(int));
+        int status = s[i].fds == NULL || snap_reserve(&s[i], len) < 0 ? -1 : 0;
+        for(size_t off = 0; off < len && status == 0; off += UPGRADE_CHUNK) {
+            size_t n = len - off < UPGRADE_CHUNK ? len - off : UPGRADE_CHUNK;
+            status = recv_record(fd, s[i].data + off, n);
+        }
+        if(status == 0) {
+            status = recv_fds(fd, s[i].fds, num_fds);
+        }
+        if(status < 0) {
+            fprintf(stderr, "upgrade: cannot receive the state of shard %d\n", i);
+            snap_free(&head);
+            return -1;
+        }
+        s[i].len = len;
+        s[i].num_fds = s[i].fds_cap = num_fds;
+    }
+    snap_free(&head);
+    handover_fd = fd;
+    *snaps = s;
+    return 1;
+}
+
+
+/* Tell the old process that this one has taken over, so that it exits.
+ * Return 0 on success and -1 on failure.
+ */
+int upgrade_finish(void) {
+    int status = send_record(handover_fd, "A", 1);
+    if(status < 0) {
+        perror("upgrade");
+    }
+    close(handover_fd);
+    handover_fd = -1;
+    return status;
+}
@@ -0,0 +1,65 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Upgrading the server in place. On SIGUSR2 the server starts its own
+ * binary again, found through argv[0] so that a new build installed under
+ * the same name is the one that runs, and hands it the whole running
+ * state:
+ *
+ *   1. The new process loads the dictionary while the old one keeps
+ *      playing, then says it is ready.
+ *   2. Every shard of the old process finishes its loop iteration, saves
+ *      its game, its clients and their pending input and output into a
+ *      snapshot, and stops.
+ *   3. The snapshots go over a Unix socket, with the listening and client
+ *      sockets attached as SCM_RIGHTS.
+ *   4. The new process acknowledges once it holds everything, and the old
+ *      one exits. Its shards pick up where the old ones stopped.
+ *
+ * Clients see a pause for as long as steps 2 to 4 take, and nothing else.
+ * If the new process fails before step 4, the old one carries on as if
+ * nothing had happened.
+ */
+
+#define UPGRADE_ENV "WORDSRV_UPGRADE_FD"
+
+/* A shard's saved state: bytes in host order, and the descriptors the
+ * bytes refer to by number. Reading past the end sets bad instead of
+ * failing at once, so a reader can check once at the end.
+ */
+struct snapshot {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;                   // Where the next read starts
+    int *fds;
+    int num_fds;
+    int fds_cap;
+    int bad;                      // A read ran out of data, or a write of memory
+};
+
+void snap_put(struct snapshot *s, const void *p, size_t n);
+void snap_put_u32(struct snapshot *s, uint32_t v);
+void snap_put_u64(struct snapshot *s, uint64_t v);
+void snap_put_fd(struct snapshot *s, int fd);
+void *snap_extend(struct snapshot *s, size_t n);
+void snap_get(struct snapshot *s, void *p, size_t n);
+uint32_t snap_get_u32(struct snapshot *s);
+uint64_t snap_get_u64(struct snapshot *s);
+int snap_get_fd(struct snapshot *s);
+const void *snap_view(struct snapshot *s, size_t n);
+void snap_free(struct snapshot *s);
+
+int upgrade_start(char **argv, int num_shards);
+int upgrade_wake_fd(int shard);
+void upgrade_woken(int shard);
+struct snapshot *upgrade_snapshot(int shard);
+void upgrade_park(int shard);
+
+int upgrade_inherit(int num_shards, struct snapshot **snaps);
+int upgrade_finish(void);
+
+#endif
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "uring.h"
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/* Return 1 if the running kernel is at least major.minor. Multishot recv
+ * cannot be probed for, so this is how it is detected.
+ */
+static int kernel_at_least(int major, int minor) {
+    struct utsname u;
+    int ma, mi;
+    if(uname(&u) < 0 || sscanf(u.release, "%d.%d", &ma, &mi) != 2) {
+        return 0;
+    }
+    return ma > major || (ma == major && mi >= minor);
+}
+
+
+/* Return 1 if every opcode the server uses is supported by this kernel.
+ */
+static int probe_opcodes(struct uring *r) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if(probe == NULL) {
+        return 0;
+    }
+    int ok = 0;
+    if(sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_WRITEV,
+                     IORING_OP_ASYNC_CANCEL};
+        ok = 1;
+        for(int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ok = 0;
+            }
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+
+/* Map the rings of the io_uring instance r->fd described by p.
+ */
+static int map_rings(struct uring *r, struct io_uring_params *p) {
+    r->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if(p->features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        return -1;
+    }
+    if(p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = r->sq_ring;
+    r->sq_head = (unsigned *)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    r->sq_entries = *(unsigned *)(sq + p->sq_off.ring_entries);
+    r->sq_array = (unsigned *)(sq + p->sq_off.array);
+    r->sqe_tail = *r->sq_tail;
+
+    char *cq = r->cq_ring;
+    r->cq_head = (unsigned *)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+
+/* Register num_bufs receive buffers of buf_size bytes as buffer group
+ * URING_BGID. num_bufs must be a power of two.
+ */
+static int setup_buffers(struct uring *r, unsigned num_bufs, unsigned buf_size) {
+    r->num_bufs = num_bufs;
+    r->buf_size = buf_size;
+    r->br_size = num_bufs * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(r->br == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+    r->bufs = malloc((size_t)num_bufs * buf_size);
+    if(r->bufs == NULL) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)r->br;
+    reg.ring_entries = num_bufs;
+    reg.bgid = URING_BGID;
+    if(sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+
+    r->br_tail = 0;
+    for(unsigned i = 0; i < num_bufs; i++) {
+        uring_recycle_buf(r, i);
+    }
+    return 0;
+}
+
+
+/* Set up a ring with room for entries submissions and num_bufs provided
+ * buffers of buf_size bytes.
+ * Return 0 on success and -1 (with errno set) if this kernel cannot run the
+ * io_uring backend; r is left closed in that case.
+ */
+int uring_init(struct uring *r, unsigned entries, unsigned num_bufs, unsigned buf_size) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    if(!kernel_at_least(6, 0)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    r->fd = sys_setup(entries, &p);
+    if(r->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        r->fd = sys_setup(entries, &p);
+    }
+    if(r->fd < 0) {
+        return -1;
+    }
+
+    int err = 0;
+    if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)
+       || !probe_opcodes(r)) {
+        err = EOPNOTSUPP;
+    } else if(map_rings(r, &p) < 0 || setup_buffers(r, num_bufs, buf_size) < 0) {
+        err = errno;
+    }
+    if(err) {
+        uring_exit(r);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+
+void uring_exit(struct uring *r) {
+    if(r->fd >= 0) {
+        close(r->fd);
+    }
+    if(r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if(r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if(r->sq_ring != NULL) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if(r->br != NULL) {
+        munmap(r->br, r->br_size);
+    }
+    free(r->bufs);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+
+/* Return a cleared submission queue entry. If the queue is full, what has
+ * been prepared so far is submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if(r->sqe_tail - head >= r->sq_entries) {
+        if(uring_submit(r, 0, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if(r->sqe_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned idx = r->sqe_tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+
+/* Hand every prepared entry to the kernel. If wait is set and no completion
+ * is pending, block until one arrives or timeout_ms passes (-1 waits
+ * forever). Return 0 on success and -1 on error.
+ */
+int uring_submit(struct uring *r, int wait, int timeout_ms) {
+    unsigned tail = *r->sq_tail;
+    unsigned to_submit = r->sqe_tail - tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = 0;
+    unsigned min_complete = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if(wait && uring_peek_cqe(r) == NULL) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+        if(timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+    if(to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+
+    while(1) {
+        int ret = sys_enter(r->fd, to_submit, min_complete, flags, argp, argsz);
+        if(ret >= 0) {
+            return 0;
+        }
+        if(errno == ETIME) {
+            return 0;
+        }
+        if(errno != EINTR) {
+            return -1;
+        }
+        // everything was submitted before the signal arrived
+        to_submit = 0;
+        if(min_complete == 0) {
+            return 0;
+        }
+    }
+}
+
+
+/* Return the oldest unseen completion, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+
+/* Release the completion returned by uring_peek_cqe.
+ */
+void uring_cqe_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+char *uring_buf(struct uring *r, int bid) {
+    return r->bufs + (size_t)bid * r->buf_size;
+}
+
+
+/* Give provided buffer bid back to the kernel.
+ */
+void uring_recycle_buf(struct uring *r, int bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (r->num_bufs - 1)];
+    b->addr = (uintptr_t)uring_buf(r, bid);
+    b->len = r->buf_size;
+    b->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+
+/* Accept connections on fd until cancelled; one completion per connection.
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+
+/* Receive from fd into provided buffers until the connection ends; one
+ * completion per chunk.
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = user_data;
+}
+
+
+/* Write n_iov buffers to fd. iov only has to stay valid until the entry is
+ * submitted.
+ */
+void uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov,
+                       int n_iov, uint64_t user_data) {
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = n_iov;
+    sqe->user_data = user_data;
+}
+
+
+/* Cancel every request still pending on fd.
+ */
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,65 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* A minimal io_uring wrapper built directly on the system calls, with one
+ * ring of provided receive buffers (buffer group URING_BGID). Submission
+ * queue entries are only handed to the kernel by uring_submit, so
+ * everything prepared while handling one batch of completions goes out in
+ * a single io_uring_enter.
+ */
+
+#define URING_BGID 0
+
+struct uring {
+    int fd;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;        // Entries handed out but not yet submitted end here
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // provided receive buffers
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    char *bufs;
+    unsigned num_bufs;
+    unsigned buf_size;
+    uint16_t br_tail;
+};
+
+int uring_init(struct uring *r, unsigned entries, unsigned num_bufs, unsigned buf_size);
+void uring_exit(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r, int wait, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+char *uring_buf(struct uring *r, int bid);
+void uring_recycle_buf(struct uring *r, int bid);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov,
+                       int n_iov, uint64_t user_data);
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+#endif
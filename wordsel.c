@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "wordsel.h"
+#include "gameplay.h"
+
+#define SCORE_STEPS 64            // Resolution of a letter's share of a score
+#define NUM_SCORES (NUM_LETTERS * SCORE_STEPS + 1)
+
+static const char *difficulty_names[NUM_DIFFICULTIES] = {"easy", "medium", "hard"};
+
+
+/* Sort the numbers of the n words by key[word], which is below num_keys,
+ * into out, and record in start[k] where the words with key k begin;
+ * start[num_keys] is n. A counting sort: one pass to count, one to place.
+ */
+static void sort_by_key(const uint16_t *key, uint32_t n, int num_keys,
+                        uint32_t *out, uint32_t *start) {
+    memset(start, 0, (num_keys + 1) * sizeof(uint32_t));
+    for(uint32_t i = 0; i < n; i++) {
+        start[key[i] + 1]++;
+    }
+    for(int k = 0; k < num_keys; k++) {
+        start[k + 1] += start[k];
+    }
+    uint32_t fill[num_keys];
+    memcpy(fill, start, num_keys * sizeof(uint32_t));
+    for(uint32_t i = 0; i < n; i++) {
+        out[fill[key[i]]++] = i;
+    }
+}
+
+
+/* Give every word of dict a difficulty. A word is easy when its distinct
+ * letters are ones that many words contain, since guesses then tend to hit:
+ * its score is the sum, over its distinct letters, of the share of words
+ * containing that letter. Longer words have more letters and so score
+ * higher, so the scores of each length are cut into thirds separately,
+ * from the highest (easy) to the lowest (hard).
+ */
+static int rate_words(const struct dictionary *dict, uint8_t *difficulty) {
+    uint32_t n = dict->size;
+    uint32_t containing[NUM_LETTERS] = {0};
+    uint32_t *letters = malloc(n * sizeof(uint32_t));
+    uint16_t *score = malloc(n * sizeof(uint16_t));
+    uint32_t *count = calloc(SEL_MAX_LEN * NUM_SCORES, sizeof(uint32_t));
+    if(letters == NULL || score == NULL || count == NULL) {
+        free(letters);
+        free(score);
+        free(count);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < n; i++) {
+        int len;
+        const char *w = dict_word(dict, i, &len);
+        uint32_t mask = 0;
+        for(int j = 0; j < len; j++) {
+            if(w[j] >= 'a' && w[j] <= 'z') {
+                mask |= LETTER_BIT(w[j]);
+            }
+        }
+        letters[i] = mask;
+        for(uint32_t m = mask; m != 0; m &= m - 1) {
+            containing[__builtin_ctz(m)]++;
+        }
+    }
+
+    uint32_t share[NUM_LETTERS];
+    for(int c = 0; c < NUM_LETTERS; c++) {
+        share[c] = (uint64_t)containing[c] * SCORE_STEPS / n;
+    }
+    for(uint32_t i = 0; i < n; i++) {
+        uint32_t s = 0;
+        for(uint32_t m = letters[i]; m != 0; m &= m - 1) {
+            s += share[__builtin_ctz(m)];
+        }
+        score[i] = s;
+        count[dict->words[i].len * NUM_SCORES + s]++;
+    }
+
+    // for each length, walk down from the highest score to find where each
+    // third ends
+    uint32_t cut[SEL_MAX_LEN][NUM_DIFFICULTIES];
+    for(int len = 0; len < SEL_MAX_LEN; len++) {
+        const uint32_t *c = count + len * NUM_SCORES;
+        uint32_t total = 0;
+        for(int s = 0; s < NUM_SCORES; s++) {
+            total += c[s];
+        }
+        uint32_t seen = 0;
+        int d = 0;
+        for(int s = NUM_SCORES - 1; s >= 0 && d < NUM_DIFFICULTIES - 1; s--) {
+            seen += c[s];
+            while(d < NUM_DIFFICULTIES - 1
+                  && seen >= (uint64_t)total * (d + 1) / NUM_DIFFICULTIES) {
+                cut[len][d++] = s;
+            }
+        }
+        while(d < NUM_DIFFICULTIES) {
+            cut[len][d++] = 0;
+        }
+    }
+    for(uint32_t i = 0; i < n; i++) {
+        const uint32_t *c = cut[dict->words[i].len];
+        int level = 0;
+        while(level < NUM_DIFFICULTIES - 1 && score[i] < c[level]) {
+            level++;
+        }
+        difficulty[i] = level;
+    }
+
+    free(letters);
+    free(score);
+    free(count);
+    return 0;
+}
+
+
+/* Build the length and difficulty indexes of dict, which must outlive idx.
+ * Return 0 on success and -1 on failure.
+ */
+int word_index_build(struct word_index *idx, const struct dictionary *dict) {
+    uint32_t n = dict->size;
+    memset(idx, 0, sizeof(*idx));
+    idx->dict = dict;
+    idx->by_length = malloc(n * sizeof(uint32_t));
+    idx->by_difficulty = malloc(n * sizeof(uint32_t));
+    uint8_t *difficulty = malloc(n);
+    uint16_t *key = malloc(n * sizeof(uint16_t));
+    uint32_t *start = malloc((NUM_DIFFICULTIES * SEL_MAX_LEN + 1) * sizeof(uint32_t));
+    if(idx->by_length == NULL || idx->by_difficulty == NULL || difficulty == NULL
+       || key == NULL || start == NULL || rate_words(dict, difficulty) < 0) {
+        perror("word_index_build");
+        free(difficulty);
+        free(key);
+        free(start);
+        word_index_free(idx);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < n; i++) {
+        key[i] = dict->words[i].len;
+    }
+    sort_by_key(key, n, SEL_MAX_LEN, idx->by_length, idx->length_start);
+
+    for(uint32_t i = 0; i < n; i++) {
+        key[i] = difficulty[i] * SEL_MAX_LEN + dict->words[i].len;
+    }
+    sort_by_key(key, n, NUM_DIFFICULTIES * SEL_MAX_LEN, idx->by_difficulty, start);
+    for(int d = 0; d < NUM_DIFFICULTIES; d++) {
+        memcpy(idx->difficulty_start[d], start + d * SEL_MAX_LEN,
+               (SEL_MAX_LEN + 1) * sizeof(uint32_t));
+    }
+
+    free(difficulty);
+    free(key);
+    free(start);
+    return 0;
+}
+
+
+void word_index_free(struct word_index *idx) {
+    free(idx->by_length);
+    free(idx->by_difficulty);
+    memset(idx, 0, sizeof(*idx));
+}
+
+
+/* Build the alias table that draws sel's words in proportion to their
+ * weights (Vose's method). Return 0 on success and -1 on failure.
+ */
+static int build_alias(struct selector *sel, const uint32_t *weights) {
+    uint32_t n = sel->count;
+    double total = 0;
+    for(uint32_t i = 0; i < n; i++) {
+        total += weights[sel->words[i]];
+    }
+    if(total <= 0) {
+        fprintf(stderr, "The words chosen all have a frequency weight of 0\n");
+        return -1;
+    }
+
+    double *p = malloc(n * sizeof(double));
+    uint32_t *small = malloc(n * sizeof(uint32_t));
+    uint32_t *large = malloc(n * sizeof(uint32_t));
+    sel->alias = malloc(n * sizeof(uint32_t));
+    sel->threshold = malloc(n * sizeof(uint32_t));
+    if(p == NULL || small == NULL || large == NULL || sel->alias == NULL
+       || sel->threshold == NULL) {
+        perror("malloc");
+        free(p);
+        free(small);
+        free(large);
+        return -1;
+    }
+
+    // scale so that the average slot holds exactly 1
+    uint32_t num_small = 0, num_large = 0;
+    for(uint32_t i = 0; i < n; i++) {
+        p[i] = weights[sel->words[i]] * (n / total);
+        if(p[i] < 1) {
+            small[num_small++] = i;
+        } else {
+            large[num_large++] = i;
+        }
+    }
+    // each small slot is topped up from a large one
+    while(num_small > 0 && num_large > 0) {
+        uint32_t s = small[--num_small];
+        uint32_t l = large[num_large - 1];
+        sel->threshold[s] = p[s] * 4294967296.0;
+        sel->alias[s] = l;
+        p[l] -= 1 - p[s];
+        if(p[l] < 1) {
+            num_large--;
+            small[num_small++] = l;
+        }
+    }
+    // what is left is full, give or take rounding
+    while(num_large > 0) {
+        uint32_t l = large[--num_large];
+        sel->threshold[l] = UINT32_MAX;
+        sel->alias[l] = l;
+    }
+    while(num_small > 0) {
+        uint32_t s = small[--num_small];
+        sel->threshold[s] = UINT32_MAX;
+        sel->alias[s] = s;
+    }
+
+    free(p);
+    free(small);
+    free(large);
+    return 0;
+}
+
+
+/* Resolve policy against idx. Return 0 on success and -1, after saying
+ * why, if no word fits the policy or the table cannot be built.
+ */
+int selector_init(struct selector *sel, const struct word_index *idx,
+                  const struct select_policy *policy) {
+    memset(sel, 0, sizeof(*sel));
+    sel->index = idx;
+
+    int lo = policy->min_len > 0 ? policy->min_len : 0;
+    int hi = policy->max_len > 0 && policy->max_len < SEL_MAX_LEN ? policy->max_len
+                                                                  : SEL_MAX_LEN - 1;
+    if(lo > hi) {
+        lo = hi + 1;
+    }
+    const uint32_t *start = policy->difficulty == DIFF_ANY ? idx->length_start
+                                                           : idx->difficulty_start[policy->difficulty];
+    const uint32_t *words = policy->difficulty == DIFF_ANY ? idx->by_length
+                                                           : idx->by_difficulty;
+    sel->words = words + start[lo];
+    sel->count = start[hi + 1] - start[lo];
+    if(sel->count == 0) {
+        fprintf(stderr, "No words of %d to %d letters at difficulty %s\n",
+                policy->min_len, policy->max_len > 0 ? policy->max_len : SEL_MAX_LEN - 1,
+                difficulty_name(policy->difficulty));
+        return -1;
+    }
+
+    if(policy->weighted) {
+        if(idx->dict->weights == NULL) {
+            fprintf(stderr, "The dictionary has no frequency weights\n");
+            return -1;
+        }
+        if(build_alias(sel, idx->dict->weights) < 0) {
+            selector_free(sel);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void selector_free(struct selector *sel) {
+    free(sel->alias);
+    free(sel->threshold);
+    memset(sel, 0, sizeof(*sel));
+}
+
+
+void rotation_init(struct rotation *rot) {
+    rot->key = 0;
+    rot->next = UINT32_MAX;
+    rot->last = UINT32_MAX;
+    rot->swapped = 0;
+}
+
+
+/* The round function of the permutation below.
+ */
+static uint32_t feistel_round(uint32_t half, uint64_t key, int round) {
+    uint64_t z = key + (uint64_t)half * 0x9e3779b97f4a7c15ULL + round;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+/* Return where i lands in the permutation of 0 .. n-1 chosen by key. A
+ * four-round Feistel network shuffles the smallest even number of bits
+ * that holds n, and results of n or more are fed through again until one
+ * is in range, which takes fewer than four tries on average.
+ */
+static uint32_t permute(uint32_t n, uint64_t key, uint32_t i) {
+    int bits = 2;
+    while(bits < 32 && (1ULL << bits) < n) {
+        bits += 2;
+    }
+    int half = bits / 2;
+    uint32_t mask = (1u << half) - 1;
+    do {
+        uint32_t left = i >> half;
+        uint32_t right = i & mask;
+        for(int round = 0; round < 4; round++) {
+            uint32_t t = left ^ (feistel_round(right, key, round) & mask);
+            left = right;
+            right = t;
+        }
+        i = (left << half) | right;
+    } while(i >= n);
+    return i;
+}
+
+
+/* Return the number of the word for a new game. With an alias table the
+ * word is drawn by weight; otherwise it is the next in the game's rotation,
+ * which starts a new order once all the words have been used. Either way
+ * the last word is not picked twice in a row when there is a choice: a
+ * new order that would start with it plays its first two words the other
+ * way round, so that every word is still played once a round.
+ */
+uint32_t selector_pick(const struct selector *sel, struct rotation *rot, uint64_t *rng) {
+    uint32_t word = 0;
+    if(sel->alias != NULL) {
+        // a few tries; one word may carry nearly all the weight
+        for(int tries = 0; tries < 4; tries++) {
+            uint32_t slot = random_below(rng, sel->count);
+            uint32_t u = next_random(rng) >> 32;
+            word = sel->words[u < sel->threshold[slot] ? slot : sel->alias[slot]];
+            if(word != rot->last) {
+                break;
+            }
+        }
+    }
+    else {
+        if(rot->next >= sel->count) {
+            rot->key = next_random(rng);
+            rot->next = 0;
+            rot->swapped = sel->count > 1
+                           && sel->words[permute(sel->count, rot->key, 0)] == rot->last;
+        }
+        uint32_t pos = rot->swapped && rot->next < 2 ? 1 - rot->next : rot->next;
+        rot->next++;
+        word = sel->words[permute(sel->count, rot->key, pos)];
+    }
+    rot->last = word;
+    return word;
+}
+
+
+const char *difficulty_name(int difficulty) {
+    if(difficulty < 0 || difficulty >= NUM_DIFFICULTIES) {
+        return "any";
+    }
+    return difficulty_names[difficulty];
+}
+
+
+/* Return the difficulty called name, DIFF_ANY for "any", or -2 if there is
+ * no such difficulty.
+ */
+int parse_difficulty(const char *name) {
+    if(strcasecmp(name, "any") == 0) {
+        return DIFF_ANY;
+    }
+    for(int d = 0; d < NUM_DIFFICULTIES; d++) {
+        if(strcasecmp(name, difficulty_names[d]) == 0) {
+            return d;
+        }
+    }
+    return -2;
+}
@@ -0,0 +1,77 @@
+#ifndef _WORDSEL_H_
+#define _WORDSEL_H_
+
+#include <stdint.h>
+
+#include "dict.h"
+
+/* Word selection. A word_index is built once when the dictionary is
+ * loaded: the words sorted by length, and sorted by difficulty and then
+ * length, so that the words of any length range, with or without a
+ * difficulty, are one contiguous run. A selector resolves a policy to such
+ * a run once; picking from it is then constant time however large the
+ * dictionary is.
+ *
+ * By default a game rotates through the run in an order of its own that
+ * does not repeat a word until every word has been used. The order is a
+ * keyed permutation computed on the fly, so it needs no memory per game.
+ * With frequency weights, words are instead drawn by weight through an
+ * alias table, though never the same word twice in a row.
+ */
+
+#define SEL_MAX_LEN 32            // Above the length of any word
+#define NUM_DIFFICULTIES 3
+
+enum difficulty {
+    DIFF_ANY = -1,
+    DIFF_EASY,
+    DIFF_MEDIUM,
+    DIFF_HARD,
+};
+
+/* What kind of word a game wants. */
+struct select_policy {
+    int min_len;                  // Fewest letters, or 0
+    int max_len;                  // Most letters, or 0 for no limit
+    int difficulty;               // DIFF_ANY or one of enum difficulty
+    int weighted;                 // Draw by frequency weight
+};
+
+struct word_index {
+    const struct dictionary *dict;
+    uint32_t *by_length;          // Word numbers by length
+    uint32_t *by_difficulty;      // Word numbers by difficulty, then length
+    // by_length[length_start[l]] is the first word with l letters
+    uint32_t length_start[SEL_MAX_LEN + 1];
+    uint32_t difficulty_start[NUM_DIFFICULTIES][SEL_MAX_LEN + 1];
+};
+
+struct selector {
+    const struct word_index *index;
+    const uint32_t *words;        // The candidates: a run of an index array
+    uint32_t count;
+    uint32_t *alias;              // Weighted only: Vose alias table
+    uint32_t *threshold;          // Keep slot i if a random u32 is below this
+};
+
+/* Where one game is in its rotation through a selector's words. */
+struct rotation {
+    uint64_t key;                 // Chooses the permutation
+    uint32_t next;                // Position in it
+    uint32_t last;                // Word picked last, so a new round does not
+                                  // start with it
+    uint32_t swapped;             // 1 if this round plays its first two
+                                  // positions the other way round
+};
+
+int word_index_build(struct word_index *idx, const struct dictionary *dict);
+void word_index_free(struct word_index *idx);
+int selector_init(struct selector *sel, const struct word_index *idx,
+                  const struct select_policy *policy);
+void selector_free(struct selector *sel);
+void rotation_init(struct rotation *rot);
+uint32_t selector_pick(const struct selector *sel, struct rotation *rot, uint64_t *rng);
+const char *difficulty_name(int difficulty);
+int parse_difficulty(const char *name);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE         /* pthread_setaffinity_np */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -13,16 +14,63 @@
 
 #include "socket.h"
 #include "gameplay.h"
+#include "event.h"
+#include "outq.h"
+#include "clock.h"
+#include "uring.h"
+#include "pool.h"
+#include "metrics.h"
+#include "log.h"
+#include "proto.h"
+#include "render.h"
+#include "input.h"
+#include "scores.h"
+#include "lexicon.h"
+#include "upgrade.h"
+#include "spsc.h"
+#include "router.h"
+#include "replay.h"
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <poll.h>
 
 
 #ifndef PORT
     #define PORT 58474
 #endif
-#define MAX_QUEUE 5
+#define MAX_QUEUE 1024
+#define ACCEPT_BATCH 1024
+#define MAX_EVENTS 256
+#define SWEEP_INTERVAL_MS 1000
+#define TIMER_TICK_MS 10
+#define BOT_THINK_MS 1000      // How long a bot takes over its guess
+
+// io_uring backend: size of the submission queue, the provided receive
+// buffers, and the iovec space for writes prepared between submissions
+#define URING_ENTRIES 4096
+#define URING_NUM_BUFS 1024
+#define URING_BUF_SIZE 2048
+#define URING_IOV_POOL 8192
+
+/* Every io_uring request carries its kind in the low bits of user_data and,
+ * for client requests, the struct client in the rest.
+ */
+#define UD_ACCEPT 1
+#define UD_RECV 2
+#define UD_SEND 3
+#define UD_CANCEL 4
+#define UD_WAKE 5
+#define UD_KIND(ud) ((ud) & 7)
+#define UD_CLIENT(ud) ((struct client *)(uintptr_t)((ud) & ~7ULL))
 
 
-void add_player(struct client **top, int fd, struct in_addr addr);
+struct client *add_player(struct client **top, int fd, struct in_addr addr);
 void remove_player(struct client **top, int fd);
 
 /* These are some of the function prototypes that we used in our solution 
@@ -31,37 +79,444 @@ void remove_player(struct client **top, int fd);
  */
 
 void help_disconnect(struct client *p, struct game_state *game);
-
-/* The set of socket descriptors for select to monitor.
+void handle_line(struct client *p, struct game_state *game, struct client **new_players);
+void idle_expired(struct timer *t);
+void announce_turn_all(struct game_state *game);
+void drop_client(struct client *p);
+void uring_send(struct client *p);
+void uring_arm_recv(struct client *p);
+void take_deliveries(void);
+int replay_evicts(int fd, int reason);
+void bot_move(struct timer *t);
+
+/* The event loop watching the socket descriptors.
  * This is a global variable because we need to remove socket descriptors
- * from allset when a write to a socket fails.
+ * from the loop when a write to a socket fails. Each shard thread runs its
+ * own loop, so it is thread-local.
+ */
+__thread struct event_loop *loop;
+
+/* The io_uring of this shard, or NULL when it uses ev_wait. Writes prepared
+ * since the last submission keep their iovecs in iov_pool.
+ */
+__thread struct uring *ring;
+__thread struct iovec *iov_pool;
+__thread int iov_used;
+
+/* Clients indexed by socket descriptor, so that a ready descriptor is
+ * mapped to its owner without searching the client lists. The table grows
+ * to fit the largest descriptor seen.
+ */
+__thread struct client **fd_table;
+__thread int fd_table_len;
+
+/* Slots for this shard's clients. The pool starts with client_slots slots
+ * and grows by as many again whenever it runs out. Set once in main.
+ */
+__thread struct pool client_pool;
+int client_slots = 1024;
+
+/* Length of the kernel's queue of connections waiting to be accepted. Set
+ * once in main; the kernel caps it at net.core.somaxconn.
+ */
+int listen_backlog = MAX_QUEUE;
+
+/* How long a player may take to guess before the turn passes on, how long
+ * a new client may take to give a name, and how long a player may stay
+ * silent before being disconnected. 0 turns a limit off. Set once in main.
+ */
+long long turn_timeout_ms = 60000;
+long long handshake_timeout_ms = 30000;
+long long idle_timeout_ms = 600000;
+
+/* Bot players put in every game, and the chance, in percent, that a bot
+ * guesses the letter most of the words that fit the board contain rather
+ * than any letter left. Set once in main.
+ */
+int num_bots;
+int bot_skill = 50;
+
+/* Turn, handshake and idle deadlines of this shard's clients.
+ */
+__thread struct timer_wheel timers;
+
+/* The game this thread's bots play in.
+ */
+__thread struct game_state *bots_game;
+
+/* A descriptor held back so that, when the process runs out, there is one
+ * to free for accepting and closing a waiting connection. Otherwise such a
+ * connection sits in the queue and keeps the listener ready forever.
+ */
+__thread int reserve_fd = -1;
+
+/* This shard's counters and histograms, read by the stats thread.
+ */
+__thread struct metrics *stats;
+
+/* This shard's number, which is also its hazard slot in lexicon.c, and the
+ * generation of the word list its game last picked from.
+ */
+__thread int shard_id;
+__thread unsigned lexicon_generation;
+
+/* Set while this shard is stopping for an upgrade. With io_uring it waits
+ * for its requests to end first, and accept_armed tells whether the
+ * listener still has one.
+ */
+__thread int freezing;
+__thread int accept_armed;
+
+/* One reactor thread. Every shard accepts on its own SO_REUSEPORT listener
+ * and owns its game and client lists; the only thing shards share is the
+ * word list, which is read-only and replaced as a whole on SIGHUP.
+ */
+struct shard {
+    int id;
+    pthread_t thread;
+    int cpu;                  // CPU to pin the thread to, or -1
+    enum ev_backend backend;
+    int listenfd;
+    uint64_t seed;
+    struct metrics *metrics;
+    struct snapshot *restore; // State handed over by an upgrade, or NULL
+};
+
+/* Pipeline mode (-i): one game for everybody on a thread of its own, with
+ * the sockets spread over I/O threads. An I/O thread accepts clients,
+ * reads and frames their input and writes their output; the game thread
+ * only plays. Each I/O thread has two bounded SPSC queues with the game
+ * thread: commands (a client arrived, sent a line, or is gone) go to the
+ * game, and deliveries (a message to queue, a deadline to restart, a
+ * client to disconnect or to free) come back. A client belongs to its I/O
+ * thread, which frees it only once the game has let go of it.
+ */
+#define PIPE_COMMANDS 4096
+#define PIPE_DELIVERIES 65536
+#define PIPE_BATCH 256        // Commands taken from one queue at a time
+
+enum command_kind {
+    CMD_JOIN,                 // A new client, not yet named
+    CMD_LINE,                 // A line, or the payload of a binary frame
+    CMD_GONE,                 // The client is disconnecting
+};
+
+struct command {
+    int kind;                 // One of enum command_kind
+    int op;                   // Opcode of a binary frame
+    struct client *client;
+    char line[MAX_LINE + 1];
+};
+
+enum delivery_kind {
+    OUT_MSG,                  // Queue msg for the client; the reference passes on
+    OUT_TOUCH,                // Restart the client's idle deadline
+    OUT_CLOSE,                // Disconnect the client
+    OUT_RELEASE,              // The game is done with the client; free it
+};
+
+struct delivery {
+    int kind;                 // One of enum delivery_kind
+    struct client *client;
+    struct msgbuf *msg;
+};
+
+/* Wakes a thread that sleeps when its queues are empty. It sets asleep
+ * before looking at them one last time, and whoever pushes something after
+ * that writes to fd, an eventfd it waits on.
+ */
+struct bell {
+    int fd;
+    int asleep;
+};
+
+struct io_thread {
+    int id;
+    pthread_t thread;
+    int cpu;                  // CPU to pin the thread to, or -1
+    enum ev_backend backend;
+    int listenfd;
+    struct metrics *metrics;
+    struct spsc commands;     // To the game thread
+    struct spsc deliveries;   // From the game thread
+    struct bell bell;
+    // game thread: deliveries pushed since the bell was last rung
+    int owed __attribute__((aligned(64)));
+};
+
+/* With -R, every thread that accepts clients also takes them from
+ * wgg-router over a socket of its own, and tells it how many clients it
+ * holds; see router.h. A thread that lost the router tries again with
+ * every report.
+ */
+const char *router_path;
+__thread int routerfd = -1;
+__thread int reported = -1;   // Clients last reported to the router
+__thread int num_sockets;     // Clients of this thread with a socket, so
+                              // not counting bots
+__thread struct timer report_timer;
+
+/* With -r the shard records what drives it, and with -y it plays such a
+ * recording back instead of using sockets, as fast as it can or, with -Y,
+ * at the pace it was recorded; see replay.h. Output in a replay goes into
+ * replay_digest instead of a socket. Set once in main.
+ */
+int recording;
+int replaying;
+int replay_realtime;
+struct rec_reader replay;
+uint64_t replay_digest = 0xcbf29ce484222325ULL;
+unsigned long long replay_bytes_out;
+unsigned long long replay_evictions;
+int stopfd = -1;              // Delivers SIGINT and SIGTERM while recording
+
+struct io_thread *io_threads;
+int num_io_threads;           // 0 unless in pipeline mode
+struct bell game_bell;
+
+/* Set on the game thread of pipeline mode, and on an I/O thread to the
+ * thread itself, which also counts the commands it pushed since it last
+ * rang the game's bell.
+ */
+__thread int on_game_thread;
+__thread struct io_thread *io_self;
+__thread int commands_owed;
+
+/* A client whose unsent output grows past max_backlog_bytes, or whose
+ * output makes no progress for max_backlog_ms, is disconnected so that it
+ * cannot hold up the other players. Set once in main.
+ */
+size_t max_backlog_bytes = 64 * 1024;
+long long max_backlog_ms = 10000;
+
+/* Clients marked by drop_client that still have to be disconnected, and
+ * the number of clients waiting for their socket to become writable.
+ */
+__thread struct client **closing;
+__thread int closing_len;
+__thread int closing_cap;
+__thread int num_backlogged;
+
+/* Clients with output queued since the last flush. Output is written once
+ * per loop iteration, so everything a client is sent while handling one
+ * batch of events goes out in a single writev.
+ */
+__thread struct client **dirty;
+__thread int dirty_len;
+__thread int dirty_cap;
+
+
+/* Wake the thread b belongs to if it is asleep. Call after pushing onto
+ * one of its queues.
+ */
+void bell_ring(struct bell *b) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&b->asleep, __ATOMIC_SEQ_CST)
+       && __atomic_exchange_n(&b->asleep, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if(write(b->fd, &one, sizeof(one)) < 0) {
+            perror("write eventfd");
+        }
+    }
+}
+
+
+/* Get ready to sleep on b. The queues have to be looked at once more
+ * afterwards, since anything pushed before this did not ring.
+ */
+void bell_arm(struct bell *b) {
+    __atomic_store_n(&b->asleep, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Done sleeping on b; take back a ring that may have come.
+ */
+void bell_disarm(struct bell *b, int rung) {
+    __atomic_store_n(&b->asleep, 0, __ATOMIC_SEQ_CST);
+    if(rung) {
+        uint64_t n;
+        if(read(b->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+            perror("read eventfd");
+        }
+    }
+}
+
+
+/* Game thread: pass kind, and for OUT_MSG the reference to m, to the I/O
+ * thread that owns p. If its queue is full, wait until it makes room; it
+ * takes deliveries even while it waits for room for its own commands.
+ * Return 0.
+ */
+int deliver(struct client *p, int kind, struct msgbuf *m) {
+    struct io_thread *t = &io_threads[p->io_id];
+    struct delivery *d;
+    while((d = spsc_slot(&t->deliveries)) == NULL) {
+        bell_ring(&t->bell);
+        sched_yield();
+    }
+    d->kind = kind;
+    d->client = p;
+    d->msg = m;
+    spsc_push(&t->deliveries);
+    t->owed = 1;
+    return 0;
+}
+
+
+/* Record p as the owner of its socket descriptor.
+ */
+void set_fd_owner(int fd, struct client *p) {
+    if(fd >= fd_table_len) {
+        int len = fd_table_len ? fd_table_len : 64;
+        while(len <= fd) {
+            len *= 2;
+        }
+        struct client **t = realloc(fd_table, len * sizeof(struct client *));
+        if(t == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(t + fd_table_len, 0, (len - fd_table_len) * sizeof(struct client *));
+        fd_table = t;
+        fd_table_len = len;
+    }
+    fd_table[fd] = p;
+}
+
+
+/* Publish how full this thread's client pool is in its metrics.
  */
-fd_set allset;
+void publish_pool(void) {
+    metric_set(stats, G_CLIENT_SLOTS_IN_USE, client_pool.in_use);
+    metric_set(stats, G_CLIENT_SLOTS_HIGH_WATER, client_pool.high_water);
+    metric_set(stats, G_CLIENT_SLOTS, client_pool.capacity);
+}
 
 
-/* Add a client to the head of the linked list
+/* Add a client to the head of the linked list and return it
  */
-void add_player(struct client **top, int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
+struct client *add_player(struct client **top, int fd, struct in_addr addr) {
+    int capacity = client_pool.capacity;
+    struct client *p = pool_alloc(&client_pool);
 
     if (!p) {
-        perror("malloc");
+        perror("pool_alloc");
         exit(1);
     }
+    publish_pool();
+    if(client_pool.capacity != capacity) {
+        LOG(LOG_INFO, "Client pool grew to %d slots (%d in use, high water %d)\n",
+               client_pool.capacity, client_pool.in_use, client_pool.high_water);
+    }
 
-    printf("Adding client %s\n", inet_ntoa(addr));
+    LOG(LOG_DEBUG, "Adding client %s\n", inet_ntoa(addr));
 
     p->fd = fd;
     p->ipaddr = addr;
+    p->in_game = 0;
+    p->bot = 0;
+    p->mode = MODE_UNKNOWN;
+    p->op = 0;
+    p->closing = 0;
+    p->dirty = 0;
+    p->want_write = 0;
+    p->inflight = 0;
+    p->sending = 0;
+    p->zombie = 0;
     p->name[0] = '\0';
-    p->in_ptr = p->inbuf;
-    p->inbuf[0] = '\0';
+    p->in_start = 0;
+    p->in_end = 0;
+    p->skipping = 0;
+    p->line = NULL;
+    p->prompted_ns = 0;
+    memset(&p->played, 0, sizeof(p->played));
+    p->io_id = io_self != NULL ? io_self->id : 0;
+    outq_init(&p->out);
+    timer_init(&p->idle, idle_expired);
+    if(handshake_timeout_ms > 0) {
+        timer_add(&timers, &p->idle, now_ms() + handshake_timeout_ms);
+    }
+    p->next = *top;
+    *top = p;
+    set_fd_owner(fd, p);
+    num_sockets++;
+    return p;
+}
+
+
+/* Add a bot player to the head of the linked list and return it. A bot
+ * has no socket; its idle timer is the time it takes over a guess.
+ */
+struct client *add_bot(struct client **top) {
+    struct client *p = pool_alloc(&client_pool);
+    if (!p) {
+        perror("pool_alloc");
+        exit(1);
+    }
+    publish_pool();
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    p->bot = 1;
+    p->in_game = 1;
+    p->mode = MODE_TEXT;
+    outq_init(&p->out);
+    timer_init(&p->idle, bot_move);
     p->next = *top;
     *top = p;
+    return p;
+}
+
+/* Close p's socket and free it. With io_uring, requests still pending for
+ * p point at it, so they are cancelled and p is freed by the completion of
+ * the last one.
+ */
+void release_client(struct client *p) {
+    if(ring != NULL && p->inflight > 0) {
+        p->zombie = 1;
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if(sqe != NULL) {
+            uring_prep_cancel_fd(sqe, p->fd, UD_CANCEL);
+        }
+        else {
+            // pending requests still end once the connection is shut down
+            shutdown(p->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    // a client handed back by the game thread is no longer watched, and
+    // a replayed one never had a socket
+    if(ring == NULL && !p->zombie && !replaying) {
+        ev_del(loop, p->fd);
+    }
+    if(!replaying) {
+        close(p->fd);
+    }
+    outq_free(&p->out);
+    pool_free(&client_pool, p);
+    publish_pool();
+    num_sockets--;
+}
+
+/* Forget p in this thread's tables: its socket's owner, its idle
+ * deadline, and its places among the backlogged and dirty clients.
+ */
+void forget_client(struct client *p) {
+    fd_table[p->fd] = NULL;
+    timer_cancel(&timers, &p->idle);
+    if(p->want_write) {
+        num_backlogged--;
+    }
+    if(p->dirty) {
+        // fill the hole with the last entry
+        dirty[p->dirty_idx] = dirty[--dirty_len];
+        dirty[p->dirty_idx]->dirty_idx = p->dirty_idx;
+    }
 }
 
+
 /* Removes client from the linked list and closes its socket.
- * Also removes socket descriptor from allset 
+ * Also removes socket descriptor from the event loop. On the game thread
+ * of pipeline mode, the client's I/O thread is told to do the closing.
  */
 void remove_player(struct client **top, int fd) {
     struct client **p;
@@ -72,10 +527,15 @@ void remove_player(struct client **top, int fd) {
     // This avoids a special case for removing the head of the list
     if (*p) {
         struct client *t = (*p)->next;
-        printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        FD_CLR((*p)->fd, &allset);
-        close((*p)->fd);
-        free(*p);
+        LOG(LOG_INFO, "Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
+        metric_add(stats, M_REMOVED, 1);
+        if(on_game_thread) {
+            deliver(*p, OUT_RELEASE, NULL);
+        }
+        else {
+            forget_client(*p);
+            release_client(*p);
+        }
         *p = t;
     } else {
         fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
@@ -84,292 +544,838 @@ void remove_player(struct client **top, int fd) {
 }
 
 
-/* Move the has_next_turn pointer to the next active client */
-void advance_turn(struct game_state *game){
-    if(game->has_next_turn->next != NULL){
-        game->has_next_turn = game->has_next_turn->next;
+/* Mark p to be disconnected once the current event has been handled.
+ * Removing p right away could pull it out of a list the caller is walking.
+ */
+void drop_client(struct client *p) {
+    if(on_game_thread) {
+        deliver(p, OUT_CLOSE, NULL);
+        return;
     }
-    else{
-        game->has_next_turn = game->head;
+    if(p->closing) {
+        return;
+    }
+    p->closing = 1;
+    if(closing_len == closing_cap) {
+        closing_cap = closing_cap ? closing_cap * 2 : 16;
+        closing = realloc(closing, closing_cap * sizeof(struct client *));
+        if(closing == NULL) {
+            perror("realloc");
+            exit(1);
+        }
     }
+    closing[closing_len++] = p;
 }
 
 
-/* Ask client whose turn it is for guess
+/* Disconnect every client marked by drop_client. Saying goodbye to a player
+ * may mark more clients, and those are handled in the same pass.
  */
-void prompt_for_guess(struct game_state *game){
-    // prompt client whose turn it is to type guess
-    if(game->has_next_turn != NULL){
-        char msg[MAX_BUF] = "Your guess?\n";
-        int len1 = strlen(msg);
-        msg[len1] = '\r'; 
-        if (write(game->has_next_turn->fd, msg, len1 + 1) != len1 + 1) {
-            // there is a problem with socket
-             help_disconnect(game->has_next_turn, game);
-       }
+void reap_clients(struct game_state *game, struct client **new_players) {
+    for(int i = 0; i < closing_len; i++) {
+        struct client *p = closing[i];
+        if(p->in_game) {
+            help_disconnect(p, game);
+        }
+        else {
+            remove_player(new_players, p->fd);
+        }
     }
+    closing_len = 0;
 }
 
 
-/* Broadcast message to all the active clients. 
- * Outbuf must have a null terminating character
+/* Return a new shared message holding len bytes of data.
  */
-void broadcast(struct game_state *game, char *outbuf){
-    int len = strlen(outbuf);
-    outbuf[len] = '\r';
-    outbuf[len + 1] = '\n';
-
-    for(struct client *p = game->head; p != NULL;) {        
-        struct client *next = p->next;
-        if (write(p->fd, outbuf, len + 2) != len + 2) {
-            // socket is invalid
-            help_disconnect(p, game);
-        }
-        p = next;
-    }       
+struct msgbuf *make_msg(const char *data, int len) {
+    struct msgbuf *m = msgbuf_new(data, len);
+    if(m == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return m;
 }
 
 
-/* Announce whose turn it is to client p. */
-void announce_turn(struct game_state *game, struct client *p){
-    // get the status message for the current state of the game
-    if(game->has_next_turn != NULL && p != NULL){
-        // there is a current player, so announce turn
-        char game_info[MAX_MSG];
-        status_message(game_info, game);
-        int info_len = strlen(game_info);
-        game_info[info_len] = '\r';
-        game_info[info_len + 1] = '\n';
-
-        if (write(p->fd, game_info, info_len + 2) != info_len + 2) {
-             // socket is invalid
-            help_disconnect(p, game);
+/* Remember that p has output to flush at the end of this loop iteration.
+ * Drop p instead if its backlog is over max_backlog_bytes.
+ * Return 0 on success and -1 if p has been dropped.
+ */
+int mark_dirty(struct client *p) {
+    // in a replay, output never backs up, so the recording says
+    if(replaying ? replay_evicts(p->fd, EVICT_BACKLOG) >= 0
+                 : p->out.len > max_backlog_bytes) {
+        LOG(LOG_WARN, "Evicting client %d: more than %zu bytes of output pending\n",
+               p->fd, max_backlog_bytes);
+        if(recording) {
+            rec_evict(p->fd, EVICT_BACKLOG);
         }
-
-        // annouce turn to all the players
-        char all_msg[MAX_BUF];
-        char p1[] = "It's ";
-        int len0 = strlen(p1);
-        strcpy(all_msg, p1);
-
-        int len1 = strlen(game->has_next_turn->name);
-        strcat(all_msg, game->has_next_turn->name);
-
-        char p3[] = "'s turn.";
-        int len2 = strlen(p3);
-        strcat(all_msg, p3);
-        int total = len0 + len1 + len2;
-        all_msg[total] = '\r';
-        all_msg[total + 1] = '\n';
-        
-        if(p != game->has_next_turn){                 
-            if (write(p->fd, all_msg, total + 2) != total + 2) {
-                // socket is invalid
-                help_disconnect(p, game);
+        drop_client(p);
+        return -1;
+    }
+    if(!p->dirty) {
+        if(dirty_len == dirty_cap) {
+            dirty_cap = dirty_cap ? dirty_cap * 2 : 64;
+            dirty = realloc(dirty, dirty_cap * sizeof(struct client *));
+            if(dirty == NULL) {
+                perror("realloc");
+                exit(1);
             }
         }
+        p->dirty = 1;
+        p->dirty_idx = dirty_len;
+        dirty[dirty_len++] = p;
     }
+    return 0;
 }
 
 
-/* Announce the winner of the game */
-int announce_winner(struct game_state *game){
-    if(game->head != NULL){
-        if(game->guesses_left == 0){
-            // inform players that game is over
-            char all_msg[MAX_BUF];
-        
-            char no_more_text[] = "Game over! No more guesses left. The word was ";
-            int len0 = strlen(no_more_text);
-            strcpy(all_msg, no_more_text);
+/* Queue a copy of len bytes of buf for client p. Nothing is written until
+ * flush_dirty runs at the end of the loop iteration.
+ * Return 0 on success and -1 if p has been dropped.
+ */
+int send_to(struct client *p, const char *buf, int len) {
+    if(p->bot) {
+        // a bot goes by the game itself, not by what it is told
+        return 0;
+    }
+    if(on_game_thread) {
+        return deliver(p, OUT_MSG, make_msg(buf, len));
+    }
+    if(p->closing) {
+        return -1;
+    }
+    if(outq_write(&p->out, buf, len) < 0) {
+        perror("outq_write");
+        drop_client(p);
+        return -1;
+    }
+    return mark_dirty(p);
+}
 
-            int len1 = strlen(game->word);
-            strcat(all_msg, game->word);
 
-            all_msg[len0 + len1] = '\0';
+/* Queue frame f for client p.
+ * Return 0 on success and -1 if p has been dropped.
+ */
+int send_frame(struct client *p, struct frame *f) {
+    return send_to(p, (char *)f->data, f->len);
+}
 
-            printf("%s\n", all_msg);
 
-            broadcast(game, all_msg);
+/* Tell p that something went wrong: with the NUL-terminated text, or in
+ * binary mode with an OP_ERROR frame carrying code.
+ * Return 0 on success and -1 if p has been dropped.
+ */
+int send_error(struct client *p, const char *text, int code) {
+    if(p->mode == MODE_BINARY) {
+        struct frame f;
+        frame_begin(&f, OP_ERROR);
+        frame_u8(&f, code);
+        return send_frame(p, &f);
+    }
+    return send_to(p, text, strlen(text));
+}
 
-            return 1;                                        
-        }
-        else if(strcmp(game->word, game->guess) == 0){
-            printf("Game over! %s won.\n", game->has_next_turn->name);
 
-            // client won
-            // inform players that game is over
-            char all_msg[MAX_BUF];
- 
-            char game_over[] = "Game over! ";
-            int len = strlen(game_over);
-            strcpy(all_msg, game_over);
+/* Queue the shared message m for client p.
+ * Return 0 on success and -1 if p has been dropped.
+ */
+int send_msg(struct client *p, struct msgbuf *m) {
+    if(p->bot) {
+        return 0;
+    }
+    if(on_game_thread) {
+        msgbuf_get(m);
+        return deliver(p, OUT_MSG, m);
+    }
+    if(p->closing) {
+        return -1;
+    }
+    if(outq_push(&p->out, m) < 0) {
+        perror("outq_push");
+        drop_client(p);
+        return -1;
+    }
+    return mark_dirty(p);
+}
 
-            int len0 = strlen(game->has_next_turn->name);
-            strcat(all_msg, game->has_next_turn->name);
 
-            char won[] = " won.\r\n \r\n";
-            int len1 = strlen(won);
-            strcat(all_msg, won);
+/* Replay: if the next event is the eviction of fd, or of any client if fd
+ * is -1, for reason, take it and return the client's descriptor. Return -1
+ * otherwise.
+ */
+int replay_evicts(int fd, int reason) {
+    struct rec_reader next = replay;
+    struct rec_event e;
+    if(rec_next(&next, &e) != 1 || e.type != REC_EVICT || e.reason != reason
+       || (fd >= 0 && e.fd != fd)) {
+        return -1;
+    }
+    replay = next;
+    replay_evictions++;
+    return e.fd;
+}
 
-            int total = len + len0 + len1;
-          
-            for(struct client *p = game->head; p != NULL;) {
-                struct client *next = p->next;
-                // send message to all the clients except the winner
-                if(p != game->has_next_turn){
-                    if (write(p->fd, all_msg, total) != total) {
-                        // socket is invalid
-                        help_disconnect(p, game);
-                    }
-                } 
-                p = next;   
-            }       
 
-            // inform the winner
-            char win_message[MAX_BUF];
-            strcpy(win_message, game_over);
-            strcat(win_message, "You won.\r\n \r\n");
-            total = len + strlen("You won.\r\n \r\n");
-        
-            if (write(game->has_next_turn->fd, win_message, total) != total) {
-                // socket is invalid
-                help_disconnect(game->has_next_turn, game);
-            }            
-            return 1;       
+/* Replay: take p's queued output as if it had all been written, adding it
+ * to replay_digest.
+ */
+void replay_output(struct client *p) {
+    struct iovec iov[OUTQ_MAX_IOV];
+    while(p->out.len > 0) {
+        int n = outq_iov(&p->out, iov, OUTQ_MAX_IOV);
+        size_t total = 0;
+        for(int i = 0; i < n; i++) {
+            // FNV-1a over the client's descriptor and its output
+            replay_digest = (replay_digest ^ (uint32_t)p->fd) * 0x100000001b3ULL;
+            const unsigned char *b = iov[i].iov_base;
+            for(size_t j = 0; j < iov[i].iov_len; j++) {
+                replay_digest = (replay_digest ^ b[j]) * 0x100000001b3ULL;
+            }
+            total += iov[i].iov_len;
         }
+        outq_consume(&p->out, total);
+        metric_add(stats, M_BYTES_OUT, total);
+        replay_bytes_out += total;
     }
-    return 0;
 }
 
 
-/* Return position of a network newline in a buffer.
+/* Write p's queued output with as few writev calls as the socket allows.
+ * If the socket cannot take all of it, wait for it to become writable.
  */
-int find_network_newline(const char *buf, int n) {
-    for(int i = 0; i < n; i++){
-        if(buf[i] == '\r'){
-            return i;
+void flush_client(struct client *p) {
+    if(p->closing) {
+        return;
+    }
+    if(ring != NULL) {
+        uring_send(p);
+        return;
+    }
+    if(replaying) {
+        if(replay_evicts(p->fd, EVICT_WRITE_FAILED) >= 0) {
+            drop_client(p);
+            return;
         }
+        replay_output(p);
+        return;
+    }
+    ssize_t n = outq_flush(&p->out, p->fd);
+    if(n < 0) {
+        metric_add(stats, M_WRITE_ERRORS, 1);
+        if(recording) {
+            rec_evict(p->fd, EVICT_WRITE_FAILED);
+        }
+        drop_client(p);
+        return;
+    }
+    metric_add(stats, M_BYTES_OUT, n);
+    if(p->out.len > 0) {
+        metric_add(stats, M_SHORT_WRITES, 1);
+    }
+    if(p->out.len > 0 && !p->want_write) {
+        // start watching for the socket to drain
+        p->want_write = 1;
+        num_backlogged++;
+        ev_modify(loop, p->fd, EV_READ | EV_WRITE);
+    }
+    else if(p->out.len == 0 && p->want_write) {
+        p->want_write = 0;
+        num_backlogged--;
+        ev_modify(loop, p->fd, EV_READ);
     }
-    return -1;
 }
 
 
-/* Return whether input was read from a given client p. is_active must be 
- * either 1 or 0 and it indicates whehter p is an active client.
+/* Prepare an io_uring write of p's queued output. It is submitted with
+ * everything else prepared in this loop iteration. Only one write per
+ * client is in flight at a time; the rest goes out when it completes.
  */
-int read_from(struct client *p, struct game_state *game, struct client **new_players, int is_active){
-    if(p != NULL){
-        // read input from active client
-        int index = p->in_ptr - p->inbuf;
-        int size_left = MAX_BUF - 1 - index;
-
-        // if buffer is full
-        if(size_left == 0){
-            size_left = MAX_BUF - 1;
-            p->in_ptr = p->inbuf;
+void uring_send(struct client *p) {
+    // while stopping for an upgrade, output stays queued and is handed over
+    if(p->sending || p->out.len == 0 || freezing) {
+        return;
+    }
+    if(iov_used + OUTQ_MAX_IOV > URING_IOV_POOL) {
+        // the kernel copies the iovecs on submission, so the pool can be reused
+        if(uring_submit(ring, 0, 0) < 0) {
+            perror("io_uring_enter");
         }
+        iov_used = 0;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe == NULL) {
+        drop_client(p);
+        return;
+    }
+    struct iovec *iov = iov_pool + iov_used;
+    int n_iov = outq_iov(&p->out, iov, OUTQ_MAX_IOV);
+    iov_used += n_iov;
+    uring_prep_writev(sqe, p->fd, iov, n_iov, (uintptr_t)p | UD_SEND);
+    p->sending = 1;
+    p->inflight++;
+    if(!p->want_write) {
+        p->want_write = 1;
+        num_backlogged++;
+    }
+}
 
-        int num_read = read(p->fd, p->in_ptr, size_left);
 
-        printf("[%d] Read %d bytes\n", p->fd, num_read);
-    
-        if(num_read <= 0){
-            // problem with socket
-            if(is_active){
-                help_disconnect(p, game);
+/* Flush every client that was sent something since the last flush.
+ */
+void flush_dirty() {
+    for(int i = 0; i < dirty_len; i++) {
+        dirty[i]->dirty = 0;
+        flush_client(dirty[i]);
+    }
+    dirty_len = 0;
+}
+
+
+/* Drop clients in list whose output has not moved for max_backlog_ms.
+ */
+void evict_stalled(struct client *list, long long now) {
+    for(struct client *p = list; p != NULL; p = p->next) {
+        if(p->want_write && now - p->out.since_ms > max_backlog_ms) {
+            LOG(LOG_WARN, "Evicting client %d: output stalled for %lld ms\n",
+                   p->fd, now - p->out.since_ms);
+            if(recording) {
+                rec_evict(p->fd, EVICT_STALLED);
             }
-            else{
-                remove_player(new_players, p->fd);
-            }   
+            drop_client(p);
         }
-        else{
-            if(find_network_newline(p->inbuf, p->in_ptr + num_read - p->inbuf) != -1){
-                *(p->in_ptr + num_read - 2) = '\0';            
-
-                p->in_ptr = p->inbuf;
+    }
+}
 
-                printf("[%d] Found newline %s\n", p->fd, p->inbuf);
 
-                return 1;                                                         
-            }
-            else{
-                p->in_ptr += num_read;
-                return 0;
-            }
+/* Replay: drop the clients the recording says were evicted for stalled
+ * output at this point.
+ */
+void replay_stalled(void) {
+    int fd;
+    while((fd = replay_evicts(-1, EVICT_STALLED)) >= 0) {
+        if(fd < fd_table_len && fd_table[fd] != NULL) {
+            drop_client(fd_table[fd]);
         }
     }
-    return 0;    
 }
 
 
-/* Notify active clients about client p's guess.
+/* Restart p's idle deadline; it has just been heard from.
  */
-void announce_guess(struct client *p, char guess, struct game_state *game){
-    if(p != NULL){
-        char all_mes[MAX_BUF];
+void touch_client(struct client *p) {
+    if(on_game_thread) {
+        // the deadline is kept by p's I/O thread
+        deliver(p, OUT_TOUCH, NULL);
+        return;
+    }
+    if(idle_timeout_ms > 0) {
+        timer_add(&timers, &p->idle, now_ms() + idle_timeout_ms);
+    }
+    else {
+        timer_cancel(&timers, &p->idle);
+    }
+}
 
-        int len0 = strlen(p->name);
-        strcpy(all_mes, p->name);
 
-        char guesses_text[] = " guesses  ";
-        int len1 = strlen(guesses_text);
-        strcat(all_mes, guesses_text);
+/* Disconnect a client that did not give a name, or did not send anything,
+ * in time.
+ */
+void idle_expired(struct timer *t) {
+    struct client *p = timer_owner(t, struct client, idle);
+    LOG(LOG_INFO, "Disconnecting client %d: %s\n", p->fd,
+        p->in_game ? "idle for too long" : "no name given in time");
+    metric_add(stats, M_IDLE_TIMEOUTS, 1);
+    drop_client(p);
+}
 
-        all_mes[len0 + len1 - 1] = guess;
-        all_mes[len0 + len1] = '\0';
 
-        broadcast(game, all_mes);
-    }    
+/* Move the has_next_turn pointer to the next active client */
+void advance_turn(struct game_state *game){
+    if(game->has_next_turn->next != NULL){
+        game->has_next_turn = game->has_next_turn->next;
+    }
+    else{
+        game->has_next_turn = game->head;
+    }
 }
 
 
-/* Manage turns, remove player p from active clients and inform
- * all the active clients about removal.
+/* Return 1 if anyone but bots is playing.
  */
-void help_disconnect(struct client *p, struct game_state *game){
-
-    // store name of p for future use
-    char name[MAX_NAME];
-    strcpy(name, p->name);
-    int current_left = 0;
-    // if p has next turn
-    if(game->has_next_turn == p){
-        // give turn to next player
-        advance_turn(game);
-        current_left = 1;
-        // if no players left in the game
-        if(game->has_next_turn == p){
-            game->has_next_turn = NULL;
+int has_humans(struct game_state *game) {
+    for(struct client *p = game->head; p != NULL; p = p->next) {
+        if(!p->bot) {
+            return 1;
         }
     }
+    return 0;
+}
 
-    // remove p from active clients
-    remove_player(&(game->head), p->fd);
 
-    //say goodbye to player who just left
-    char all_mes[MAX_BUF];
+/* Ask client whose turn it is for guess
+ */
+void prompt_for_guess(struct game_state *game){
+    // prompt client whose turn it is to type guess
+    if(game->has_next_turn != NULL){
+        struct client *p = game->has_next_turn;
+        if(p->mode == MODE_BINARY) {
+            struct frame f;
+            frame_begin(&f, OP_TURN);
+            frame_u8(&f, 1);
+            frame_str(&f, p->name);
+            send_frame(p, &f);
+        }
+        else {
+            char msg[MAX_BUF] = "Your guess?\n";
+            int len1 = strlen(msg);
+            msg[len1] = '\r';
+            send_to(p, msg, len1 + 1);
+        }
+        game->has_next_turn->prompted_ns = now_ns();
 
-    char bye_text[] = "Goodbye ";
-    int len0 = strlen(bye_text);
-    strcpy(all_mes, bye_text);
+        // a bot takes its turn after a while, if anyone is there to see it
+        if(p->bot && has_humans(game)) {
+            timer_add(&timers, &p->idle, now_ms() + BOT_THINK_MS);
+        }
+
+        // a new turn gets a new deadline; asking again after an invalid
+        // guess does not
+        if(turn_timeout_ms > 0 && (game->turn_player != game->has_next_turn ||
+                                   !timer_pending(&game->turn_timer))) {
+            timer_add(&timers, &game->turn_timer, now_ms() + turn_timeout_ms);
+            game->turn_player = game->has_next_turn;
+        }
+    }
+    else {
+        timer_cancel(&timers, &game->turn_timer);
+        game->turn_player = NULL;
+    }
+}
+
+
+/* Pass the turn on from a player who took too long to guess.
+ */
+void turn_expired(struct timer *t) {
+    struct game_state *game = timer_owner(t, struct game_state, turn_timer);
+    struct client *p = game->has_next_turn;
+    if(p == NULL) {
+        return;
+    }
+    LOG(LOG_DEBUG, "%s took too long to guess\n", p->name);
+    metric_add(stats, M_TURN_TIMEOUTS, 1);
+    send_error(p, "You took too long.\r\n", PROTO_ERR_TIMED_OUT);
+
+    advance_turn(game);
+    LOG(LOG_DEBUG, "It's %s's turn.\n", game->has_next_turn->name);
+    announce_turn_all(game);
+    prompt_for_guess(game);
+}
+
+
+/* Broadcast message to all the active clients: outbuf to those using text
+ * and frame f, unless it is NULL, to those using binary frames.
+ * Outbuf must have a null terminating character and room for two more
+ * characters. Each form is copied once, when first needed, and shared by
+ * every player's queue.
+ */
+void broadcast(struct game_state *game, char *outbuf, struct frame *f){
+    int len = strlen(outbuf);
+    outbuf[len] = '\r';
+    outbuf[len + 1] = '\n';
+
+    struct msgbuf *m = NULL;
+    struct msgbuf *bin = NULL;
+    for(struct client *p = game->head; p != NULL; p = p->next) {
+        if(p->mode != MODE_BINARY) {
+            if(m == NULL) {
+                m = make_msg(outbuf, len + 2);
+            }
+            send_msg(p, m);
+        }
+        else if(f != NULL) {
+            if(bin == NULL) {
+                bin = make_msg((char *)f->data, f->len);
+            }
+            send_msg(p, bin);
+        }
+    }
+    if(m != NULL) {
+        msgbuf_put(m);
+    }
+    if(bin != NULL) {
+        msgbuf_put(bin);
+    }
+}
+
+
+/* Return the status message for the current state of the game.
+ */
+struct msgbuf *render_status(struct game_state *game){
+    char game_info[STATUS_MAX + 2];
+    status_message(game_info, game);
+    int info_len = strlen(game_info);
+    game_info[info_len] = '\r';
+    game_info[info_len + 1] = '\n';
+    return make_msg(game_info, info_len + 2);
+}
+
+
+/* Return the message telling players whose turn it is.
+ */
+struct msgbuf *render_turn(struct game_state *game){
+    char all_msg[MAX_BUF];
+    int len = format_turn(all_msg, game->has_next_turn->name);
+    return make_msg(all_msg, len);
+}
+
+
+/* Announce whose turn it is to client p. */
+void announce_turn(struct game_state *game, struct client *p){
+    // get the status message for the current state of the game
+    if(game->has_next_turn != NULL && p != NULL && p->mode == MODE_BINARY){
+        struct frame f;
+        render_state(game, &f);
+        send_frame(p, &f);
+        if(p != game->has_next_turn){
+            render_turn_frame(game->has_next_turn->name, &f);
+            send_frame(p, &f);
+        }
+    }
+    else if(game->has_next_turn != NULL && p != NULL){
+        // there is a current player, so announce turn
+        struct msgbuf *info = render_status(game);
+        send_msg(p, info);
+        msgbuf_put(info);
+
+        if(p != game->has_next_turn){                 
+            struct msgbuf *turn = render_turn(game);
+            send_msg(p, turn);
+            msgbuf_put(turn);
+        }
+    }
+}
+
+
+/* Announce whose turn it is to all the active clients. The status and the
+ * turn message are rendered once and shared by every queue. Clients using
+ * binary frames have followed the game through OP_DELTA and OP_STATE, so
+ * they only hear about the turn.
+ */
+void announce_turn_all(struct game_state *game){
+    if(game->has_next_turn == NULL){
+        return;
+    }
+    struct msgbuf *info = NULL;
+    struct msgbuf *turn = NULL;
+    struct msgbuf *bin = NULL;
+
+    for(struct client *p = game->head; p != NULL; p = p->next) {
+        if(p->mode == MODE_BINARY) {
+            if(p != game->has_next_turn){
+                if(bin == NULL) {
+                    struct frame f;
+                    render_turn_frame(game->has_next_turn->name, &f);
+                    bin = make_msg((char *)f.data, f.len);
+                }
+                send_msg(p, bin);
+            }
+            continue;
+        }
+        if(info == NULL) {
+            info = render_status(game);
+            turn = render_turn(game);
+        }
+        send_msg(p, info);
+        if(p != game->has_next_turn){
+            send_msg(p, turn);
+        }
+    }
+    if(info != NULL) {
+        msgbuf_put(info);
+        msgbuf_put(turn);
+    }
+    if(bin != NULL) {
+        msgbuf_put(bin);
+    }
+}
+
+
+/* Announce the winner of the game */
+int announce_winner(struct game_state *game){
+    if(game->head != NULL){
+        if(game->guesses_left == 0){
+            // inform players that game is over
+            char all_msg[MAX_BUF];
+            int len = format_loss(all_msg, game->word);
+            all_msg[len] = '\0';
+
+            LOG(LOG_DEBUG, "%s\n", all_msg);
+
+            struct frame f;
+            render_game_over(game, NULL, &f);
+            broadcast(game, all_msg, &f);
+
+            return 1;                                        
+        }
+        else if(game->revealed == game->all_positions){
+            LOG(LOG_DEBUG, "Game over! %s won.\n", game->has_next_turn->name);
+
+            // client won
+            // inform players that game is over
+            char all_msg[MAX_BUF];
+            int total = format_win(all_msg, game->has_next_turn->name);
+            struct msgbuf *m = NULL;
+            struct msgbuf *bin = NULL;
+          
+            for(struct client *p = game->head; p != NULL; p = p->next) {
+                // binary clients all get the same frame
+                if(p->mode == MODE_BINARY){
+                    if(bin == NULL){
+                        struct frame f;
+                        render_game_over(game, game->has_next_turn->name, &f);
+                        bin = make_msg((char *)f.data, f.len);
+                    }
+                    send_msg(p, bin);
+                }
+                // send message to all the clients except the winner
+                else if(p != game->has_next_turn){
+                    if(m == NULL){
+                        m = make_msg(all_msg, total);
+                    }
+                    send_msg(p, m);
+                } 
+            }       
+            if(m != NULL){
+                msgbuf_put(m);
+            }
+            if(bin != NULL){
+                msgbuf_put(bin);
+            }
+
+            // inform the winner
+            if(game->has_next_turn->mode != MODE_BINARY){
+                char win_message[MAX_BUF];
+                total = format_own_win(win_message);
+                send_to(game->has_next_turn, win_message, total);
+            }
+            return 1;       
+        }
+    }
+    return 0;
+}
+
+
+/* Account for num_read bytes of input stored at input_space(p).
+ */
+void got_input(struct client *p, int num_read) {
+    LOG(LOG_DEBUG, "[%d] Read %d bytes\n", p->fd, num_read);
+    metric_add(stats, M_BYTES_IN, num_read);
+    p->in_end += num_read;
+}
+
+
+/* Settle how p talks from the first byte it sent: PROTO_MAGIC asks for
+ * binary frames, which the server confirms, and anything else is text.
+ */
+void choose_mode(struct client *p) {
+    if((unsigned char)p->inbuf[p->in_start] != PROTO_MAGIC) {
+        p->mode = MODE_TEXT;
+        return;
+    }
+    p->in_start++;
+    p->mode = MODE_BINARY;
+    LOG(LOG_DEBUG, "[%d] Using binary frames\n", p->fd);
+
+    char magic = PROTO_MAGIC;
+    send_to(p, &magic, 1);
+    struct frame f;
+    frame_begin(&f, OP_HELLO);
+    frame_u8(&f, PROTO_VERSION);
+    send_frame(p, &f);
+}
+
+
+/* Return the payload of the next full frame from p, NUL-terminated in
+ * place of its last byte, and set *op to its opcode. Return NULL if no
+ * full frame is in yet. A frame whose payload is longer than MAX_LINE is
+ * skipped and the client is told so.
+ */
+char *next_frame(struct client *p, int *op) {
+    while(1){
+        int pending = p->in_end - p->in_start;
+        if(p->skipping > 0){
+            int n = pending < p->skipping ? pending : p->skipping;
+            p->in_start += n;
+            p->skipping -= n;
+            if(p->skipping > 0){
+                return NULL;
+            }
+            continue;
+        }
+        if(pending < 2){
+            return NULL;
+        }
+        unsigned char *start = (unsigned char *)p->inbuf + p->in_start;
+        int len = start[0];
+        if(len == 0){
+            p->in_start++;
+            send_error(p, NULL, PROTO_ERR_BAD_FRAME);
+            continue;
+        }
+        if(len - 1 > MAX_LINE){
+            LOG(LOG_INFO, "[%d] Frame too long\n", p->fd);
+            send_error(p, NULL, PROTO_ERR_TOO_LONG);
+            p->skipping = len + 1;
+            continue;
+        }
+        if(pending < len + 1){
+            return NULL;
+        }
+        // move the payload over the header to make room for the NUL
+        *op = start[1];
+        memmove(start, start + 2, len - 1);
+        start[len - 1] = '\0';
+        p->in_start += len + 1;
+        return (char *)start;
+    }
+}
+
+
+/* Return the next full line of input from p, without its line ending.
+ * Return NULL if no full line is in yet. A line longer than MAX_LINE is
+ * thrown away and the client is told so. Clients using binary frames get
+ * the payload of their next frame instead, and its opcode in *op.
+ */
+char *next_line(struct client *p, int *op) {
+    if(p->mode == MODE_UNKNOWN){
+        if(p->in_start == p->in_end){
+            return NULL;
+        }
+        choose_mode(p);
+    }
+    if(p->mode == MODE_BINARY){
+        return next_frame(p, op);
+    }
+    char *line;
+    int found;
+    while((found = scan_line(p, &line)) < 0){
+        LOG(LOG_INFO, "[%d] Line too long\n", p->fd);
+        send_error(p, "Line too long.\r\n", PROTO_ERR_TOO_LONG);
+    }
+    if(found == 0){
+        return NULL;
+    }
+    LOG(LOG_DEBUG, "[%d] Found newline %s\n", p->fd, line);
+    return line;
+}
+
+
+/* Handle every full line p has sent, stopping early if p is dropped.
+ */
+void handle_input(struct client *p, struct game_state *game, struct client **new_players) {
+    while(!p->closing && !p->zombie && (p->line = next_line(p, &p->op)) != NULL){
+        handle_line(p, game, new_players);
+    }
+}
+
+
+/* Read what client p has sent. Return whether anything arrived. A client
+ * whose socket failed or closed is dropped.
+ */
+int read_from(struct client *p){
+    int size_left;
+    char *space = input_space(p, &size_left);
+    int num_read = read(p->fd, space, size_left);
+
+    if(num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+        // nothing to read after all
+        return 0;
+    }
+    if(num_read <= 0){
+        // problem with socket
+        LOG(LOG_DEBUG, "[%d] Read %d bytes\n", p->fd, num_read);
+        if(recording) {
+            rec_close(p->fd);
+        }
+        drop_client(p);
+        return 0;
+    }
+    if(recording) {
+        rec_read(p->fd, space, num_read);
+    }
+    got_input(p, num_read);
+    return 1;
+}
+
+
+/* Notify active clients about client p's guess, which uncovered the
+ * positions in hits.
+ */
+void announce_guess(struct client *p, char guess, uint32_t hits, struct game_state *game){
+    if(p != NULL){
+        struct frame f;
+        render_delta(game, p->name, guess, hits, &f);
+
+        char all_mes[MAX_BUF];
+        int len = format_guess(all_mes, p->name, guess);
+        all_mes[len] = '\0';
+
+        broadcast(game, all_mes, &f);
+    }    
+}
+
+
+/* Manage turns, remove player p from active clients and inform
+ * all the active clients about removal.
+ */
+void help_disconnect(struct client *p, struct game_state *game){
+
+    // store name of p for future use
+    char name[MAX_NAME];
+    strcpy(name, p->name);
+    int current_left = 0;
+    // if p has next turn
+    if(game->has_next_turn == p){
+        // give turn to next player
+        advance_turn(game);
+        current_left = 1;
+        // if no players left in the game
+        if(game->has_next_turn == p){
+            game->has_next_turn = NULL;
+        }
+    }
+
+    // what p did in a game left unfinished counts, but not as a game
+    if(p->played.hits + p->played.misses > 0) {
+        scores_add(p->name, &p->played);
+    }
+
+    // remove p from active clients
+    remove_player(&(game->head), p->fd);
+
+    //say goodbye to player who just left
+    char all_mes[MAX_BUF];
+
+    char bye_text[] = "Goodbye ";
+    int len0 = strlen(bye_text);
+    strcpy(all_mes, bye_text);
 
     int len1 = strlen(name);
     strcat(all_mes, name);
 
     all_mes[len0 + len1] = '\0';
-    broadcast(game, all_mes);
+    struct frame f;
+    frame_begin(&f, OP_LEFT);
+    frame_str(&f, name);
+    broadcast(game, all_mes, &f);
 
     if(current_left){
         // if player whose turn it was left
         if(game -> has_next_turn != NULL){
-            printf("It's %s's turn.\n", game->has_next_turn->name);
+            LOG(LOG_DEBUG, "It's %s's turn.\n", game->has_next_turn->name);
         }
-        for(struct client *q = game->head; q != NULL;) {
-            struct client *next = q->next;
-            announce_turn(game, q); 
-            q = next;    
-        } 
+        announce_turn_all(game);
     }    
     
     prompt_for_guess(game);
@@ -393,33 +1399,37 @@ void add_to_game(struct client *p, struct client **new_players, struct game_stat
     }  
 
     // update the name of the client
-    strncpy(p->name, p->inbuf, MAX_NAME);
+    strncpy(p->name, p->line, MAX_NAME);
 
     // add client to game
     p->next = game->head;
     game->head = p;
-    p->in_ptr = p->inbuf;
+    p->in_game = 1;
+    touch_client(p);
 
     // if there is no current player
     if(game->has_next_turn == NULL){
         game->has_next_turn = p;  
-        printf("It's %s's turn.\n", game->has_next_turn->name);                                   
+        LOG(LOG_DEBUG, "It's %s's turn.\n", game->has_next_turn->name);                                   
     }                             
 
     // inform all the players that p has joined the game
     char all_msg[MAX_BUF];
 
-    int len0 = strlen(p->inbuf);
+    int len0 = strlen(p->name);
     strcpy(all_msg, p->name);
 
-    printf("%s jas just joined.\n", p->name);
+    LOG(LOG_INFO, "%s has just joined.\n", p->name);
 
     char joined_text[] = " has joined the game.";
     int len1 = strlen(joined_text);
     strcat(all_msg, joined_text);
     // broadcast message to active clients
     all_msg[len0 + len1] = '\0';
-    broadcast(game, all_msg);
+    struct frame f;
+    frame_begin(&f, OP_JOINED);
+    frame_str(&f, p->name);
+    broadcast(game, all_msg, &f);
    
    // send information about game to p
    announce_turn(game, p);
@@ -438,41 +1448,19 @@ int is_valid_input(struct client *p, struct game_state *game){
     if(game->has_next_turn != p){
         is_valid = -1;
     }
-    else if(strlen(p->inbuf) > 1){
-        is_valid = 0;
-    }
-    else if('a' > p->inbuf[0] || 'z' < p->inbuf[0]){
+    else if(!check_guess(game, p->line)){
         is_valid = 0;
     }
-    else{
-        for(int i = 0; i < NUM_LETTERS; i++){
-            if(game->letters_guessed[i] == p->inbuf[0]){
-                is_valid = 0;
-                break;
-            }
-        }
-    }
 
     if(is_valid == -1){
-        printf("Player %s tried to guess out of turn\n", p->name);
+        LOG(LOG_DEBUG, "Player %s tried to guess out of turn\n", p->name);
 
         // inform client that it's not their turn
-        char msg[MAX_BUF] = "It's not your turn.\r\n";
-        int len = strlen(msg);
-        if (write(p->fd, msg, len) != len) {
-            // there is a problem with socket
-            help_disconnect(p, game);
-        }                                                                   
+        send_error(p, "It's not your turn.\r\n", PROTO_ERR_NOT_YOUR_TURN);
     }
     else if(is_valid == 0){
         // inform client that guess isn't valid
-        char msg[MAX_BUF] = "Invalid guess.\r\n";
-        int len = strlen(msg);
-        if (write(p->fd, msg, len) != len) {
-            // there is a problem with socket
-            help_disconnect(p, game);                                    
-        }
-        else{
+        if (send_error(p, "Invalid guess.\r\n", PROTO_ERR_INVALID_GUESS) == 0) {
             prompt_for_guess(game);  
         }                                       
     }
@@ -481,263 +1469,2120 @@ int is_valid_input(struct client *p, struct game_state *game){
 }
 
 
+/* Pick the word for a new game from the newest word list. A game starting
+ * on a list it has not used before begins a new rotation through it.
+ */
+void start_game(struct game_state *game) {
+    const struct lexicon *lex = lexicon_enter(shard_id);
+    if(lex->generation != lexicon_generation) {
+        rotation_init(&game->rot);
+        lexicon_generation = lex->generation;
+    }
+    init_game(game, &lex->sel);
+    lexicon_exit(shard_id);
+    metric_add(stats, M_GAMES_STARTED, 1);
+}
+
+
 /* Restart the game and inform active clients about it.
  */
-void restart_game(struct game_state *game, char *words){
+void restart_game(struct game_state *game){
 
     char restart_mes[MAX_BUF];
 
     char new_game[] = "\r\nLet's start a new game.";
     strcpy(restart_mes, new_game);
 
-    broadcast(game, restart_mes);
+    broadcast(game, restart_mes, NULL);
+
+    LOG(LOG_DEBUG, "Started new game\n");
+
+    start_game(game);
+
+    // binary clients get the new board now; text clients get it with the
+    // next turn announcement
+    struct msgbuf *bin = NULL;
+    for(struct client *p = game->head; p != NULL; p = p->next) {
+        if(p->mode == MODE_BINARY) {
+            if(bin == NULL) {
+                struct frame f;
+                render_state(game, &f);
+                bin = make_msg((char *)f.data, f.len);
+            }
+            send_msg(p, bin);
+        }
+    }
+    if(bin != NULL) {
+        msgbuf_put(bin);
+    }
+}
+
+
+/* Hand what every player did in the game that just ended to the stats
+ * thread; winner is NULL if the guesses ran out.
+ */
+void record_game(struct game_state *game, struct client *winner) {
+    for(struct client *p = game->head; p != NULL; p = p->next) {
+        p->played.games = 1;
+        p->played.wins = p == winner;
+        if(!p->bot) {
+            // bots stay off the leaderboard
+            scores_add(p->name, &p->played);
+        }
+        memset(&p->played, 0, sizeof(p->played));
+    }
+}
 
-    printf("Started new game\n");
 
-    init_game(game, words);    
+/* Send client p the leaderboard.
+ */
+void send_leaderboard(struct client *p) {
+    struct leaderboard board;
+    scores_top(&board);
+    if(p->mode == MODE_BINARY) {
+        struct frame f;
+        for(int place = board.len == 0 ? 0 : 1; place <= board.len; place++) {
+            render_leader(&board, place, &f);
+            send_frame(p, &f);
+        }
+        return;
+    }
+    char msg[MAX_BOARD_MSG];
+    send_to(p, msg, format_leaderboard(msg, &board));
 }
 
 
 /* Process guess, advance turn if guess is incorrect, make announcements to active players. 
  */
-void process_guess(struct client *p, struct game_state *game, char *words_filename, int is_correct, char guess){
-    announce_guess(p, guess, game);
+void process_guess(struct client *p, struct game_state *game, uint32_t hits, char guess){
+    long long start = real_now_ns();
+    announce_guess(p, guess, hits, game);
 
     // announce winner, if there is one
     int game_over = announce_winner(game);
 
     if(game_over){
-        restart_game(game, words_filename);
+        metric_add(stats, M_GAMES_FINISHED, 1);
+        record_game(game, game->revealed == game->all_positions ? game->has_next_turn : NULL);
+        restart_game(game);
     }
 
-    if(!is_correct){
+    if(hits == 0){
         // if guess is incorrect, advance turn
         advance_turn(game);
     }
 
     if(game -> has_next_turn != NULL){
-        printf("It's %s's turn.\n", game->has_next_turn->name);
+        LOG(LOG_DEBUG, "It's %s's turn.\n", game->has_next_turn->name);
     }    
 
-    for(struct client *q = game->head; q != NULL;) {
-        struct client *next = q->next;
-        announce_turn(game, q); 
-        q = next;    
-    }    
+    announce_turn_all(game);
 
     prompt_for_guess(game);     
+
+    metric_add(stats, M_GUESSES, 1);
+    metric_record(stats, H_GUESS, real_now_ns() - start);
 }
 
 
-int main(int argc, char **argv) {
-    int clientfd, maxfd, nready;
-    struct client *p;
-    struct sockaddr_in q;
-    fd_set rset;
-    
-    if(argc != 2){
-        fprintf(stderr,"Usage: %s <dictionary filename>\n", argv[0]);
-        exit(1);
+/* Apply the guess in p->line to the game, if it is p's turn and the guess
+ * is valid.
+ */
+void handle_guess(struct client *p, struct game_state *game) {
+    // check whether input from p is valid
+    int is_valid = is_valid_input(p, game); 
+    if(is_valid != 1){
+        return;
     }
 
-    // Add the following code to main in wordsrv.c:
-    struct sigaction sa;
-    sa.sa_handler = SIG_IGN;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    if(sigaction(SIGPIPE, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(1);
-    }    
-    
-    // Create and initialize the game state
-    struct game_state game;
-
-    srandom((unsigned int)time(NULL));
-    // Set up the file pointer outside of init_game because we want to 
-    // just rewind the file when we need to pick a new word
-    game.dict.fp = NULL;
-    game.dict.size = get_file_length(argv[1]);
+    // client's guess is valid, modify game; whoever has the next turn
+    // gets a fresh deadline, even if it is p again
+    timer_cancel(&timers, &game->turn_timer);
+    char guess = p->line[0];
+    long long think_ns = now_ns() - p->prompted_ns;
+    metric_record(stats, H_THINK, think_ns);
+    p->played.think_us += think_ns / 1000;
+
+    // mark the guess and uncover the letters it hits
+    uint32_t hits = uncover(game, guess);
+    if(hits != 0){
+        p->played.hits++;
+    }
+    else{
+        // if letter does not appear in the word
+        p->played.misses++;
+        game->guesses_left -= 1;
 
-    init_game(&game, argv[1]);
-    
-    // head and has_next_turn also don't change when a subsequent game is
-    // started so we initialize them here.
-    game.head = NULL;
-    game.has_next_turn = NULL;
-      
-    /* A list of client who have not yet entered their name.  This list is
-     * kept separate from the list of active players in the game, because
-     * until the new playrs have entered a name, they should not have a turn
-     * or receive broadcast messages.  In other words, they can't play until
-     * they have a name.
-     */
-    struct client *new_players = NULL;
-    
-    struct sockaddr_in *server = init_server_addr(PORT);
-    int listenfd = set_up_server_socket(server, MAX_QUEUE);
-    
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
+        LOG(LOG_DEBUG, "Letter %c is not in the word\n", guess);                
 
-    while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        if (nready == -1) {
-            perror("select");
-            continue;
+        // inform client that guess is incorrect; binary clients learn
+        // this from the OP_DELTA frame
+        if(p->mode != MODE_BINARY){
+            char msg[MAX_BUF];
+            send_to(p, msg, format_miss(msg, guess));
         }
-
-        if (FD_ISSET(listenfd, &rset)){
-            printf("A new client is connecting\n");
-            clientfd = accept_connection(listenfd, &q);
-
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-
-            printf("Connection from %s\n", inet_ntoa(q.sin_addr));
-            add_player(&new_players, clientfd, q.sin_addr);
-            char *greeting = WELCOME_MSG;
-            if(write(clientfd, greeting, strlen(greeting)) == -1) {
-                fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
-                remove_player(&new_players, clientfd);
-            };
-        }      
-        
-        /* Check which other socket descriptors have something ready to read.
-         * The reason we iterate over the rset descriptors at the top level and
-         * search through the two lists of clients each time is that it is
-         * possible that a client will be removed in the middle of one of the
-         * operations. This is also why we call break after handling the input.
-         * If a client has been removed the loop variables may not longer be 
-         * valid.
+    }
+    process_guess(p, game, hits, guess);
+}
+
+
+/* Find the words in the newest list that fit the board of game.
+ */
+void match_game(struct game_state *game, struct match_result *r) {
+    const struct lexicon *lex = lexicon_enter(shard_id);
+    match_board(&lex->match, game->len, game->revealed, game->word, game->guessed, r);
+    lexicon_exit(shard_id);
+}
+
+
+/* Tell player p how many words fit the board, and which letter most of
+ * them contain.
+ */
+void send_hint(struct client *p, struct game_state *game) {
+    struct match_result r;
+    match_game(game, &r);
+    if(p->mode == MODE_BINARY) {
+        struct frame f;
+        render_hint(&r, &f);
+        send_frame(p, &f);
+        return;
+    }
+    char msg[MAX_BUF];
+    send_to(p, msg, format_hint(msg, game->guess, &r));
+}
+
+
+/* Pick a letter for a bot to guess: with a chance of bot_skill percent,
+ * the one most of the words that fit the board contain, and otherwise any
+ * letter not guessed yet.
+ */
+char bot_letter(struct game_state *game) {
+    if(random_below(&game->rng, 100) < (uint32_t)bot_skill) {
+        struct match_result r;
+        match_game(game, &r);
+        int best = match_best_letter(&r);
+        if(best >= 0) {
+            return 'a' + best;
+        }
+    }
+    uint32_t left = ~game->guessed & (LETTER_BIT('z') * 2 - 1);
+    for(uint32_t n = random_below(&game->rng, __builtin_popcount(left)); n > 0; n--) {
+        left &= left - 1;
+    }
+    return 'a' + __builtin_ctz(left);
+}
+
+
+/* Make the guess of the bot whose idle timer t ran out, if it is still
+ * its turn and someone is still playing.
+ */
+void bot_move(struct timer *t) {
+    struct client *p = timer_owner(t, struct client, idle);
+    struct game_state *game = bots_game;
+    if(game->has_next_turn != p || !has_humans(game)) {
+        return;
+    }
+    p->inbuf[0] = bot_letter(game);
+    p->inbuf[1] = '\0';
+    p->line = p->inbuf;
+    handle_guess(p, game);
+}
+
+
+/* Put num_bots bots in game.
+ */
+void add_bots(struct game_state *game) {
+    for(int i = 1; i <= num_bots; i++) {
+        struct client *p = add_bot(&game->head);
+        snprintf(p->name, MAX_NAME, "bot%d", i);
+    }
+}
+
+
+/* Add p to the game if the name in p->line is acceptable, otherwise ask
+ * for another name.
+ */
+void handle_name(struct client *p, struct client **new_players, struct game_state *game) {
+    int is_valid = 1;
+    if(strlen(p->line) > MAX_NAME - 1){
+        is_valid = 0;
+    }
+    else if(strpbrk(p->line, "\r\n\t\b\x1b\x7f") != NULL){
+        // it would end up in other players' output
+        is_valid = 0;
+    }
+    else if(strlen(p->line) >= 1){
+        // check whether any active player has this name
+        for(struct client *q = game->head; q != NULL; q = q->next) {
+            if(strcmp(q->name, p->line) == 0){
+                is_valid = 0;
+                break;
+            }
+        }    
+    }
+    else{
+        // name is invalid because it is an empty string
+        is_valid = 0;
+    }
+    if(is_valid == 1){
+        // add p to active clients
+        add_to_game(p, new_players, game);
+    }
+    else{
+        // send feedback back to client telling them their name is 
+        // invalid
+        send_error(p, "Unacceptable name. Please enter your name:\r\n",
+                   PROTO_ERR_BAD_NAME);
+    }
+}
+
+
+/* Act on the line p just finished: a guess or a request for a hint from
+ * a player, or the name of a new player.
+ */
+void handle_line(struct client *p, struct game_state *game, struct client **new_players) {
+    // anyone may ask for the leaderboard, whether playing or not
+    if(p->mode == MODE_BINARY ? p->op == OP_TOP : strcmp(p->line, "/top") == 0) {
+        send_leaderboard(p);
+        return;
+    }
+    // players may ask for a hint, their turn or not
+    if(p->in_game && (p->mode == MODE_BINARY ? p->op == OP_HINT
+                                             : strcmp(p->line, "/hint") == 0)) {
+        touch_client(p);
+        send_hint(p, game);
+        return;
+    }
+    // a binary frame has to be the kind the client is expected to send
+    if(p->mode == MODE_BINARY && p->op != (p->in_game ? OP_GUESS : OP_JOIN)) {
+        send_error(p, NULL, PROTO_ERR_BAD_FRAME);
+        return;
+    }
+    if(p->in_game) {
+        touch_client(p);
+        handle_guess(p, game);
+    }
+    else {
+        // new player is entering their name
+        handle_name(p, new_players, game);
+    }
+}
+
+
+/* Add the connected socket clientfd to new_players and greet it.
+ */
+void new_client(int clientfd, struct in_addr addr, struct client **new_players) {
+    LOG(LOG_INFO, "Connection from %s\n", inet_ntoa(addr));
+    // replies are small and each one is waited for; don't let Nagle hold
+    // them back
+    if(!replaying && set_nodelay(clientfd) < 0) {
+        perror("setsockopt");
+    }
+    if(ring == NULL && !replaying && ev_add(loop, clientfd, EV_READ) < 0) {
+        perror("set up client socket");
+        close(clientfd);
+        return;
+    }
+    if(recording) {
+        rec_accept(clientfd, addr);
+    }
+    struct client *p = add_player(new_players, clientfd, addr);
+    metric_add(stats, M_ACCEPTED, 1);
+    if(ring != NULL) {
+        uring_arm_recv(p);
+    }
+    char *greeting = WELCOME_MSG;
+    send_to(p, greeting, strlen(greeting));
+}
+
+
+/* Open the reserve descriptor if it is not held. Return 0 on success and
+ * -1 on failure.
+ */
+int take_reserve_fd() {
+    if(reserve_fd < 0) {
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    return reserve_fd < 0 ? -1 : 0;
+}
+
+
+/* Out of descriptors: give up the reserve one to accept the next waiting
+ * connection on listenfd, close it at once and take the reserve back.
+ * Return 0 if a connection was turned away and -1 if none could be.
+ */
+int turn_away(int listenfd) {
+    if(take_reserve_fd() < 0) {
+        return -1;
+    }
+    close(reserve_fd);
+    reserve_fd = -1;
+    struct sockaddr_in q;
+    int fd = accept_connection(listenfd, &q);
+    if(fd >= 0) {
+        close(fd);
+        LOG(LOG_WARN, "Out of descriptors; turned away %s\n", inet_ntoa(q.sin_addr));
+    }
+    take_reserve_fd();
+    return fd >= 0 ? 0 : -1;
+}
+
+
+/* Accept the connections waiting on listenfd and ask each client for a
+ * name. At most ACCEPT_BATCH are taken at once so that a flood of them
+ * cannot stall the players; the listener stays ready for the rest.
+ * Failures that concern a single connection are skipped.
+ */
+void handle_connection(int listenfd, struct client **new_players) {
+    for(int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in q;
+        int clientfd = accept_connection(listenfd, &q);
+        if(clientfd >= 0) {
+            new_client(clientfd, q.sin_addr, new_players);
+            continue;
+        }
+        switch(errno) {
+        case EAGAIN:
+            return;
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+            // the connection went away or was refused before we got it
+            break;
+        case EMFILE:
+        case ENFILE:
+            if(turn_away(listenfd) < 0) {
+                return;
+            }
+            break;
+        default:
+            // ENOBUFS, ENOMEM and the like; try again next iteration
+            perror("accept");
+            return;
+        }
+    }
+}
+
+
+/* Stop taking clients from the router.
+ */
+void leave_router() {
+    if(routerfd >= 0) {
+        ev_del(loop, routerfd);
+        close(routerfd);
+        routerfd = -1;
+    }
+}
+
+
+/* Connect to the router at router_path, unless connected already. A
+ * router that is not up yet is tried again with the next report.
+ */
+void connect_router() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, router_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+       || ev_add(loop, fd, EV_READ) < 0) {
+        LOG(LOG_DEBUG, "Cannot reach the router at %s\n", router_path);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    routerfd = fd;
+    reported = -1;
+    LOG(LOG_INFO, "Taking clients from the router at %s\n", router_path);
+}
+
+
+/* Tell the router how many clients this thread holds, if that changed,
+ * connecting to it first if need be; not while stopping for an upgrade,
+ * since new clients should go to the new process. Runs every
+ * ROUTER_REPORT_MS.
+ */
+void report_load(struct timer *t) {
+    if(routerfd < 0 && !freezing) {
+        connect_router();
+    }
+    if(routerfd >= 0 && num_sockets != reported) {
+        struct load_report r = {num_sockets};
+        if(send(routerfd, &r, sizeof(r), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(r)) {
+            reported = num_sockets;
+        }
+        else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG(LOG_WARN, "Lost the router: %s\n", strerror(errno));
+            leave_router();
+        }
+    }
+    timer_add(&timers, t, now_ms() + ROUTER_REPORT_MS);
+}
+
+
+/* Start taking clients from the router, if there is one.
+ */
+void join_router() {
+    if(router_path != NULL) {
+        timer_init(&report_timer, report_load);
+        report_load(&report_timer);
+    }
+}
+
+
+/* Take on the client on fd that the router handed over with h, as a new
+ * client that sent the input in h. Return it, or NULL if it could not be
+ * watched.
+ */
+struct client *adopt_client(int fd, const struct handoff *h, struct client **new_players) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if(getpeername(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    if(ev_add(loop, fd, EV_READ) < 0) {
+        perror("set up client socket");
+        close(fd);
+        return NULL;
+    }
+    LOG(LOG_INFO, "Connection from %s through the router\n", inet_ntoa(addr.sin_addr));
+    struct client *p = add_player(new_players, fd, addr.sin_addr);
+    metric_add(stats, M_ACCEPTED, 1);
+    // the router greeted the client and settled its mode
+    p->mode = h->mode;
+    memcpy(p->inbuf, h->data, h->len);
+    p->in_end = h->len;
+    return p;
+}
+
+
+/* Receive the next client from the router into *h. Return its socket, or
+ * -1 if there is none for now. A router that went away is left.
+ */
+int next_handoff(struct handoff *h) {
+    while(routerfd >= 0) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {h, sizeof(*h)};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(routerfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return -1;
+        }
+        if(n <= 0) {
+            LOG(LOG_WARN, "Lost the router\n");
+            leave_router();
+            return -1;
+        }
+        int fd = -1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        if(fd >= 0 && (size_t)n >= HANDOFF_SIZE(0) && h->len < MAX_BUF
+           && (size_t)n == HANDOFF_SIZE(h->len)
+           && (h->mode == MODE_TEXT || h->mode == MODE_BINARY)) {
+            return fd;
+        }
+        LOG(LOG_WARN, "Dropped a malformed handoff from the router\n");
+        if(fd >= 0) {
+            close(fd);
+        }
+    }
+    return -1;
+}
+
+
+/* Take on every client the router has handed over and handle the input
+ * it came with.
+ */
+void take_handoffs(struct game_state *game, struct client **new_players) {
+    struct handoff h;
+    int fd;
+    while((fd = next_handoff(&h)) >= 0) {
+        struct client *p = adopt_client(fd, &h, new_players);
+        if(p != NULL) {
+            handle_input(p, game, new_players);
+            reap_clients(game, new_players);
+        }
+    }
+}
+
+
+/* io_uring requests in flight for p keep it alive; free a removed client
+ * once the last one has completed.
+ */
+void uring_op_done(struct client *p) {
+    p->inflight--;
+    if(p->zombie && p->inflight == 0) {
+        release_client(p);
+    }
+}
+
+
+/* Start a multishot accept on listenfd. Every connection it accepts
+ * completes separately, so it only has to be armed again when the kernel
+ * ends it.
+ */
+void uring_arm_accept(int listenfd) {
+    if(freezing) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe == NULL) {
+        fprintf(stderr, "io_uring: no room to accept\n");
+        exit(1);
+    }
+    uring_prep_accept(sqe, listenfd, UD_ACCEPT);
+    accept_armed = 1;
+}
+
+
+/* Start a multishot receive into the provided buffers for p.
+ */
+void uring_arm_recv(struct client *p) {
+    if(freezing) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe == NULL) {
+        drop_client(p);
+        return;
+    }
+    uring_prep_recv(sqe, p->fd, (uintptr_t)p | UD_RECV);
+    p->inflight++;
+}
+
+
+void uring_accepted(int listenfd, struct io_uring_cqe *cqe, struct client **new_players) {
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        accept_armed = 0;
+        uring_arm_accept(listenfd);
+    }
+    if(cqe->res == -EMFILE || cqe->res == -ENFILE) {
+        // the kernel cannot make progress either; shed what is waiting
+        handle_connection(listenfd, new_players);
+        return;
+    }
+    if(cqe->res < 0) {
+        if(cqe->res != -ECONNABORTED && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("accept");
+        }
+        return;
+    }
+    LOG(LOG_DEBUG, "A new client is connecting\n");
+    struct sockaddr_in q;
+    socklen_t len = sizeof(q);
+    if(getpeername(cqe->res, (struct sockaddr *)&q, &len) < 0) {
+        perror("getpeername");
+        close(cqe->res);
+        return;
+    }
+    new_client(cqe->res, q.sin_addr, new_players);
+}
+
+
+/* Hand the data received for p to the line parser. A buffer may hold more
+ * than fits in p->inbuf, so it is fed in pieces.
+ */
+void uring_received(struct client *p, struct io_uring_cqe *cqe,
+                    struct game_state *game, struct client **new_players) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = uring_buf(ring, bid);
+        int n = cqe->res;
+        while(n > 0 && !p->zombie && !p->closing) {
+            int size_left;
+            char *space = input_space(p, &size_left);
+            int chunk = n < size_left ? n : size_left;
+            memcpy(space, data, chunk);
+            data += chunk;
+            n -= chunk;
+            got_input(p, chunk);
+            handle_input(p, game, new_players);
+        }
+        uring_recycle_buf(ring, bid);
+    }
+
+    if(!p->zombie && !p->closing) {
+        if(cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS
+                             && cqe->res != -ECANCELED)) {
+            // closed by the client, or a problem with the socket
+            LOG(LOG_DEBUG, "[%d] Read %d bytes\n", p->fd, cqe->res);
+            drop_client(p);
+        }
+        else if(!more) {
+            // out of buffers, or the kernel ended the receive for another
+            // reason; start another
+            uring_arm_recv(p);
+        }
+    }
+    if(!more) {
+        uring_op_done(p);
+    }
+}
+
+
+void uring_sent(struct client *p, struct io_uring_cqe *cqe) {
+    p->sending = 0;
+    // a write cancelled for an upgrade wrote nothing; it is still queued
+    if(!p->zombie && !p->closing && cqe->res != -ECANCELED) {
+        if(cqe->res < 0) {
+            errno = -cqe->res;
+            perror("write");
+            metric_add(stats, M_WRITE_ERRORS, 1);
+            drop_client(p);
+        }
+        else {
+            outq_consume(&p->out, cqe->res);
+            metric_add(stats, M_BYTES_OUT, cqe->res);
+            if(p->out.len > 0) {
+                metric_add(stats, M_SHORT_WRITES, 1);
+                // short write; the rest goes out with this iteration's flush
+                mark_dirty(p);
+            }
+            else {
+                p->want_write = 0;
+                num_backlogged--;
+            }
+        }
+    }
+    uring_op_done(p);
+}
+
+
+/* Raise the soft limit on open descriptors to the hard limit so that the
+ * number of players is not capped at the default of 1024.
+ */
+void raise_fd_limit() {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
+
+/* Return how long the loop may wait for events, in ms, or -1 to wait
+ * until one arrives: until the next timer is due, and no longer than the
+ * backlog sweep interval while a client is backlogged.
+ */
+int wait_timeout() {
+    long long timeout = timer_next_ms(&timers, now_ms());
+    if(num_backlogged > 0 && (timeout < 0 || timeout > SWEEP_INTERVAL_MS)) {
+        timeout = SWEEP_INTERVAL_MS;
+    }
+    return timeout;
+}
+
+
+/* Work done at the end of every loop iteration, whatever the backend.
+ */
+void end_iteration(struct game_state *game, struct client **new_players,
+                   long long *last_sweep) {
+    if(recording) {
+        rec_tick();
+    }
+    long long now = now_ms();
+    timer_run(&timers, now);
+    reap_clients(game, new_players);
+
+    if(num_backlogged > 0 && now - *last_sweep >= SWEEP_INTERVAL_MS) {
+        evict_stalled(game->head, now);
+        evict_stalled(*new_players, now);
+        reap_clients(game, new_players);
+        *last_sweep = now;
+    }
+    else if(replaying) {
+        replay_stalled();
+        reap_clients(game, new_players);
+    }
+
+    // Write everything queued during this iteration, one writev per
+    // client. Clients dropped by a failed write get a goodbye
+    // broadcast, which has to be flushed too.
+    while(dirty_len > 0) {
+        flush_dirty();
+        reap_clients(game, new_players);
+    }
+}
+
+
+/* Return the position of p in list, or UINT32_MAX if it is not there.
+ */
+uint32_t client_index(struct client *list, struct client *p) {
+    uint32_t i = 0;
+    for(struct client *q = list; q != NULL; q = q->next, i++) {
+        if(q == p) {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+
+int count_clients(struct client *list) {
+    int n = 0;
+    for(struct client *p = list; p != NULL; p = p->next) {
+        n++;
+    }
+    return n;
+}
+
+
+/* Save the clients in list, in order, with their sockets, pending input
+ * and output, and deadlines. Bots have no socket.
+ */
+void save_clients(struct snapshot *s, struct client *list) {
+    snap_put_u32(s, count_clients(list));
+    for(struct client *p = list; p != NULL; p = p->next) {
+        snap_put_u32(s, p->bot);
+        if(!p->bot) {
+            snap_put_fd(s, p->fd);
+        }
+        snap_put_u32(s, p->ipaddr.s_addr);
+        snap_put_u32(s, p->mode);
+        snap_put_u32(s, p->skipping);
+        snap_put_u64(s, p->prompted_ns);
+        snap_put(s, &p->played, sizeof(p->played));
+        snap_put_u64(s, timer_pending(&p->idle) ? timer_expiry_ms(&timers, &p->idle) : -1);
+        snap_put_u32(s, strlen(p->name));
+        snap_put(s, p->name, strlen(p->name));
+        snap_put_u32(s, p->in_end - p->in_start);
+        snap_put(s, p->inbuf + p->in_start, p->in_end - p->in_start);
+        snap_put_u32(s, p->out.len);
+        char *out = snap_extend(s, p->out.len);
+        if(out != NULL) {
+            outq_copy(&p->out, out);
+        }
+    }
+}
+
+
+/* Save everything this shard needs to go on in another process: its
+ * listener, its game and its clients.
+ */
+void save_shard(struct snapshot *s, int listenfd, struct game_state *game,
+                struct client *new_players) {
+    snap_put_fd(s, listenfd);
+    snap_put_u32(s, game->len);
+    snap_put(s, game->word, game->len);
+    snap_put_u32(s, game->guessed);
+    snap_put_u32(s, game->guesses_left);
+    snap_put_u64(s, game->rng);
+    snap_put_u64(s, game->rot.key);
+    snap_put_u32(s, game->rot.next);
+    snap_put_u32(s, game->rot.last);
+    snap_put_u32(s, game->rot.swapped);
+    snap_put_u64(s, timer_pending(&game->turn_timer)
+                    ? timer_expiry_ms(&timers, &game->turn_timer) : -1);
+    snap_put_u32(s, client_index(game->head, game->turn_player));
+    snap_put_u32(s, client_index(game->head, game->has_next_turn));
+    save_clients(s, game->head);
+    save_clients(s, new_players);
+}
+
+
+/* Rebuild the clients saved by save_clients at the end of the list *top.
+ * Their sockets are not watched yet. Return 0 on success and -1 if the
+ * snapshot is damaged.
+ */
+int restore_clients(struct snapshot *s, struct client **top) {
+    uint32_t n = snap_get_u32(s);
+    while(*top != NULL) {
+        top = &(*top)->next;
+    }
+    for(uint32_t i = 0; i < n && !s->bad; i++) {
+        int bot = snap_get_u32(s);
+        int fd = bot ? -1 : snap_get_fd(s);
+        struct in_addr addr;
+        addr.s_addr = snap_get_u32(s);
+        if(s->bad) {
+            return -1;
+        }
+        struct client *p = bot ? add_bot(top) : add_player(top, fd, addr);
+        top = &p->next;
+        p->mode = snap_get_u32(s);
+        p->skipping = snap_get_u32(s);
+        p->prompted_ns = snap_get_u64(s);
+        snap_get(s, &p->played, sizeof(p->played));
+        long long idle = snap_get_u64(s);
+        uint32_t name_len = snap_get_u32(s);
+        if(name_len >= MAX_NAME) {
+            return -1;
+        }
+        snap_get(s, p->name, name_len);
+        p->name[name_len] = '\0';
+        uint32_t in_len = snap_get_u32(s);
+        if(in_len >= MAX_BUF) {
+            return -1;
+        }
+        snap_get(s, p->inbuf, in_len);
+        p->in_end = in_len;
+        uint32_t out_len = snap_get_u32(s);
+        const char *out = snap_view(s, out_len);
+        if(out == NULL || outq_write(&p->out, out, out_len) < 0) {
+            return -1;
+        }
+        if(idle >= 0) {
+            timer_add(&timers, &p->idle, idle);
+        }
+        else {
+            timer_cancel(&timers, &p->idle);
+        }
+    }
+    return s->bad ? -1 : 0;
+}
+
+
+/* Rebuild the game and the clients saved by save_shard, after the
+ * listener, which main has taken already.
+ * Return 0 on success and -1 if the snapshot is damaged.
+ */
+int restore_shard(struct snapshot *s, struct game_state *game, struct client **new_players) {
+    char word[MAX_WORD];
+    uint32_t len = snap_get_u32(s);
+    if(len >= MAX_WORD) {
+        return -1;
+    }
+    snap_get(s, word, len);
+    uint32_t guessed = snap_get_u32(s);
+    int guesses_left = snap_get_u32(s);
+    game->rng = snap_get_u64(s);
+    game->rot.key = snap_get_u64(s);
+    game->rot.next = snap_get_u32(s);
+    game->rot.last = snap_get_u32(s);
+    game->rot.swapped = snap_get_u32(s);
+    long long turn_deadline = snap_get_u64(s);
+    uint32_t turn_player = snap_get_u32(s);
+    uint32_t next_turn = snap_get_u32(s);
+    if(s->bad || resume_game(game, word, len, guessed, guesses_left) < 0) {
+        return -1;
+    }
+    // the rotation goes on through the word list this process loaded
+    const struct lexicon *lex = lexicon_enter(shard_id);
+    lexicon_generation = lex->generation;
+    lexicon_exit(shard_id);
+
+    if(restore_clients(s, &game->head) < 0 || restore_clients(s, new_players) < 0) {
+        return -1;
+    }
+    uint32_t i = 0;
+    for(struct client *p = game->head; p != NULL; p = p->next, i++) {
+        p->in_game = 1;
+        if(i == next_turn) {
+            game->has_next_turn = p;
+        }
+        if(i == turn_player && turn_deadline >= 0) {
+            game->turn_player = p;
+            timer_add(&timers, &game->turn_timer, turn_deadline);
+        }
+    }
+    return 0;
+}
+
+
+/* Watch the sockets of every client again, after an upgrade handed them
+ * over or one was called off, and send what they are still owed.
+ */
+void watch_clients(struct game_state *game, struct client **new_players) {
+    struct client *lists[2] = {game->head, *new_players};
+    for(int i = 0; i < 2; i++) {
+        for(struct client *p = lists[i]; p != NULL; p = p->next) {
+            if(p->bot) {
+                continue;
+            }
+            if(ring != NULL) {
+                uring_arm_recv(p);
+            }
+            else if(ev_add(loop, p->fd, EV_READ) < 0) {
+                perror("ev_add");
+                drop_client(p);
+                continue;
+            }
+            if(p->out.len > 0) {
+                mark_dirty(p);
+            }
+        }
+    }
+    while(dirty_len > 0) {
+        flush_dirty();
+        reap_clients(game, new_players);
+    }
+}
+
+
+/* Cancel every io_uring request pending on fd.
+ */
+void uring_cancel(int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe != NULL) {
+        uring_prep_cancel_fd(sqe, fd, UD_CANCEL);
+    }
+}
+
+
+/* Start stopping this shard for an upgrade. With io_uring the requests in
+ * flight have to end first, so the accept and every client's requests are
+ * cancelled, and no new ones are started.
+ */
+void begin_freeze(int listenfd, struct game_state *game, struct client *new_players) {
+    freezing = 1;
+    if(ring == NULL) {
+        return;
+    }
+    uring_cancel(listenfd);
+    struct client *lists[2] = {game->head, new_players};
+    for(int i = 0; i < 2; i++) {
+        for(struct client *p = lists[i]; p != NULL; p = p->next) {
+            if(p->inflight > 0) {
+                uring_cancel(p->fd);
+            }
+        }
+    }
+}
+
+
+/* Return 1 if no io_uring request is pending for the listener or a client.
+ */
+int uring_idle(struct game_state *game, struct client *new_players) {
+    if(accept_armed) {
+        return 0;
+    }
+    struct client *lists[2] = {game->head, new_players};
+    for(int i = 0; i < 2; i++) {
+        for(struct client *p = lists[i]; p != NULL; p = p->next) {
+            if(p->inflight > 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/* Called at the end of every loop iteration while freezing: once nothing
+ * is in flight, hand the shard's state to the upgrade and wait. If the
+ * upgrade is called off, go on where the shard stopped.
+ */
+void freeze_shard(struct shard *sh, struct game_state *game, struct client **new_players) {
+    if(ring != NULL && !uring_idle(game, *new_players)) {
+        return;
+    }
+    save_shard(upgrade_snapshot(sh->id), sh->listenfd, game, *new_players);
+    upgrade_park(sh->id);
+
+    // still here, so the old process carries on
+    freezing = 0;
+    if(ring != NULL) {
+        uring_arm_accept(sh->listenfd);
+        watch_clients(game, new_players);
+    }
+}
+
+
+/* Start a multishot receive on the socket that asks this shard to stop
+ * for an upgrade.
+ */
+void uring_arm_wake(int shard) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if(sqe == NULL) {
+        fprintf(stderr, "io_uring: no room to watch for upgrades\n");
+        exit(1);
+    }
+    uring_prep_recv(sqe, upgrade_wake_fd(shard), UD_WAKE);
+}
+
+
+void uring_woken(struct shard *sh, struct io_uring_cqe *cqe,
+                 struct game_state *game, struct client *new_players) {
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        uring_recycle_buf(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_wake(sh->id);
+    }
+    if(cqe->res > 0 && !freezing) {
+        begin_freeze(sh->listenfd, game, new_players);
+    }
+}
+
+
+/* Run shard sh on io_uring. Accepts and receives are multishot requests
+ * that stay armed, and everything prepared while handling one batch of
+ * completions is submitted with the wait for the next batch, in a single
+ * io_uring_enter. Falls back to returning (so the caller uses epoll) if
+ * the kernel lacks what is needed; otherwise this never returns.
+ */
+void run_uring(struct shard *sh, struct game_state *game, struct client **new_players) {
+    static __thread struct uring r;
+    if(uring_init(&r, URING_ENTRIES, URING_NUM_BUFS, URING_BUF_SIZE) < 0) {
+        fprintf(stderr, "Shard %d: io_uring unavailable (%s), using epoll\n",
+                sh->id, strerror(errno));
+        sh->backend = EV_BACKEND_EPOLL;
+        return;
+    }
+    iov_pool = malloc(URING_IOV_POOL * sizeof(struct iovec));
+    if(iov_pool == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    ring = &r;
+    uring_arm_accept(sh->listenfd);
+    uring_arm_wake(sh->id);
+    if(sh->restore != NULL) {
+        watch_clients(game, new_players);
+        snap_free(sh->restore);
+        sh->restore = NULL;
+    }
+
+    long long last_sweep = now_ms();
+    while(1) {
+        int timeout = wait_timeout();
+        if(uring_submit(ring, 1, timeout) < 0) {
+            perror("io_uring_enter");
+        }
+        iov_used = 0;
+        long long start = now_ns();
+
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(ring)) != NULL) {
+            struct client *p = UD_CLIENT(cqe->user_data);
+            switch(UD_KIND(cqe->user_data)) {
+            case UD_ACCEPT:
+                uring_accepted(sh->listenfd, cqe, new_players);
+                break;
+            case UD_RECV:
+                uring_received(p, cqe, game, new_players);
+                break;
+            case UD_SEND:
+                uring_sent(p, cqe);
+                break;
+            case UD_WAKE:
+                uring_woken(sh, cqe, game, *new_players);
+                break;
+            }
+            uring_cqe_seen(ring);
+            reap_clients(game, new_players);
+        }
+
+        end_iteration(game, new_players, &last_sweep);
+        metric_record(stats, H_LOOP, now_ns() - start);
+        if(freezing) {
+            freeze_shard(sh, game, new_players);
+        }
+    }
+}
+
+
+/* Pin the calling thread, the what numbered id, to cpu unless it is -1.
+ */
+void pin_to_cpu(const char *what, int id, int cpu) {
+    if(cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(err != 0) {
+            fprintf(stderr, "%s %d: cannot pin to CPU %d: %s\n",
+                    what, id, cpu, strerror(err));
+        }
+    }
+}
+
+
+/* Set up what every thread that keeps clients or games needs: its
+ * metrics, deadlines, reserve descriptor and client slots.
+ */
+void init_thread(struct metrics *metrics) {
+    stats = metrics;
+    timer_wheel_init(&timers, now_ms(), TIMER_TICK_MS);
+    if(take_reserve_fd() < 0) {
+        perror("open /dev/null");
+    }
+    if(pool_init(&client_pool, sizeof(struct client), client_slots) < 0) {
+        perror("pool_init");
+        exit(1);
+    }
+    publish_pool();
+}
+
+
+/* Initialize game, with nobody in it yet, to pick words using seed.
+ */
+void init_game_state(struct game_state *game, uint64_t seed) {
+    game->rng = seed;
+
+    // head and has_next_turn also don't change when a subsequent game is
+    // started so we initialize them here.
+    game->head = NULL;
+    game->has_next_turn = NULL;
+    timer_init(&game->turn_timer, turn_expired);
+    game->turn_player = NULL;
+    bots_game = game;
+}
+
+
+/* Recording: move the shard's clock to the present. It then stays put
+ * while one batch of events is handled, so that the events are recorded
+ * at the very times the game saw.
+ */
+void tick_clock(void) {
+    if(recording) {
+        clock_frozen_ns = real_now_ns();
+    }
+}
+
+
+/* Play the recording in replay through the shard's game, setting the
+ * clock to each event's time, and print what was replayed. With
+ * replay_realtime, wait until each event is due. This never returns.
+ */
+void run_replay(struct game_state *game, struct client **new_players) {
+    struct rec_event e;
+    unsigned long long events = 0, accepts = 0, bytes_in = 0, mismatches = 0;
+    long long first_ns = replay.ns;
+    long long start = real_now_ns();
+    long long last_sweep = now_ms();
+    int status;
+    while((status = rec_next(&replay, &e)) == 1) {
+        if(replay_realtime) {
+            long long wait = (e.ns - first_ns) - (real_now_ns() - start);
+            if(wait > 0) {
+                struct timespec ts = {wait / 1000000000, wait % 1000000000};
+                nanosleep(&ts, NULL);
+            }
+        }
+        clock_frozen_ns = e.ns;
+        events++;
+
+        struct client *p = e.fd >= 0 && e.fd < fd_table_len ? fd_table[e.fd] : NULL;
+        int size_left;
+        switch(e.type) {
+        case REC_ACCEPT:
+            if(p != NULL) {
+                mismatches++;
+                break;
+            }
+            new_client(e.fd, e.addr, new_players);
+            accepts++;
+            break;
+        case REC_READ:
+            if(p == NULL || p->closing) {
+                mismatches++;
+                break;
+            }
+            char *space = input_space(p, &size_left);
+            if(e.len > size_left) {
+                mismatches++;
+                break;
+            }
+            memcpy(space, e.data, e.len);
+            got_input(p, e.len);
+            handle_input(p, game, new_players);
+            bytes_in += e.len;
+            break;
+        case REC_CLOSE:
+            if(p == NULL) {
+                mismatches++;
+                break;
+            }
+            drop_client(p);
+            break;
+        case REC_TICK:
+            end_iteration(game, new_players, &last_sweep);
+            break;
+        case REC_EVICT:
+            // a write that failed after the socket drained, outside any
+            // other event
+            if(p == NULL) {
+                mismatches++;
+                break;
+            }
+            replay_evictions++;
+            drop_client(p);
+            break;
+        }
+        reap_clients(game, new_players);
+    }
+
+    double wall = (real_now_ns() - start) / 1e9;
+    printf("Replayed %llu events: %llu connections, %llu bytes in, %llu bytes out\n",
+           events, accepts, bytes_in, replay_bytes_out);
+    printf("Recorded over %.3f s, replayed in %.3f s (%.0f events/s)\n",
+           (replay.ns - first_ns) / 1e9, wall, wall > 0 ? events / wall : 0.0);
+    printf("%llu clients evicted, output digest %016llx\n",
+           replay_evictions, (unsigned long long)replay_digest);
+    if(mismatches > 0) {
+        printf("%llu events did not fit the replayed game\n", mismatches);
+    }
+    if(status < 0) {
+        printf("The recording ends in the middle of an event\n");
+    }
+    exit(mismatches > 0 ? 1 : 0);
+}
+
+
+/* Run the event loop of shard sh. This never returns.
+ */
+void *run_shard(void *arg) {
+    struct shard *sh = arg;
+    int listenfd = sh->listenfd;
+
+    pin_to_cpu("Shard", sh->id, sh->cpu);
+    shard_id = sh->id;
+    init_thread(sh->metrics);
+
+    // Create and initialize the game state
+    struct game_state game;
+    init_game_state(&game, sh->seed);
+
+    /* A list of client who have not yet entered their name.  This list is
+     * kept separate from the list of active players in the game, because
+     * until the new playrs have entered a name, they should not have a turn
+     * or receive broadcast messages.  In other words, they can't play until
+     * they have a name.
+     */
+    struct client *new_players = NULL;
+
+    // after an upgrade, go on with the game the old process was playing
+    if(sh->restore != NULL) {
+        if(restore_shard(sh->restore, &game, &new_players) < 0) {
+            fprintf(stderr, "Shard %d: the state handed over is damaged\n", sh->id);
+            exit(1);
+        }
+        LOG(LOG_INFO, "Shard %d took over %d players and %d new clients\n", sh->id,
+            count_clients(game.head), count_clients(new_players));
+    }
+    else {
+        start_game(&game);
+        add_bots(&game);
+    }
+
+    if(sh->backend == EV_BACKEND_URING) {
+        run_uring(sh, &game, &new_players);
+    }
+    if(replaying) {
+        run_replay(&game, &new_players);
+    }
+
+    loop = ev_create(sh->backend);
+    if(loop == NULL) {
+        perror("ev_create");
+        exit(1);
+    }
+    // a recording server is not upgraded
+    int wakefd = recording ? -1 : upgrade_wake_fd(sh->id);
+    if(ev_add(loop, listenfd, EV_READ) < 0 || (wakefd >= 0 && ev_add(loop, wakefd, EV_READ) < 0)
+       || (stopfd >= 0 && ev_add(loop, stopfd, EV_READ) < 0)) {
+        perror("ev_add");
+        exit(1);
+    }
+    if(sh->restore != NULL) {
+        watch_clients(&game, &new_players);
+        snap_free(sh->restore);
+        sh->restore = NULL;
+    }
+    join_router();
+
+    struct ev_event events[MAX_EVENTS];
+    long long last_sweep = now_ms();
+    while (1) {
+        // wake up periodically to look for stalled clients while any
+        // client has output queued
+        tick_clock();
+        int timeout = wait_timeout();
+        int nready = ev_wait(loop, events, MAX_EVENTS, timeout);
+        if (nready == -1) {
+            if(errno != EINTR) {
+                perror("ev_wait");
+            }
+            continue;
+        }
+        long long start = real_now_ns();
+        tick_clock();
+
+        /* Each ready descriptor is looked up in fd_table. A client removed
+         * while handling an earlier event has its entry cleared, so a later
+         * event for it in the same batch is skipped. New connections are
+         * accepted after the batch so that a descriptor closed above cannot
+         * be reused by a new client while stale events for it are pending.
          */
-        int cur_fd;
-        for(cur_fd = 0; cur_fd <= maxfd; cur_fd++) {
-            if(FD_ISSET(cur_fd, &rset)) {
-                // Check if this socket descriptor is an active player
-                for(p = game.head; p != NULL;) {
-                    struct client *next = p->next;
-                    if(cur_fd == p->fd) {                  
-                        int finished_reading = read_from(p, &game, &new_players, 1);                        
-                    
-                        if(finished_reading){
-                            // check whether input from p is valid
-                            int is_valid = is_valid_input(p, &game); 
-                            if(is_valid == 1){
-                                // client's guess is valid, modify game
-                                char guess = p->inbuf[0];
-
-                                char* found = strchr(game.word, guess);
-                                if(found == NULL){
-                                    // if letter does not appear in the word
-                                    game.guesses_left -= 1;
-
-                                    // add guess to guess list
-                                    for(int i = 0; i < NUM_LETTERS; i++){
-                                        if(game.letters_guessed[i] == 0){
-                                            game.letters_guessed[i] = guess;
-                                            break;
-                                        }
-                                    }                    
-
-                                    printf("Letter %c is not in the word\n", guess);                
-
-                                    // inform client that guess is incorrect
-                                    char msg[MAX_BUF];
-
-                                    strncpy(msg, &guess, 1);
-                                    msg[1] = '\0';
-
-                                    char not_in[] = " is not in the word.\r\n";
-                                    int len = strlen(not_in);
-                                    strncat(msg, not_in, len);
-
-                                    if (write(p->fd, msg, len + 1) != len + 1) {
-                                        // there is a problem with socket
-                                        help_disconnect(p, &game);
-                                    }
-                                    process_guess(p, &game, argv[1], 0, guess);                                                                          
-                                }
-                                else{
-                                    // add guess to guess list
-                                    for(int i = 0; i < NUM_LETTERS; i++){
-                                        if(game.letters_guessed[i] == 0){
-                                            game.letters_guessed[i] = guess;
-                                            break;
-                                        }
-                                    }
-
-                                    // uncover letters
-                                    for(int i = 0; i < MAX_WORD; i++){
-                                        if(game.word[i]){
-                                            if(game.word[i] == guess){
-                                                game.guess[i] = guess;
-                                            }
-                                        }
-                                        else{
-                                            break;
-                                        }
-                                    }
-                                    process_guess(p, &game, argv[1], 1, guess);                                        
-                                }
-                            }
-                        }    
-                    }
-                    p = next;
-                }
+        int listener_ready = 0;
+        for(int i = 0; i < nready; i++) {
+            int cur_fd = events[i].fd;
+            if(cur_fd == listenfd) {
+                listener_ready = 1;
+                continue;
+            }
+            if(cur_fd == wakefd) {
+                upgrade_woken(sh->id);
+                // clients already handed over go to the new process too
+                take_handoffs(&game, &new_players);
+                leave_router();
+                begin_freeze(listenfd, &game, new_players);
+                continue;
+            }
+            if(cur_fd == routerfd) {
+                take_handoffs(&game, &new_players);
+                continue;
+            }
+            if(cur_fd == stopfd) {
+                // the recording is written out at exit
+                LOG(LOG_INFO, "Stopped recording\n");
+                exit(0);
+            }
+            struct client *p = cur_fd < fd_table_len ? fd_table[cur_fd] : NULL;
+            if(p == NULL) {
+                continue;
+            }
 
-                // Check if any new players are entering their names
-                for(p = new_players; p != NULL;) {
-                    struct client *next = p->next;
-                    if(cur_fd == p->fd) {
-                        int finished_reading = read_from(p, &game, &new_players, 0);
-
-                        if(finished_reading){
-                            int is_valid = 1;
-                            if(strlen(p->inbuf) > MAX_NAME - 1){
-                                is_valid = 0;
-                            }
-                            else if(strlen(p->inbuf) >= 1){
-                                // check whether any active player has this name
-                                for(struct client *q = game.head; q != NULL; q = q->next) {
-                                    if(strcmp(q->name, p->inbuf) == 0){
-                                        is_valid = 0;
-                                        break;
-                                    }
-                                }    
-                            }
-                            else{
-                                // name is invalid because it is an empty string
-                                is_valid = 0;
-                            }
-                            if(is_valid == 1){
-                                // add p to active clients
-                                add_to_game(p, &new_players, &game);
-                            }
-                            else{
-                                // send feedback back to client telling them their name is 
-                                // invalid
-                                char msg[MAX_BUF] = "Unacceptable name. Please enter your name:\r\n";
-                                int len = strlen(msg);
-                                if (write(p->fd, msg, len) != len) {
-                                    // problem with socket
-                                    help_disconnect(p, &game);
-                                }
-                            }
-                        }
-                    } 
-                    p = next;
-                }
+            if(events[i].events & EV_WRITE) {
+                flush_client(p);
+            }
+            if((events[i].events & EV_READ) && !p->closing && read_from(p)) {
+                handle_input(p, &game, &new_players);
+            }
+            reap_clients(&game, &new_players);
+        }
+
+        if(listener_ready) {
+            handle_connection(listenfd, &new_players);
+            reap_clients(&game, &new_players);
+        }
+
+        end_iteration(&game, &new_players, &last_sweep);
+        metric_record(stats, H_LOOP, real_now_ns() - start);
+        if(freezing) {
+            freeze_shard(sh, &game, &new_players);
+        }
+    }
+    return NULL;
+}
+
+
+/* I/O thread: return a free slot on the queue of commands to the game
+ * thread, waiting for the game to make room if it is full. Deliveries are
+ * taken in the meantime, so that a game thread waiting for room on the
+ * other queue can go on.
+ */
+struct command *command_slot(void) {
+    struct command *c;
+    while((c = spsc_slot(&io_self->commands)) == NULL) {
+        bell_ring(&game_bell);
+        take_deliveries();
+        sched_yield();
+    }
+    commands_owed = 1;
+    return c;
+}
+
+
+/* I/O thread: pass the game thread a command of kind about p.
+ */
+void push_command(int kind, struct client *p) {
+    struct command *c = command_slot();
+    c->kind = kind;
+    c->client = p;
+    spsc_push(&io_self->commands);
+}
+
+
+/* I/O thread: pass every full line p has sent to the game thread, stopping
+ * early if p is dropped.
+ */
+void pass_lines(struct client *p) {
+    char *line;
+    int op = 0;
+    while(!p->closing && (line = next_line(p, &op)) != NULL) {
+        struct command *c = command_slot();
+        c->kind = CMD_LINE;
+        c->op = op;
+        c->client = p;
+        strcpy(c->line, line);
+        spsc_push(&io_self->commands);
+    }
+}
+
+
+/* I/O thread: act on everything the game thread delivered.
+ */
+void take_deliveries(void) {
+    struct delivery *d;
+    while((d = spsc_peek(&io_self->deliveries)) != NULL) {
+        struct client *p = d->client;
+        switch(d->kind) {
+        case OUT_MSG:
+            send_msg(p, d->msg);
+            msgbuf_put(d->msg);
+            break;
+        case OUT_TOUCH:
+            touch_client(p);
+            break;
+        case OUT_CLOSE:
+            drop_client(p);
+            break;
+        case OUT_RELEASE:
+            forget_client(p);
+            release_client(p);
+            break;
+        }
+        spsc_pop(&io_self->deliveries);
+    }
+}
+
+
+/* I/O thread: stop watching every client marked by drop_client and tell
+ * the game thread they are gone. Each stays until the game releases it.
+ */
+void hand_over_closing(void) {
+    for(int i = 0; i < closing_len; i++) {
+        struct client *p = closing[i];
+        ev_del(loop, p->fd);
+        p->zombie = 1;
+        push_command(CMD_GONE, p);
+    }
+    closing_len = 0;
+}
+
+
+/* I/O thread: drop clients whose output has not moved for max_backlog_ms.
+ * The clients are not in a list of this thread's, so fd_table is searched.
+ */
+void evict_stalled_fds(long long now) {
+    for(int fd = 0; fd < fd_table_len; fd++) {
+        struct client *p = fd_table[fd];
+        if(p != NULL && p->want_write && now - p->out.since_ms > max_backlog_ms) {
+            LOG(LOG_WARN, "Evicting client %d: output stalled for %lld ms\n",
+                   p->fd, now - p->out.since_ms);
+            drop_client(p);
+        }
+    }
+}
+
+
+/* I/O thread: take on every client the router has handed over, and pass
+ * them and the input they came with to the game thread.
+ */
+void take_io_handoffs(void) {
+    struct handoff h;
+    int fd;
+    while((fd = next_handoff(&h)) >= 0) {
+        struct client *joined = NULL;
+        struct client *p = adopt_client(fd, &h, &joined);
+        if(p != NULL) {
+            push_command(CMD_JOIN, p);
+            pass_lines(p);
+        }
+    }
+}
+
+
+/* Run I/O thread t of pipeline mode. This never returns.
+ */
+void *run_io(void *arg) {
+    struct io_thread *t = arg;
+    io_self = t;
+    pin_to_cpu("I/O thread", t->id, t->cpu);
+    init_thread(t->metrics);
+
+    loop = ev_create(t->backend);
+    if(loop == NULL) {
+        perror("ev_create");
+        exit(1);
+    }
+    if(ev_add(loop, t->listenfd, EV_READ) < 0 || ev_add(loop, t->bell.fd, EV_READ) < 0) {
+        perror("ev_add");
+        exit(1);
+    }
+    join_router();
+
+    struct ev_event events[MAX_EVENTS];
+    long long last_sweep = now_ms();
+    while(1) {
+        int timeout = wait_timeout();
+        bell_arm(&t->bell);
+        if(!spsc_drained(&t->deliveries)) {
+            timeout = 0;
+        }
+        int nready = ev_wait(loop, events, MAX_EVENTS, timeout);
+        int rung = 0;
+        for(int i = 0; i < nready; i++) {
+            rung |= events[i].fd == t->bell.fd;
+        }
+        bell_disarm(&t->bell, rung);
+        if(nready == -1) {
+            if(errno != EINTR) {
+                perror("ev_wait");
+            }
+            continue;
+        }
+        long long start = now_ns();
+
+        // as in run_shard, new connections wait until the batch is done
+        int listener_ready = 0;
+        for(int i = 0; i < nready; i++) {
+            int cur_fd = events[i].fd;
+            if(cur_fd == t->listenfd) {
+                listener_ready = 1;
+                continue;
+            }
+            if(cur_fd == routerfd) {
+                take_io_handoffs();
+                continue;
+            }
+            struct client *p = cur_fd < fd_table_len ? fd_table[cur_fd] : NULL;
+            if(p == NULL || p->zombie) {
+                continue;
+            }
+            if(events[i].events & EV_WRITE) {
+                flush_client(p);
+            }
+            if((events[i].events & EV_READ) && !p->closing && read_from(p)) {
+                pass_lines(p);
+            }
+        }
+
+        if(listener_ready) {
+            // the game owns a client's next pointer once it has the client
+            struct client *joined = NULL;
+            handle_connection(t->listenfd, &joined);
+            while(joined != NULL) {
+                struct client *p = joined;
+                joined = p->next;
+                push_command(CMD_JOIN, p);
+            }
+        }
+
+        take_deliveries();
+        long long now = now_ms();
+        timer_run(&timers, now);
+        if(num_backlogged > 0 && now - last_sweep >= SWEEP_INTERVAL_MS) {
+            evict_stalled_fds(now);
+            last_sweep = now;
+        }
+        flush_dirty();
+        hand_over_closing();
+        if(commands_owed) {
+            commands_owed = 0;
+            bell_ring(&game_bell);
+        }
+        metric_record(stats, H_LOOP, now_ns() - start);
+    }
+    return NULL;
+}
+
+
+/* Game thread: act on command c from an I/O thread.
+ */
+void run_command(struct command *c, struct game_state *game, struct client **new_players) {
+    struct client *p = c->client;
+    switch(c->kind) {
+    case CMD_JOIN:
+        p->next = *new_players;
+        *new_players = p;
+        break;
+    case CMD_LINE:
+        p->line = c->line;
+        p->op = c->op;
+        handle_line(p, game, new_players);
+        break;
+    case CMD_GONE:
+        if(p->in_game) {
+            help_disconnect(p, game);
+        }
+        else {
+            remove_player(new_players, p->fd);
+        }
+        break;
+    }
+}
+
+
+/* Run the game thread of pipeline mode, which makes no system calls
+ * while there is work: its output goes to the I/O threads' queues and its
+ * log and stats to the threads that write them. It only rings the bell of
+ * an I/O thread that went to sleep, and sleeps itself when every queue is
+ * empty. This never returns.
+ */
+void run_game(struct metrics *metrics, uint64_t seed) {
+    on_game_thread = 1;
+    shard_id = 0;
+    stats = metrics;
+    timer_wheel_init(&timers, now_ms(), TIMER_TICK_MS);
+
+    struct game_state game;
+    init_game_state(&game, seed);
+    start_game(&game);
+    // the game thread makes no clients but the bots
+    if(num_bots > 0 && pool_init(&client_pool, sizeof(struct client), num_bots) < 0) {
+        perror("pool_init");
+        exit(1);
+    }
+    add_bots(&game);
+    struct client *new_players = NULL;
+
+    while(1) {
+        long long start = now_ns();
+        int handled = 0;
+        for(int i = 0; i < num_io_threads; i++) {
+            struct spsc *q = &io_threads[i].commands;
+            struct command *c;
+            for(int n = 0; n < PIPE_BATCH && (c = spsc_peek(q)) != NULL; n++) {
+                run_command(c, &game, &new_players);
+                spsc_pop(q);
+                handled++;
+            }
+        }
+        timer_run(&timers, now_ms());
+        for(int i = 0; i < num_io_threads; i++) {
+            if(io_threads[i].owed) {
+                io_threads[i].owed = 0;
+                bell_ring(&io_threads[i].bell);
+            }
+        }
+        if(handled > 0) {
+            metric_record(stats, H_LOOP, now_ns() - start);
+            continue;
+        }
+
+        bell_arm(&game_bell);
+        int idle = 1;
+        for(int i = 0; i < num_io_threads; i++) {
+            idle &= spsc_drained(&io_threads[i].commands);
+        }
+        int rung = 0;
+        if(idle) {
+            struct pollfd pfd = {game_bell.fd, POLLIN, 0};
+            rung = poll(&pfd, 1, timer_next_ms(&timers, now_ms())) > 0;
+        }
+        bell_disarm(&game_bell, rung);
+    }
+}
+
+
+/* Make a bell, or exit.
+ */
+void init_bell(struct bell *b) {
+    b->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(b->fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    b->asleep = 0;
+}
+
+
+/* Start pipeline mode: num_io I/O threads, each listening on its own
+ * SO_REUSEPORT listener for server, and the game thread, which is the
+ * calling thread. metrics has a slot for the game thread, then one for
+ * each I/O thread. This never returns.
+ */
+void run_pipeline(int num_io, struct sockaddr_in *server, enum ev_backend backend,
+                  int pin_cpus, long num_cpus, struct metrics *metrics, uint64_t seed) {
+    if(posix_memalign((void **)&io_threads, 64, num_io * sizeof(struct io_thread)) != 0) {
+        fprintf(stderr, "Cannot allocate the I/O threads\n");
+        exit(1);
+    }
+    memset(io_threads, 0, num_io * sizeof(struct io_thread));
+    num_io_threads = num_io;
+    init_bell(&game_bell);
+
+    for(int i = 0; i < num_io; i++) {
+        struct io_thread *t = &io_threads[i];
+        t->id = i;
+        t->cpu = pin_cpus ? (i + 1) % num_cpus : -1;
+        t->backend = backend;
+        t->listenfd = set_up_server_socket(server, listen_backlog, num_io > 1);
+        t->metrics = &metrics[i + 1];
+        init_bell(&t->bell);
+        if(spsc_init(&t->commands, sizeof(struct command), PIPE_COMMANDS) < 0
+           || spsc_init(&t->deliveries, sizeof(struct delivery), PIPE_DELIVERIES) < 0) {
+            fprintf(stderr, "Cannot allocate the queues of the I/O threads\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < num_io; i++) {
+        int err = pthread_create(&io_threads[i].thread, NULL, run_io, &io_threads[i]);
+        if(err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    pin_to_cpu("Game thread", 0, pin_cpus ? 0 : -1);
+    run_game(&metrics[0], seed);
+}
+
+
+int main(int argc, char **argv) {
+    enum ev_backend backend = EV_BACKEND_EPOLL;
+    int num_shards = 1;
+    int num_io = 0;
+    int pin_cpus = 0;
+    int port = PORT;
+    const char *stats_path = NULL;
+    const char *scores_path = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    struct select_policy policy = {0, 0, DIFF_ANY, 0};
+    int opt;
+
+    while((opt = getopt(argc, argv, "b:t:i:cw:W:s:p:q:T:H:I:l:d:fa:k:S:P:R:r:y:YL:")) != -1) {
+        switch(opt) {
+        case 'b':
+            if(ev_parse_backend(optarg, &backend) < 0) {
+                fprintf(stderr, "Unknown event backend %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            num_shards = strtol(optarg, NULL, 10);
+            if(num_shards < 1) {
+                fprintf(stderr, "The number of threads must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'i':
+            num_io = strtol(optarg, NULL, 10);
+            if(num_io < 1) {
+                fprintf(stderr, "The number of I/O threads must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'c':
+            pin_cpus = 1;
+            break;
+        case 'w':
+            max_backlog_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'W':
+            max_backlog_ms = strtoll(optarg, NULL, 10) * 1000;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            turn_timeout_ms = strtoll(optarg, NULL, 10) * 1000;
+            break;
+        case 'H':
+            handshake_timeout_ms = strtoll(optarg, NULL, 10) * 1000;
+            break;
+        case 'I':
+            idle_timeout_ms = strtoll(optarg, NULL, 10) * 1000;
+            break;
+        case 'l':
+            // MIN-MAX, MIN- or -MAX
+            policy.min_len = strtol(optarg, NULL, 10);
+            if(strchr(optarg, '-') != NULL) {
+                policy.max_len = strtol(strchr(optarg, '-') + 1, NULL, 10);
+            }
+            else {
+                policy.max_len = policy.min_len;
+            }
+            break;
+        case 'd':
+            policy.difficulty = parse_difficulty(optarg);
+            if(policy.difficulty < DIFF_ANY) {
+                fprintf(stderr, "Unknown difficulty %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            policy.weighted = 1;
+            break;
+        case 'q':
+            listen_backlog = strtol(optarg, NULL, 10);
+            if(listen_backlog < 1) {
+                fprintf(stderr, "The listen backlog must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'a':
+            num_bots = strtol(optarg, NULL, 10);
+            if(num_bots < 0) {
+                fprintf(stderr, "The number of bots cannot be negative\n");
+                exit(1);
+            }
+            break;
+        case 'k':
+            bot_skill = strtol(optarg, NULL, 10);
+            if(bot_skill < 0 || bot_skill > 100) {
+                fprintf(stderr, "Bot skill is a percentage, from 0 to 100\n");
+                exit(1);
+            }
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'P':
+            scores_path = optarg;
+            break;
+        case 'R':
+            router_path = optarg;
+            break;
+        case 'r':
+            record_path = optarg;
+            break;
+        case 'y':
+            replay_path = optarg;
+            break;
+        case 'Y':
+            replay_realtime = 1;
+            break;
+        case 'L':
+            log_level = log_parse_level(optarg);
+            if(log_level < 0) {
+                fprintf(stderr, "Unknown log level %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            client_slots = strtol(optarg, NULL, 10);
+            if(client_slots < 1) {
+                fprintf(stderr, "The number of client slots must be positive\n");
+                exit(1);
+            }
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if(optind != argc - 1){
+        fprintf(stderr,"Usage: %s [-b epoll|select|uring] [-t threads | -i I/O threads] [-c]\n"
+                "       [-p port] [-w max backlog bytes] [-W max backlog seconds]\n"
+                "       [-s client slots] [-q listen backlog] [-T turn seconds]\n"
+                "       [-H name seconds] [-I idle seconds] [-l min-max letters]\n"
+                "       [-d easy|medium|hard|any] [-f] [-a bots [-k bot skill %%]]\n"
+                "       [-S stats socket] [-P player stats file] [-R router socket]\n"
+                "       [-r record file | -y replay file [-Y]]\n"
+                "       [-L debug|info|warn|error]\n"
+                "       <dictionary filename>\n"
+                "Send SIGHUP to reload the dictionary, SIGUSR2 to upgrade to a new build\n"
+                "(not with -i, -r or -y).\n",
+                argv[0]);
+        exit(1);
+    }
+    char *dict_name = argv[optind];
+    if(num_io > 0 && (num_shards > 1 || backend == EV_BACKEND_URING)) {
+        fprintf(stderr, "I/O threads run a single game, with epoll or select\n");
+        exit(1);
+    }
+    if(router_path != NULL && backend == EV_BACKEND_URING) {
+        fprintf(stderr, "Clients from a router are taken with epoll or select\n");
+        exit(1);
+    }
+    recording = record_path != NULL;
+    replaying = replay_path != NULL;
+    if((recording || replaying)
+       && (recording == replaying || num_shards > 1 || num_io > 0
+           || backend == EV_BACKEND_URING || router_path != NULL)) {
+        fprintf(stderr, "Either -r or -y, with one thread, epoll or select and no router\n");
+        exit(1);
+    }
+
+    // a replay runs with what the recorded server ran with
+    struct rec_header rec = {0};
+    if(replaying) {
+        if(rec_open(&replay, replay_path, &rec) < 0) {
+            exit(1);
+        }
+        turn_timeout_ms = rec.turn_timeout_ms;
+        handshake_timeout_ms = rec.handshake_timeout_ms;
+        idle_timeout_ms = rec.idle_timeout_ms;
+        policy.min_len = rec.min_len;
+        policy.max_len = rec.max_len;
+        policy.difficulty = rec.difficulty;
+        policy.weighted = rec.weighted;
+        num_bots = rec.num_bots;
+        bot_skill = rec.bot_skill;
+        // leaderboards would come from today's file, not the recorded one
+        scores_path = NULL;
+    }
+
+    // Add the following code to main in wordsrv.c:
+    struct sigaction sa;
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }    
+    raise_fd_limit();
+    
+    // Load the dictionary outside of init_game because we want to
+    // pick every new word from the same mapping, until a reload
+    struct lexicon *lex = lexicon_load(dict_name, &policy);
+    if(lex == NULL) {
+        exit(1);
+    }
+    if(replaying && rec.num_words != lex->dict.size) {
+        fprintf(stderr, "%s was recorded with a list of %u words, not %u\n",
+                replay_path, rec.num_words, (unsigned)lex->dict.size);
+        exit(1);
+    }
+
+    // started by an upgrade: take over the old process's sockets and games
+    struct snapshot *inherited;
+    int upgraded = num_io > 0 || recording || replaying
+                   ? 0 : upgrade_inherit(num_shards, &inherited);
+    if(upgraded < 0) {
+        exit(1);
+    }
+
+    struct shard *shards = calloc(num_shards, sizeof(struct shard));
+    if(shards == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_cpus < 1) {
+        num_cpus = 1;
+    }
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+
+    // Each shard's metrics sit on their own cache lines; in pipeline mode
+    // the game thread's come first, then each I/O thread's
+    int num_series = num_io > 0 ? num_io + 1 : num_shards;
+    struct metrics *metrics;
+    if(posix_memalign((void **)&metrics, 64, num_series * sizeof(struct metrics)) != 0) {
+        fprintf(stderr, "Cannot allocate metrics\n");
+        exit(1);
+    }
+    memset(metrics, 0, num_series * sizeof(struct metrics));
+
+    if(num_io > 0) {
+        // a game spread over threads is not handed to a new build
+        if(sigaction(SIGUSR2, &sa, NULL) == -1) {
+            perror("sigaction");
+            exit(1);
+        }
+        LOG(LOG_INFO, "Using the %s event backend with %d I/O thread%s and a game thread\n",
+            ev_backend_name(backend), num_io, num_io == 1 ? "" : "s");
+        if(lexicon_start(lex, dict_name, &policy, 1) < 0
+           || metrics_start(metrics, num_series, stats_path) < 0 || log_start() < 0
+           || scores_start(scores_path) < 0) {
+            exit(1);
+        }
+        run_pipeline(num_io, init_server_addr(port), backend, pin_cpus, num_cpus,
+                     metrics, seed);
+    }
+
+    // Every shard gets its own listener on the same port and the kernel
+    // spreads new connections between them
+    struct sockaddr_in *server = init_server_addr(port);
+    for(int i = 0; i < num_shards; i++) {
+        struct shard *sh = &shards[i];
+        sh->id = i;
+        sh->cpu = pin_cpus ? i % num_cpus : -1;
+        sh->backend = backend;
+        sh->seed = seed + i * 0x9e3779b97f4a7c15ULL;
+        sh->metrics = &metrics[i];
+        if(upgraded) {
+            sh->restore = &inherited[i];
+            sh->listenfd = snap_get_fd(sh->restore);
+            if(sh->listenfd < 0) {
+                fprintf(stderr, "Shard %d: the state handed over is damaged\n", i);
+                exit(1);
             }
         }
+        else if(replaying) {
+            sh->listenfd = -1;
+        }
+        else {
+            sh->listenfd = set_up_server_socket(server, listen_backlog, num_shards > 1);
+        }
+    }
+    if(upgraded) {
+        if(upgrade_finish() < 0) {
+            exit(1);
+        }
+        LOG(LOG_INFO, "Took over from the previous process\n");
+    }
+    LOG(LOG_INFO, "Using the %s event backend with %d thread%s\n", ev_backend_name(backend),
+           num_shards, num_shards == 1 ? "" : "s");
+
+    // a recording server stops at the end of a loop iteration, so that
+    // the recording ends with a whole event
+    if(recording) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        stopfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if(stopfd < 0) {
+            perror("signalfd");
+            exit(1);
+        }
+    }
+
+    // before any shard thread exists, so they all inherit SIGHUP, SIGUSR1
+    // and SIGUSR2 blocked
+    if(lexicon_start(lex, dict_name, &policy, num_shards) < 0) {
+        exit(1);
+    }
+    if(recording || replaying) {
+        // the recording holds no upgrade, so there is none
+        if(sigaction(SIGUSR2, &sa, NULL) == -1) {
+            perror("sigaction");
+            exit(1);
+        }
+    }
+    else if(upgrade_start(argv, num_shards) < 0) {
+        exit(1);
+    }
+    if(metrics_start(metrics, num_shards, stats_path) < 0 || log_start() < 0
+       || scores_start(scores_path) < 0) {
+        exit(1);
+    }
+
+    // the shard's clock starts where the recording does, and then only
+    // moves with the events
+    if(recording) {
+        rec.magic = REC_MAGIC;
+        rec.version = REC_VERSION;
+        rec.seed = shards[0].seed;
+        rec.start_ns = real_now_ns();
+        rec.turn_timeout_ms = turn_timeout_ms;
+        rec.handshake_timeout_ms = handshake_timeout_ms;
+        rec.idle_timeout_ms = idle_timeout_ms;
+        rec.min_len = policy.min_len;
+        rec.max_len = policy.max_len;
+        rec.difficulty = policy.difficulty;
+        rec.weighted = policy.weighted;
+        rec.num_words = lex->dict.size;
+        rec.num_bots = num_bots;
+        rec.bot_skill = bot_skill;
+        if(rec_start(record_path, &rec) < 0) {
+            exit(1);
+        }
+    }
+    if(replaying) {
+        shards[0].seed = rec.seed;
+    }
+    if(recording || replaying) {
+        clock_frozen_ns = rec.start_ns;
+    }
+
+    for(int i = 1; i < num_shards; i++) {
+        int err = pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]);
+        if(err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
     }
+    // the main thread runs the first shard
+    run_shard(&shards[0]);
     return 0;
 }